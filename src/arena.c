@@ -0,0 +1,119 @@
+/*
+ * arena.c
+ * bump allocator for memory that lives exactly as long as one file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/* every allocation is aligned well enough for any of the tiff value types */
+#define ARENA_ALIGN 16
+
+/* chunk headers are padded so the first allocation is aligned too */
+#define CHUNK_HEADER ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_init(arena_t* a, size_t chunk_size)
+{
+    a->head = NULL;
+    a->cur = NULL;
+    a->chunk_size = chunk_size;
+}
+
+/*
+ * grab a new chunk big enough for at least n bytes and link it in after
+ * the current one
+ */
+static arena_chunk_t* arena_grow(arena_t* a, size_t n)
+{
+    size_t size = (n > a->chunk_size) ? n : a->chunk_size;
+    arena_chunk_t* chunk = (arena_chunk_t*)malloc(CHUNK_HEADER + size);
+    if(!chunk)
+    {
+        fprintf(stderr, "out of memory allocating %lu byte arena chunk\n",
+                (unsigned long)size);
+        exit(EXIT_FAILURE);
+    }
+    chunk->size = size;
+    chunk->used = 0;
+    if(a->cur)
+    {
+        chunk->next = a->cur->next;
+        a->cur->next = chunk;
+    }
+    else
+    {
+        chunk->next = a->head;
+        a->head = chunk;
+    }
+    return chunk;
+}
+
+/*
+ * allocate n bytes. memory is only valid until the next arena_reset.
+ */
+void* arena_alloc(arena_t* a, size_t n)
+{
+    void* p;
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if(!a->cur)
+    {
+        a->cur = a->head ? a->head : arena_grow(a, n);
+        a->cur->used = 0;
+    }
+
+    /* move on to the next retained chunk that fits, or make a new one */
+    while(a->cur->size - a->cur->used < n)
+    {
+        if(a->cur->next)
+        {
+            a->cur = a->cur->next;
+            a->cur->used = 0;
+        }
+        else
+        {
+            a->cur = arena_grow(a, n);
+        }
+    }
+
+    p = (char*)a->cur + CHUNK_HEADER + a->cur->used;
+    a->cur->used += n;
+    return p;
+}
+
+void* arena_calloc(arena_t* a, size_t n)
+{
+    void* p = arena_alloc(a, n);
+    memset(p, 0, n);
+    return p;
+}
+
+/*
+ * release everything allocated since the last reset. the chunks are kept
+ * and reused, and each one's fill mark is cleared lazily as the allocator
+ * reaches it, so this is constant time however much was allocated.
+ */
+void arena_reset(arena_t* a)
+{
+    a->cur = a->head;
+    if(a->cur)
+        a->cur->used = 0;
+}
+
+/*
+ * hand every chunk back to the heap
+ */
+void arena_free(arena_t* a)
+{
+    arena_chunk_t* chunk = a->head;
+    while(chunk)
+    {
+        arena_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->head = NULL;
+    a->cur = NULL;
+}
@@ -0,0 +1,40 @@
+/*
+ * arena.h
+ * bump allocator for memory that lives exactly as long as one file
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* default size of each block the arena grabs from the heap */
+#define ARENA_CHUNK_SIZE 65536
+
+typedef struct arena_chunk
+{
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+} arena_chunk_t;
+
+/*
+ * an arena hands out memory from a list of large chunks. nothing is freed
+ * individually; arena_reset recycles everything at once and keeps the
+ * chunks for the next file, so in steady state tagging an image makes no
+ * heap calls at all.
+ */
+typedef struct
+{
+    arena_chunk_t* head;
+    arena_chunk_t* cur;
+    size_t chunk_size;
+} arena_t;
+
+void arena_init(arena_t* a, size_t chunk_size);
+void* arena_alloc(arena_t* a, size_t n);
+void* arena_calloc(arena_t* a, size_t n);
+void arena_reset(arena_t* a);
+void arena_free(arena_t* a);
+
+#endif
@@ -0,0 +1,398 @@
+/*
+ * bench.c
+ * throughput harness and microbenchmarks for neftag
+ *
+ * usage: neftag_bench [-j jobs] [-n iterations] [-U] gpslog rawfile+
+ *
+ * times parsing the log, tags every file the way neftag does and
+ * reports the rates and per-image i/o, then times the hot functions on
+ * their own. the files are modified just as neftag would modify them.
+ *
+ * bytes and read/write calls come from /proc/self/io, which only counts
+ * the read and write families; reads through a mapping show up as page
+ * faults instead. system calls of every kind, from every thread, are
+ * counted with perf on the raw_syscalls:sys_enter tracepoint, which needs
+ * tracefs mounted and perf_event_paranoid set to -1 (or CAP_PERFMON);
+ * without it they're reported as not counted. -U tags through the
+ * io_uring path, whose reads and writes are only io_uring_enter calls.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../tiff.h"
+#include "../tag.h"
+#include "../track.h"
+#include "../nmea.h"
+#include "../gpx.h"
+#include "../arena.h"
+#include "../pool.h"
+#include "../nikond90.h"
+#include "../types.h"
+
+/* i/o counters for this process, from /proc/self/io and getrusage */
+typedef struct
+{
+    unsigned long long rchar;
+    unsigned long long wchar;
+    unsigned long long syscr;
+    unsigned long long syscw;
+    long minflt;
+    long majflt;
+    long long syscalls;  /* every kind, or -1 if they can't be counted */
+} io_counts_t;
+
+typedef struct
+{
+    tag_config_t* cfg;
+    tag_job_t* jobs;
+    arena_t* arenas;
+} bench_batch_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* perf counter of system calls, opened by open_syscall_counter */
+static int syscall_counter = -1;
+
+/*
+ * start counting every system call this process and the threads it
+ * starts from here on make. leaves syscall_counter at -1 if perf can't
+ * see the tracepoint.
+ */
+static void open_syscall_counter(void)
+{
+    static const char* id_paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+    };
+    struct perf_event_attr attr;
+    unsigned long long id;
+    FILE* fp = NULL;
+    int i;
+
+    for(i=0; i<2 && fp == NULL; ++i)
+        fp = fopen(id_paths[i], "r");
+    if(fp == NULL)
+        return;
+    i = fscanf(fp, "%llu", &id);
+    fclose(fp);
+    if(i != 1)
+        return;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.inherit = 1;   /* pool workers are counted into this one when they exit */
+    syscall_counter = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void read_io(io_counts_t* c)
+{
+    unsigned long long n;
+    char name[32];
+    unsigned long long v;
+    struct rusage ru;
+    FILE* fp;
+
+    memset(c, 0, sizeof(io_counts_t));
+    if((fp = fopen("/proc/self/io", "r")) != NULL)
+    {
+        while(fscanf(fp, "%31[^:]: %llu\n", name, &v) == 2)
+        {
+            if(strcmp(name, "rchar") == 0)
+                c->rchar = v;
+            else if(strcmp(name, "wchar") == 0)
+                c->wchar = v;
+            else if(strcmp(name, "syscr") == 0)
+                c->syscr = v;
+            else if(strcmp(name, "syscw") == 0)
+                c->syscw = v;
+        }
+        fclose(fp);
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    c->minflt = ru.ru_minflt;
+    c->majflt = ru.ru_majflt;
+    c->syscalls = -1;
+    if(syscall_counter >= 0 && read(syscall_counter, &n, sizeof(n)) == sizeof(n))
+        c->syscalls = (long long)n;
+}
+
+static void parse_log(const char* path, track_t* track)
+{
+    FILE* fp;
+
+    if((fp = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    track_init(track, 1024);
+    if(is_gpx_file(fp))
+        parse_gpx_file(fp, track);
+    else
+        parse_nmea_file(fp, track);
+    fclose(fp);
+    track_sort(track);
+}
+
+static void read_one(int worker, int item, void* arg)
+{
+    bench_batch_t* b = (bench_batch_t*)arg;
+    tag_read_time(&b->jobs[item], b->cfg, &b->arenas[worker], NULL);
+}
+
+static void write_one(int worker, int item, void* arg)
+{
+    bench_batch_t* b = (bench_batch_t*)arg;
+    tag_write(&b->jobs[item], b->cfg, &b->arenas[worker], NULL);
+}
+
+/*
+ * time parsing the whole log, best of iters runs
+ */
+static void bench_parse(const char* path, int iters)
+{
+    struct stat st;
+    double best = 0;
+    track_t track;
+    int count = 0;
+    int i;
+
+    stat(path, &st);
+    for(i=0; i<iters; ++i)
+    {
+        double t = now();
+        parse_log(path, &track);
+        t = now() - t;
+        count = track.count;
+        track_free(&track);
+        if(i == 0 || t < best)
+            best = t;
+    }
+    printf("parse      %-28s %10.1f MB/s %12.0f fixes/s  (%d fixes, %.1f MB)\n",
+           strstr(path, ".gpx") ? "parse_gpx_file" : "parse_nmea_file",
+           st.st_size / best / 1e6, count / best, count, st.st_size / 1e6);
+}
+
+/*
+ * tag every file the way main does and report the rates and i/o
+ */
+static void bench_tag(track_t* track, char** paths, int nfiles, int jobs, int use_ring)
+{
+    tag_config_t cfg;
+    bench_batch_t b;
+    io_counts_t before;
+    io_counts_t after;
+    double t;
+    long long bytes = 0;
+    int tagged = 0;
+    int i;
+    struct stat st;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.track = track;
+    cfg.window_size = 3600;
+    cfg.use_nmea_file = 1;
+
+    if(jobs > nfiles)
+        jobs = nfiles;
+    b.cfg = &cfg;
+    b.jobs = (tag_job_t*)calloc(nfiles, sizeof(tag_job_t));
+    b.arenas = (arena_t*)malloc(jobs * sizeof(arena_t));
+    for(i=0; i<nfiles; ++i)
+    {
+        b.jobs[i].path = paths[i];
+        if(stat(paths[i], &st) == 0)
+            bytes += st.st_size;
+    }
+    for(i=0; i<jobs; ++i)
+        arena_init(&b.arenas[i], ARENA_CHUNK_SIZE);
+
+    read_io(&before);
+    t = now();
+    if(!use_ring || !tag_ring(b.jobs, nfiles, &cfg, &b.arenas[0], NULL))
+    {
+        use_ring = 0;
+        pool_run(jobs, nfiles, read_one, &b);
+        tag_match(b.jobs, nfiles, &cfg, NULL);
+        pool_run(jobs, nfiles, write_one, &b);
+    }
+    t = now() - t;
+    read_io(&after);
+
+    for(i=0; i<nfiles; ++i)
+        tagged += (b.jobs[i].status == TAG_OK);
+
+    if(use_ring)
+        printf("tag        %d files (%d tagged), io_uring\n", nfiles, tagged);
+    else
+        printf("tag        %d files (%d tagged), %d jobs\n", nfiles, tagged, jobs);
+    printf("           %10.1f files/s %10.1f MB/s of images\n", nfiles / t, bytes / t / 1e6);
+    printf("           %10.1f bytes read  %10.1f bytes written per image (read/write calls)\n",
+           (double)(after.rchar - before.rchar) / nfiles,
+           (double)(after.wchar - before.wchar) / nfiles);
+    printf("           %10.2f read calls  %10.2f write calls per image (read/write families)\n",
+           (double)(after.syscr - before.syscr) / nfiles,
+           (double)(after.syscw - before.syscw) / nfiles);
+    if(before.syscalls >= 0 && after.syscalls >= 0)
+        printf("           %10.2f system calls per image, of every kind\n",
+               (double)(after.syscalls - before.syscalls) / nfiles);
+    else
+        printf("           system calls not counted; no perf access to raw_syscalls:sys_enter\n");
+    printf("           %10.2f minor       %10.2f major page faults per image (mapped reads)\n",
+           (double)(after.minflt - before.minflt) / nfiles,
+           (double)(after.majflt - before.majflt) / nfiles);
+
+    for(i=0; i<jobs; ++i)
+        arena_free(&b.arenas[i]);
+    free(b.arenas);
+    free(b.jobs);
+}
+
+static void report(const char* name, double secs, long ops)
+{
+    printf("micro      %-28s %10.1f ns/op\n", name, secs / ops * 1e9);
+}
+
+/*
+ * the functions on the hot path, each on its own
+ */
+static void bench_micro(track_t* track, const char* raw)
+{
+    tiff_t tif;
+    ifd_t ifd0;
+    ifd_t gps;
+    direntry_t* dir;
+    arena_t arena;
+    location_t loc;
+    unsigned byte block[GPS_IFD_MAX_SIZE];
+    unsigned int32 gps_offset = 0;
+    long n;
+    long i;
+    double t;
+    int fd;
+    volatile int sink = 0;
+
+    arena_init(&arena, ARENA_CHUNK_SIZE);
+    if((fd = open(raw, O_RDWR)) < 0 || !tiff_map(&tif, fd) || !valid_tiff_file(&tif))
+    {
+        fprintf(stderr, "can't open '%s' for microbenchmarks\n", raw);
+        exit(EXIT_FAILURE);
+    }
+
+    /* ifd_load: index IFD0 */
+    n = 200000;
+    t = now();
+    for(i=0; i<n; ++i)
+    {
+        arena_reset(&arena);
+        sink += ifd_load(&tif, tif.first_ifd, &ifd0, &arena);
+    }
+    report("ifd_load", now() - t, n);
+
+    /* ifd_write: encode a GPS IFD and write it back with tiff_write */
+    dir = ifd_find(&ifd0, GPSInfoIFDPointer);
+    if(dir && direntry_values(&tif, dir, &arena))
+        gps_offset = dir->uint32_values[0];
+    if(gps_offset && ifd_load(&tif, gps_offset, &gps, &arena) && track->count > 0)
+    {
+        track_get(track, track->count / 2, &loc);
+        n = 20000;
+        t = now();
+        for(i=0; i<n; ++i)
+        {
+            unsigned int32 len = gps_ifd_encode(&tif, &loc, gps_offset, gps.next_offset, block);
+            sink += tiff_write(&tif, gps_offset, block, len);
+        }
+        report("gps_ifd_encode+tiff_write", now() - t, n);
+    }
+    tiff_unmap(&tif);
+    close(fd);
+    arena_free(&arena);
+
+    /* find_location_at: random times across the track */
+    if(track->count > 0)
+    {
+        time_t lo = track->when[0] / 1000;
+        time_t span = track->when[track->count-1] / 1000 - lo + 1;
+        time_t* ts;
+        int* matches;
+
+        n = 1000000;
+        ts = (time_t*)malloc(n * sizeof(time_t));
+        matches = (int*)malloc(n * sizeof(int));
+        srand(1);
+        for(i=0; i<n; ++i)
+            ts[i] = lo + rand() % span;
+
+        t = now();
+        for(i=0; i<n; ++i)
+            sink += find_location_at(track, ts[i], 3600);
+        report("find_location_at", now() - t, n);
+
+        t = now();
+        find_locations(track, ts, n, 3600, matches);
+        report("find_locations (per time)", now() - t, n);
+        free(matches);
+        free(ts);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    track_t track;
+    int iters = 5;
+    int jobs = 1;
+    int use_ring = 0;
+    int ch;
+
+    while((ch = getopt(argc, argv, "j:n:U")) != -1)
+    {
+        switch(ch)
+        {
+        case 'j':
+            jobs = atoi(optarg);
+            if(jobs <= 0)
+                jobs = pool_default_threads();
+            break;
+        case 'n':
+            iters = atoi(optarg);
+            if(iters < 1)
+                iters = 1;
+            break;
+        case 'U':
+            use_ring = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: neftag_bench [-j jobs] [-n iterations] [-U] gpslog rawfile+\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if(argc - optind < 2)
+    {
+        fprintf(stderr, "usage: neftag_bench [-j jobs] [-n iterations] [-U] gpslog rawfile+\n");
+        return EXIT_FAILURE;
+    }
+
+    open_syscall_counter();
+    bench_parse(argv[optind], iters);
+    parse_log(argv[optind], &track);
+    bench_tag(&track, argv + optind + 1, argc - optind - 1, jobs, use_ring);
+    bench_micro(&track, argv[optind + 1]);
+    track_free(&track);
+    return EXIT_SUCCESS;
+}
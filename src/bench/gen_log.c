@@ -0,0 +1,157 @@
+/*
+ * gen_log.c
+ * write a synthetic NMEA or GPX track log for benchmarking
+ *
+ * the track wanders around a starting point at walking pace, one fix
+ * per 1/rate seconds, with a GPRMC, GPGGA and GPGSA sentence per fix
+ * (or one <trkpt> for GPX) like a real logger writes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "../tiff.h"
+#include "../types.h"
+
+/*
+ * write an nmea sentence with its checksum: the xor of everything
+ * between the '$' and the '*'
+ */
+static long put_sentence(FILE* fp, const char* body)
+{
+    unsigned char sum = 0;
+    const char* p;
+
+    for(p = body; *p; ++p)
+        sum ^= (unsigned char)*p;
+    return fprintf(fp, "$%s*%02X\r\n", body, sum);
+}
+
+/*
+ * split signed decimal degrees into nmea's dddmm.mmmm and a hemisphere
+ */
+static void to_nmea(double deg, int width, char pos, char neg, char* out, size_t n, char* ref)
+{
+    double a = fabs(deg);
+    int d = (int)a;
+    snprintf(out, n, "%0*d%07.4f", width, d, (a - d) * 60);
+    *ref = deg < 0 ? neg : pos;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: gen_log [-f nmea|gpx] [-n fixes | -s megabytes] [-r fixes_per_sec]\n"
+            "               [-t \"YYYY:MM:DD HH:MM:SS\"] [outfile]\n");
+}
+
+int main(int argc, char** argv)
+{
+    int gpx = 0;
+    long fixes = 3600;
+    long max_bytes = 0;
+    int rate = 1;
+    const char* start = "2009:11:07 05:35:00";
+    double lat = 35.303895;
+    double lon = -89.501393;
+    double alt = 88.5;
+    long written = 0;
+    struct tm tm;
+    time_t t0;
+    FILE* fp = stdout;
+    long i;
+    int ch;
+
+    while((ch = getopt(argc, argv, "f:n:s:r:t:")) != -1)
+    {
+        switch(ch)
+        {
+        case 'f':
+            gpx = (strcmp(optarg, "gpx") == 0);
+            break;
+        case 'n':
+            fixes = atol(optarg);
+            break;
+        case 's':
+            max_bytes = atol(optarg) << 20;
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            if(rate < 1)
+                rate = 1;
+            break;
+        case 't':
+            start = optarg;
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if(optind < argc && (fp = fopen(argv[optind], "w")) == NULL)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    parse_datetime(start, &tm);
+    t0 = timegm(&tm);
+
+    if(gpx)
+        written += fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                           "<gpx version=\"1.0\" creator=\"neftag gen_log\" "
+                           "xmlns=\"http://www.topografix.com/GPX/1/0\">\n<trk>\n<trkseg>\n");
+
+    for(i=0; max_bytes ? written < max_bytes : i < fixes; ++i)
+    {
+        time_t t = t0 + i / rate;
+        int msec = (int)(i % rate) * 1000 / rate;
+        double heading = fmod(i * 0.5, 360.0);
+        double speed = 1.2 + 0.5 * sin(i * 0.01);   /* m/s */
+        struct tm* g = gmtime(&t);
+        char body[160];
+        char slat[16];
+        char slon[16];
+        char lat_ref;
+        char lon_ref;
+
+        /* move along the current heading for one tick */
+        lat += speed / rate * cos(heading * M_PI / 180) / 111320.0;
+        lon += speed / rate * sin(heading * M_PI / 180) / (111320.0 * cos(lat * M_PI / 180));
+        alt += 0.1 * sin(i * 0.003);
+
+        if(gpx)
+        {
+            written += fprintf(fp, "<trkpt lat=\"%.9f\" lon=\"%.9f\">\n"
+                               "  <ele>%.6f</ele>\n"
+                               "  <time>%04d-%02d-%02dT%02d:%02d:%02d.%03dZ</time>\n"
+                               "  <course>%.6f</course>\n"
+                               "  <speed>%.6f</speed>\n"
+                               "  <fix>3d</fix>\n"
+                               "  <sat>8</sat>\n"
+                               "</trkpt>\n",
+                               lat, lon, alt, g->tm_year + 1900, g->tm_mon + 1, g->tm_mday,
+                               g->tm_hour, g->tm_min, g->tm_sec, msec, heading, speed);
+            continue;
+        }
+
+        to_nmea(lat, 2, 'N', 'S', slat, sizeof(slat), &lat_ref);
+        to_nmea(lon, 3, 'E', 'W', slon, sizeof(slon), &lon_ref);
+        snprintf(body, sizeof(body), "GPRMC,%02d%02d%02d.%03d,A,%s,%c,%s,%c,%.2f,%.2f,%02d%02d%02d,,,A",
+                 g->tm_hour, g->tm_min, g->tm_sec, msec, slat, lat_ref, slon, lon_ref,
+                 speed * 3600 / 1852, heading, g->tm_mday, g->tm_mon + 1, g->tm_year % 100);
+        written += put_sentence(fp, body);
+        snprintf(body, sizeof(body), "GPGGA,%02d%02d%02d.%03d,%s,%c,%s,%c,1,08,1.0,%.1f,M,-30.4,M,,0000",
+                 g->tm_hour, g->tm_min, g->tm_sec, msec, slat, lat_ref, slon, lon_ref, alt);
+        written += put_sentence(fp, body);
+        written += put_sentence(fp, "GPGSA,A,3,22,26,31,18,14,09,,,,,,,1.8,1.0,1.5");
+    }
+
+    if(gpx)
+        fprintf(fp, "</trkseg>\n</trk>\n</gpx>\n");
+    if(fp != stdout)
+        fclose(fp);
+    return EXIT_SUCCESS;
+}
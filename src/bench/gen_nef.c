@@ -0,0 +1,254 @@
+/*
+ * gen_nef.c
+ * write synthetic NEF-like tiff files for benchmarking
+ *
+ * each file has the parts of a D90 raw that neftag looks at: an IFD0
+ * with strip pointers, DateTimeOriginal and Exif/GPS pointers, a small
+ * Exif IFD, a reserved GPS IFD, and a run of fake pixel data. files are
+ * stamped one interval apart so they spread across a log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../tiff.h"
+#include "../util.h"
+#include "../nikond90.h"
+#include "../types.h"
+
+#define NUM_STRIPS 40
+#define HEADER_SIZE 4096
+#define GPS_ENTRIES 10
+#define GPS_SLACK 80
+
+/* header bytes taken by each of the -e filler entries, out-of-line value included */
+#define EXTRA_ENTRY_SIZE (12 + 8)
+
+/* an ifd being laid out in the header block */
+typedef struct
+{
+    unsigned byte* buf;
+    int swap;
+    unsigned int32 entry_pos;   /* next directory entry */
+    unsigned int32* data_pos;   /* where out-of-line values go next */
+} layout_t;
+
+static void ifd_begin(layout_t* l, unsigned byte* buf, int swap, unsigned int32 pos,
+                      int count, unsigned int32* data_pos)
+{
+    l->buf = buf;
+    l->swap = swap;
+    l->entry_pos = pos + 2;
+    l->data_pos = data_pos;
+    put_uint16(buf + pos, count, swap);
+    *data_pos = pos + 2 + 12 * count + 4;
+}
+
+/*
+ * add an entry whose values are already in file byte order (or are
+ * bytes). anything over four bytes goes in the data area.
+ */
+static unsigned int32 ifd_entry(layout_t* l, unsigned int16 tag, unsigned int16 type,
+                                unsigned int32 count, const void* values)
+{
+    unsigned int32 size = type_bytes[type] * count;
+    unsigned byte* e = l->buf + l->entry_pos;
+    unsigned int32 where = l->entry_pos + 8;
+
+    put_uint16(e, tag, l->swap);
+    put_uint16(e + 2, type, l->swap);
+    put_uint32(e + 4, count, l->swap);
+    if(size > 4)
+    {
+        where = *l->data_pos;
+        put_uint32(e + 8, where, l->swap);
+        *l->data_pos += size + (size & 1);
+    }
+    if(values)
+        memcpy(l->buf + where, values, size);
+    l->entry_pos += 12;
+    return where;
+}
+
+static void ifd_long(layout_t* l, unsigned int16 tag, unsigned int32 v)
+{
+    unsigned byte b[4];
+    put_uint32(b, v, l->swap);
+    ifd_entry(l, tag, LONG, 1, b);
+}
+
+static void ifd_end(layout_t* l, unsigned int32 next)
+{
+    put_uint32(l->buf + l->entry_pos, next, l->swap);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: gen_nef [-b II|MM] [-n count] [-s pixel_bytes] [-t \"YYYY:MM:DD HH:MM:SS\"]\n"
+            "               [-i interval_secs] [-e extra_entries] [-G] outdir\n\n"
+            "\t-e pads IFD0 with that many more private entries\n"
+            "\t-G leaves out the GPS IFD and IFD0's pointer to it\n");
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int byte_order = HOST_BYTE_ORDER;
+    int count = 100;
+    long pixel_bytes = 1 << 20;
+    const char* start = "2009:11:07 05:36:00";
+    int interval = 10;
+    int with_gps = 1;
+    int extra = 0;
+    unsigned byte* header;
+    unsigned byte* pixels;
+    struct tm tm;
+    time_t t0;
+    int ch;
+    int i;
+
+    while((ch = getopt(argc, argv, "b:n:s:t:i:e:G")) != -1)
+    {
+        switch(ch)
+        {
+        case 'b':
+            byte_order = (strcmp(optarg, "MM") == 0) ? TIFF_BIG_ENDIAN : TIFF_LITTLE_ENDIAN;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            pixel_bytes = atol(optarg);
+            break;
+        case 't':
+            start = optarg;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'e':
+            extra = atoi(optarg);
+            break;
+        case 'G':
+            with_gps = 0;
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if(optind != argc - 1)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    parse_datetime(start, &tm);
+    t0 = timegm(&tm);
+
+    header = (unsigned byte*)malloc(HEADER_SIZE + extra * EXTRA_ENTRY_SIZE);
+    pixels = (unsigned byte*)malloc(pixel_bytes > 0 ? pixel_bytes : 1);
+    for(i=0; i<pixel_bytes; ++i)
+        pixels[i] = (unsigned byte)(i * 7);
+
+    for(i=0; i<count; ++i)
+    {
+        int swap = (byte_order != HOST_BYTE_ORDER);
+        unsigned int32 strips[NUM_STRIPS];
+        unsigned int32 counts[NUM_STRIPS];
+        unsigned int32 data_pos;
+        unsigned int32 exif_pos;
+        unsigned int32 gps_pos;
+        unsigned int32 pixel_pos;
+        unsigned int32 rational[2];
+        char stamp[40];
+        char path[4096];
+        layout_t l;
+        time_t t = t0 + (time_t)i * interval;
+        FILE* fp;
+        int k;
+
+        strftime(stamp, sizeof(stamp), "%Y:%m:%d %H:%M:%S", gmtime(&t));
+        memset(header, 0, HEADER_SIZE + extra * EXTRA_ENTRY_SIZE);
+        memcpy(header, byte_order == TIFF_BIG_ENDIAN ? "MM" : "II", 2);
+        put_uint16(header + 2, 42, swap);
+        put_uint32(header + 4, 8, swap);
+
+        /* sizes first, so the pointers can be filled in as we go */
+        exif_pos = 8 + 2 + 12 * (with_gps ? 12 : 11) + 4 + 18 + 10 + 8 * NUM_STRIPS + 8 + 20 + 20 +
+                   extra * EXTRA_ENTRY_SIZE;
+        gps_pos = exif_pos + 2 + 12 + 4 + 20;
+        pixel_pos = gps_pos + (with_gps ? 2 + 12 * GPS_ENTRIES + 4 + GPS_SLACK : 0);
+        pixel_pos = (pixel_pos + 15) & ~15;
+        for(k=0; k<NUM_STRIPS; ++k)
+        {
+            strips[k] = pixel_pos + k * (pixel_bytes / NUM_STRIPS);
+            counts[k] = pixel_bytes / NUM_STRIPS;
+        }
+        if(swap)
+        {
+            swap_endian4_array(strips, NUM_STRIPS);
+            swap_endian4_array(counts, NUM_STRIPS);
+        }
+        rational[0] = 300;
+        rational[1] = 1;
+        if(swap)
+            swap_endian4_array(rational, 2);
+
+        ifd_begin(&l, header, swap, 8, (with_gps ? 12 : 11) + extra, &data_pos);
+        ifd_long(&l, NewSubFileType, 1);
+        ifd_long(&l, ImageWidth, 4288);
+        ifd_long(&l, ImageLength, 2848);
+        ifd_entry(&l, Make, ASCII, 18, "NIKON CORPORATION");
+        ifd_entry(&l, Model, ASCII, 10, "NIKON D90");
+        ifd_entry(&l, StripOffsets, LONG, NUM_STRIPS, strips);
+        ifd_entry(&l, StripByteCounts, LONG, NUM_STRIPS, counts);
+        ifd_entry(&l, XResolution, RATIONAL, 1, rational);
+        ifd_entry(&l, DateTime, ASCII, 20, stamp);
+        ifd_long(&l, ExifIFDPointer, exif_pos);
+        if(with_gps)
+            ifd_long(&l, GPSInfoIFDPointer, gps_pos);
+        ifd_entry(&l, DateTimeOriginal, ASCII, 20, stamp);
+        for(k=0; k<extra; ++k)
+        {
+            unsigned int32 pair[2] = {k, k};
+            if(swap)
+                swap_endian4_array(pair, 2);
+            ifd_entry(&l, 0xc000 + k, LONG, 2, pair);
+        }
+        ifd_end(&l, 0);
+
+        ifd_begin(&l, header, swap, exif_pos, 1, &data_pos);
+        ifd_entry(&l, DateTimeOriginal, ASCII, 20, stamp);
+        ifd_end(&l, 0);
+
+        /* a GPS IFD full of placeholders, with room for the real thing */
+        if(with_gps)
+        {
+            unsigned byte zero[4] = {0, 0, 0, 0};
+            ifd_begin(&l, header, swap, gps_pos, GPS_ENTRIES, &data_pos);
+            for(k=0; k<GPS_ENTRIES; ++k)
+                ifd_entry(&l, k, BYTE, 4, zero);
+            ifd_end(&l, 0);
+        }
+
+        snprintf(path, sizeof(path), "%s/DSC_%05d.NEF", argv[optind], i);
+        if((fp = fopen(path, "wb")) == NULL)
+        {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+        if(fwrite(header, 1, pixel_pos, fp) != pixel_pos ||
+           fwrite(pixels, 1, pixel_bytes, fp) != (size_t)pixel_bytes ||
+           fclose(fp) != 0)
+        {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    free(pixels);
+    free(header);
+    return EXIT_SUCCESS;
+}
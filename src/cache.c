@@ -0,0 +1,276 @@
+/*
+ * cache.c
+ * on-disk index of parsed gps logs, so each log is only parsed once
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "track.h"
+#include "types.h"
+
+/* columns are laid out on 8 byte boundaries */
+#define COLUMN_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * sum of the column widths, which changes whenever the track layout does
+ */
+static unsigned int32 fix_size(void)
+{
+    track_t t;
+    track_column_t cols[TRACK_NUM_COLUMNS];
+    unsigned int32 n = 0;
+    int i;
+
+    track_columns(&t, cols);
+    for(i=0; i<TRACK_NUM_COLUMNS; ++i)
+        n += cols[i].size;
+    return n;
+}
+
+/*
+ * 64 bit FNV-1a, continuing from h
+ */
+static unsigned int64 fnv1a(unsigned int64 h, const unsigned byte* p, size_t n)
+{
+    size_t i;
+    for(i=0; i<n; ++i)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * fill in the key fields of a header from an open log file. the content
+ * hash covers the size and TRACK_CACHE_SAMPLES evenly spaced blocks of
+ * the log, first and last included, so checking it costs the same
+ * however long the log is. take the key before parsing, from the same
+ * descriptor: a log that grows while it's parsed then gets a key older
+ * than the fixes stored under it, and is simply parsed again next time,
+ * rather than a key newer than them, which would hide the new fixes for
+ * good.
+ */
+int track_cache_key(int fd, track_cache_header_t* h)
+{
+    unsigned byte buf[TRACK_CACHE_SAMPLE];
+    struct stat st;
+    off_t span;
+    off_t offset;
+    ssize_t n;
+    int i;
+
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+
+    memset(h, 0, sizeof(track_cache_header_t));
+    memcpy(h->magic, TRACK_CACHE_MAGIC, sizeof(h->magic));
+    h->version = TRACK_CACHE_VERSION;
+    h->fix_size = fix_size();
+    h->log_size = st.st_size;
+    h->log_mtime_sec = st.st_mtim.tv_sec;
+    h->log_mtime_nsec = st.st_mtim.tv_nsec;
+    
+    h->log_hash = fnv1a(0xcbf29ce484222325ULL, (const unsigned byte*)&h->log_size,
+                        sizeof(h->log_size));
+
+    /* the blocks are spread so the first starts the log and the last ends
+     * it; they overlap, covering all of it, in a log under
+     * TRACK_CACHE_SAMPLES blocks long, and one block covers a tiny log */
+    span = (st.st_size > TRACK_CACHE_SAMPLE) ? st.st_size - TRACK_CACHE_SAMPLE : 0;
+    for(i=0; i<TRACK_CACHE_SAMPLES && (i == 0 || span > 0); ++i)
+    {
+        offset = span * i / (TRACK_CACHE_SAMPLES - 1);
+        n = pread(fd, buf, sizeof(buf), offset);
+        if(n > 0)
+            h->log_hash = fnv1a(h->log_hash, buf, n);
+    }
+    return 1;
+}
+
+/*
+ * the two places an index can live: next to the log, or (if that
+ * directory isn't writable) in the user's cache directory under a name
+ * derived from the log's full path
+ */
+static void cache_path_beside(const char* log_path, char* path, size_t n)
+{
+    snprintf(path, n, "%s%s", log_path, TRACK_CACHE_SUFFIX);
+}
+
+static int cache_path_in_dir(const char* log_path, char* path, size_t n, int create)
+{
+    char dir[PATH_MAX];
+    char full[PATH_MAX];
+    const char* env;
+    unsigned int64 h;
+
+    if((env = getenv("NEFTAG_CACHE_DIR")) != NULL)
+        snprintf(dir, sizeof(dir), "%s", env);
+    else if((env = getenv("XDG_CACHE_HOME")) != NULL)
+        snprintf(dir, sizeof(dir), "%s/neftag", env);
+    else if((env = getenv("HOME")) != NULL)
+        snprintf(dir, sizeof(dir), "%s/.cache/neftag", env);
+    else
+        return 0;
+
+    if(create)
+    {
+        /* make the last two levels if need be; anything further up should
+         * already be there */
+        char* slash = strrchr(dir, '/');
+        if(slash && slash != dir)
+        {
+            *slash = '\0';
+            mkdir(dir, 0755);
+            *slash = '/';
+        }
+        if(mkdir(dir, 0755) < 0 && errno != EEXIST)
+            return 0;
+    }
+
+    if(!realpath(log_path, full))
+        return 0;
+    h = fnv1a(0xcbf29ce484222325ULL, (const unsigned byte*)full, strlen(full));
+    snprintf(path, n, "%s/%016llx%s", dir, (unsigned long long)h, TRACK_CACHE_SUFFIX);
+    return 1;
+}
+
+/*
+ * map an index file and check it against the log's key. on success the
+ * track's columns point straight into the read-only mapping.
+ */
+static int cache_map(const char* path, const track_cache_header_t* key, track_t* track)
+{
+    struct stat st;
+    const track_cache_header_t* h;
+    track_column_t cols[TRACK_NUM_COLUMNS];
+    size_t pos;
+    void* p;
+    int fd;
+    int i;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(track_cache_header_t))
+    {
+        close(fd);
+        return 0;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        return 0;
+
+    h = (const track_cache_header_t*)p;
+    if(memcmp(h->magic, key->magic, sizeof(h->magic)) != 0 ||
+       h->version != key->version ||
+       h->fix_size != key->fix_size ||
+       h->log_size != key->log_size ||
+       h->log_mtime_sec != key->log_mtime_sec ||
+       h->log_mtime_nsec != key->log_mtime_nsec ||
+       h->log_hash != key->log_hash ||
+       h->count > INT_MAX)
+    {
+        munmap(p, st.st_size);
+        return 0;
+    }
+
+    memset(track, 0, sizeof(track_t));
+    track_columns(track, cols);
+    pos = sizeof(track_cache_header_t);
+    for(i=0; i<TRACK_NUM_COLUMNS; ++i)
+    {
+        *cols[i].data = (char*)p + pos;
+        pos += COLUMN_ALIGN(h->count * cols[i].size);
+    }
+    if(pos != (size_t)st.st_size)
+    {
+        munmap(p, st.st_size);
+        memset(track, 0, sizeof(track_t));
+        return 0;
+    }
+    track->count = track->capacity = (int)h->count;
+    track->map = p;
+    track->map_size = st.st_size;
+    return 1;
+}
+
+/*
+ * look for an index of the given log matching its key and map it as the
+ * track, which must not be appended to. returns 0 if there isn't one,
+ * in which case the log has to be parsed.
+ */
+int track_cache_load(const char* log_path, const track_cache_header_t* key, track_t* track)
+{
+    char path[PATH_MAX];
+
+    cache_path_beside(log_path, path, sizeof(path));
+    if(cache_map(path, key, track))
+        return 1;
+    if(cache_path_in_dir(log_path, path, sizeof(path), 0) && cache_map(path, key, track))
+        return 1;
+    return 0;
+}
+
+/*
+ * write the index to a temporary file and rename it into place, so a
+ * reader never sees a half written index
+ */
+static int cache_write(const char* path, const track_cache_header_t* h, track_t* track)
+{
+    static const unsigned byte zeros[8];
+    track_column_t cols[TRACK_NUM_COLUMNS];
+    char tmp[PATH_MAX];
+    FILE* fp;
+    size_t n;
+    int ok;
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    if((fp = fopen(tmp, "wb")) == NULL)
+        return 0;
+    ok = fwrite(h, sizeof(track_cache_header_t), 1, fp) == 1;
+    track_columns(track, cols);
+    for(i=0; ok && i<TRACK_NUM_COLUMNS; ++i)
+    {
+        n = track->count * cols[i].size;
+        ok = fwrite(*cols[i].data, 1, n, fp) == n &&
+            fwrite(zeros, 1, COLUMN_ALIGN(n) - n, fp) == COLUMN_ALIGN(n) - n;
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok || rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * save an index of the parsed log for next time, under the key taken
+ * before it was parsed. failing to save it isn't an error; the log just
+ * gets parsed again.
+ */
+int track_cache_store(const char* log_path, const track_cache_header_t* key, track_t* track)
+{
+    track_cache_header_t h = *key;
+    char path[PATH_MAX];
+
+    h.count = track->count;
+
+    cache_path_beside(log_path, path, sizeof(path));
+    if(cache_write(path, &h, track))
+        return 1;
+    if(cache_path_in_dir(log_path, path, sizeof(path), 1) && cache_write(path, &h, track))
+        return 1;
+    return 0;
+}
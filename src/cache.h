@@ -0,0 +1,52 @@
+/*
+ * cache.h
+ * on-disk index of parsed gps logs, so each log is only parsed once
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "track.h"
+#include "types.h"
+
+#define TRACK_CACHE_MAGIC "NEFTAGIX"
+#define TRACK_CACHE_VERSION 5
+
+/* suffix of the index file written next to a log */
+#define TRACK_CACHE_SUFFIX ".nidx"
+
+/*
+ * the log's contents are fingerprinted by hashing TRACK_CACHE_SAMPLES
+ * blocks of TRACK_CACHE_SAMPLE bytes spread evenly from its start to its
+ * end (all of it, if it's smaller than that)
+ */
+#define TRACK_CACHE_SAMPLE 4096
+#define TRACK_CACHE_SAMPLES 16
+
+/*
+ * the index file is this header followed by each column of the track in
+ * turn, every one starting on an 8 byte boundary. the size, mtime and
+ * sampled content hash of the log it was built from are the key; if any
+ * of them differ the index is stale and ignored. the hash only sees the
+ * sampled blocks, so an edit that keeps the size, falls between them and
+ * has its mtime put back (rsync -t, touch -r) isn't noticed; -N, or
+ * deleting the index, makes neftag parse the log again.
+ */
+typedef struct
+{
+    char magic[8];
+    unsigned int32 version;
+    unsigned int32 fix_size;      /* total width of the columns, as a layout check */
+    unsigned int64 log_size;
+    int64 log_mtime_sec;
+    int64 log_mtime_nsec;
+    unsigned int64 log_hash;
+    unsigned int64 count;
+    unsigned byte pad[8];         /* keep the columns 8 byte aligned */
+} track_cache_header_t;
+
+int track_cache_key(int fd, track_cache_header_t* key);
+int track_cache_load(const char* log_path, const track_cache_header_t* key, track_t* track);
+int track_cache_store(const char* log_path, const track_cache_header_t* key, track_t* track);
+
+#endif
@@ -96,3 +96,25 @@ void add_offset(struct tm* t, int hours)
         t->tm_hour += hours;
     }
 }
+
+/*
+ * number of days from 1970-01-01 to the given date (months numbered 1 to
+ * 12) in the proleptic gregorian calendar. this is plain arithmetic on
+ * 400 year eras, so it's much cheaper than filling a struct tm for timegm.
+ */
+long days_from_civil(int year, int mon, int mday)
+{
+    long era;
+    long yoe; /* year of era, 0-399 */
+    long doy; /* day of year, counting from march 1st */
+    long doe; /* day of era, 0-146096 */
+
+    /* treat january and february as the end of the previous year, so the
+     * leap day falls at the end */
+    year -= (mon <= 2);
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + mday - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
@@ -11,5 +11,6 @@
 int last_day_of_month(int mon, int year);
 int is_leap_year(int year);
 void add_offset(struct tm* t, int hours);
+long days_from_civil(int year, int mon, int mday);
 
 #endif 
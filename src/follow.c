@@ -0,0 +1,429 @@
+/*
+ * follow.c
+ * tag images as they arrive while the gps log is still being written
+ *
+ * the log is read incrementally, each time it grows, and the new fixes
+ * are appended to the track. the import directory is watched with
+ * inotify, and every file written or moved into it has its timestamp
+ * read straight away. an image can be tagged once the track reaches
+ * past its time, since no later fix could then be nearer; until then it
+ * waits in a pending queue that is looked at again whenever the log
+ * grows.
+ */
+
+#define _GNU_SOURCE /* memrchr */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "follow.h"
+#include "tag.h"
+#include "track.h"
+#include "nmea.h"
+#include "arena.h"
+#include "types.h"
+
+/* the part of the log read so far */
+typedef struct
+{
+    int fd;
+    off_t offset;        /* next byte to read */
+    char* buf;           /* a partial last line carried over */
+    size_t len;
+    size_t cap;
+} follow_log_t;
+
+/*
+ * a file already dealt with, as it was when we last touched it. writing
+ * the tag closes the file and so raises an event of its own, which has
+ * to be told apart from someone copying in a new version.
+ */
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+} seen_file_t;
+
+typedef struct
+{
+    const tag_config_t* cfg;
+    arena_t arena;
+    xmp_writer_t sidecars; /* used when cfg->sidecar is set */
+
+    /* images whose timestamps are past the end of the track */
+    tag_job_t* pending;
+    int num_pending;
+    int pending_cap;
+
+    seen_file_t* seen;
+    int num_seen;
+    int seen_cap;
+} follower_t;
+
+static volatile sig_atomic_t stop_following = 0;
+
+static void on_signal(int sig)
+{
+    stop_following = 1;
+}
+
+/*
+ * offset of the last GPRMC sentence starting a line in buf, or -1
+ */
+static ssize_t last_rmc(const char* buf, size_t len)
+{
+    ssize_t i;
+
+    for(i=(ssize_t)len - 7; i >= 0; --i)
+    {
+        if(buf[i] == '$' && (i == 0 || buf[i-1] == '\n') &&
+           memcmp(buf + i, "$GPRMC,", 7) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * read whatever has been added to the log since last time and append
+ * the fixes in it to the track. only complete lines are parsed; a line
+ * still being written is kept until its newline arrives. so is the last
+ * GPRMC and everything after it, until the next GPRMC shows its fix is
+ * complete: the GPGGA lines following a GPRMC are applied to the last
+ * fix in the track, which once the track has been sorted needn't be the
+ * one they followed. returns the number of fixes added.
+ */
+static int read_log(follow_log_t* log, track_t* track)
+{
+    int before = track->count;
+    struct stat st;
+    ssize_t n;
+
+    /* a log that got shorter was replaced or truncated; start again */
+    if(fstat(log->fd, &st) == 0 && st.st_size < log->offset)
+    {
+        fprintf(stderr, "gps log was truncated; rereading it\n");
+        log->offset = 0;
+        log->len = 0;
+        track->count = 0;
+        before = 0;
+    }
+
+    for(;;)
+    {
+        const char* nl;
+
+        if(log->cap - log->len < FOLLOW_READ_SIZE)
+        {
+            log->cap = log->len + FOLLOW_READ_SIZE;
+            log->buf = (char*)realloc(log->buf, log->cap);
+            if(!log->buf)
+            {
+                fprintf(stderr, "out of memory reading gps log\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if((n = pread(log->fd, log->buf + log->len, FOLLOW_READ_SIZE, log->offset)) <= 0)
+            break;
+        log->offset += n;
+        log->len += n;
+
+        if((nl = memrchr(log->buf, '\n', log->len)) != NULL)
+        {
+            size_t whole = nl - log->buf + 1;
+            ssize_t rmc = last_rmc(log->buf, whole);
+
+            if(rmc >= 0)
+                whole = rmc;
+            parse_nmea_buffer(log->buf, whole, track, 1);
+            memmove(log->buf, log->buf + whole, log->len - whole);
+            log->len -= whole;
+        }
+    }
+
+    /* a receiver reset can send the log back in time */
+    track_sort(track);
+    return track->count - before;
+}
+
+/*
+ * true once the track has a fix at or after time ts, so the nearest
+ * fix to ts is settled
+ */
+static int track_covers(const track_t* track, time_t ts)
+{
+    return track->count > 0 && track->when[track->count-1] >= (int64)ts * 1000;
+}
+
+/*
+ * remember a file as it is now. returns 0 if it was already remembered
+ * exactly like this, so there's nothing new to do with it.
+ */
+static int note_file(follower_t* f, const char* path)
+{
+    struct stat st;
+    int i;
+
+    if(stat(path, &st) < 0)
+        return 0;
+    for(i=0; i<f->num_seen; ++i)
+    {
+        seen_file_t* s = &f->seen[i];
+        if(s->dev == st.st_dev && s->ino == st.st_ino)
+        {
+            if(s->mtime.tv_sec == st.st_mtim.tv_sec && s->mtime.tv_nsec == st.st_mtim.tv_nsec)
+                return 0;
+            s->mtime = st.st_mtim;
+            return 1;
+        }
+    }
+    if(f->num_seen == f->seen_cap)
+    {
+        f->seen_cap = f->seen_cap ? f->seen_cap * 2 : 64;
+        f->seen = (seen_file_t*)realloc(f->seen, f->seen_cap * sizeof(seen_file_t));
+        if(!f->seen)
+        {
+            fprintf(stderr, "out of memory watching for images\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    f->seen[f->num_seen].dev = st.st_dev;
+    f->seen[f->num_seen].ino = st.st_ino;
+    f->seen[f->num_seen].mtime = st.st_mtim;
+    f->num_seen++;
+    return 1;
+}
+
+static void tag_now(follower_t* f, tag_job_t* job)
+{
+    tag_match(job, 1, f->cfg, NULL);
+    if(f->cfg->sidecar)
+    {
+        /* nothing to batch with; write each sidecar as it comes */
+        tag_sidecar(job, f->cfg, &f->sidecars, NULL);
+        xmp_flush(&f->sidecars);
+    }
+    else
+        tag_write(job, f->cfg, &f->arena, NULL);
+    if(job->status == TAG_OK)
+    {
+        printf("tagged '%s'\n", job->path);
+        fflush(stdout);
+    }
+
+    /* our own write isn't a new image */
+    note_file(f, job->path);
+}
+
+/* nonzero for a sidecar, or the temporary file one is written through */
+static int is_sidecar(const char* path)
+{
+    size_t len = strlen(path);
+    size_t n = strlen(XMP_SUFFIX);
+
+    if(len > 4 && strcmp(path + len - 4, ".tmp") == 0)
+        len -= 4;
+    return len > n && strncmp(path + len - n, XMP_SUFFIX, n) == 0;
+}
+
+/*
+ * read a new image's time and tag it, or queue it until the log
+ * catches up
+ */
+static void add_image(follower_t* f, const char* path)
+{
+    tag_job_t job;
+
+    /* sidecars we write land in the same directory */
+    if(f->cfg->sidecar && is_sidecar(path))
+        return;
+    if(!note_file(f, path))
+        return;
+
+    memset(&job, 0, sizeof(job));
+    job.path = strdup(path);
+    if(tag_read_time(&job, f->cfg, &f->arena, NULL) != TAG_OK)
+    {
+        free((char*)job.path);
+        return;
+    }
+
+    if(track_covers(f->cfg->track, job.utc_time))
+    {
+        tag_now(f, &job);
+        free((char*)job.path);
+        return;
+    }
+
+    printf("waiting for gps fixes to reach the time of '%s'\n", job.path);
+    fflush(stdout);
+    if(f->num_pending == f->pending_cap)
+    {
+        f->pending_cap = f->pending_cap ? f->pending_cap * 2 : 16;
+        f->pending = (tag_job_t*)realloc(f->pending, f->pending_cap * sizeof(tag_job_t));
+        if(!f->pending)
+        {
+            fprintf(stderr, "out of memory queueing images\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    f->pending[f->num_pending++] = job;
+}
+
+/*
+ * tag every queued image the track now covers, or all of them with
+ * whatever fixes there are if flush is set
+ */
+static void run_pending(follower_t* f, int flush)
+{
+    int i;
+    int kept = 0;
+
+    for(i=0; i<f->num_pending; ++i)
+    {
+        tag_job_t* job = &f->pending[i];
+        if(flush || track_covers(f->cfg->track, job->utc_time))
+        {
+            tag_now(f, job);
+            free((char*)job->path);
+        }
+        else
+            f->pending[kept++] = *job;
+    }
+    f->num_pending = kept;
+}
+
+/*
+ * handle every event waiting on the inotify descriptor
+ */
+static void read_events(follower_t* f, int ifd, int dir_wd, const char* import_dir)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[4096];
+    const struct inotify_event* ev;
+    ssize_t n;
+    char* p;
+
+    while((n = read(ifd, buf, sizeof(buf))) > 0)
+    {
+        for(p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (const struct inotify_event*)p;
+
+            /* files are picked up once they've been closed after writing or
+             * renamed into place; dot files are usually half-copied */
+            if(ev->wd != dir_wd || ev->len == 0 || ev->name[0] == '.' ||
+               (ev->mask & IN_ISDIR))
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", import_dir, ev->name);
+            add_image(f, path);
+        }
+    }
+}
+
+/*
+ * follow the log at log_path and tag images arriving in import_dir
+ * (and those given in paths, and those already in the directory) until
+ * interrupted. images still waiting then are tagged with the fixes
+ * there are.
+ */
+int follow_run(const char* log_path, const char* import_dir, tag_config_t* cfg,
+               track_t* track, char** paths, int npaths)
+{
+    follow_log_t log;
+    follower_t f;
+    struct sigaction sa;
+    struct pollfd pfd;
+    char path[4096];
+    struct dirent* de;
+    DIR* d;
+    int ifd;
+    int dir_wd;
+    int i;
+
+    memset(&log, 0, sizeof(log));
+    memset(&f, 0, sizeof(f));
+    f.cfg = cfg;
+    if((log.fd = open(log_path, O_RDONLY)) < 0)
+    {
+        fprintf(stderr, "could not open gps log file: '%s'\n", log_path);
+        return 0;
+    }
+
+    /* inotify reports changes to both the log and the directory */
+    if((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    {
+        fprintf(stderr, "could not start watching for files: %s\n", strerror(errno));
+        close(log.fd);
+        return 0;
+    }
+    if((dir_wd = inotify_add_watch(ifd, import_dir, IN_CLOSE_WRITE | IN_MOVED_TO)) < 0)
+    {
+        fprintf(stderr, "could not watch directory '%s': %s\n", import_dir, strerror(errno));
+        close(ifd);
+        close(log.fd);
+        return 0;
+    }
+    inotify_add_watch(ifd, log_path, IN_MODIFY);
+
+    /* stop cleanly on ^C */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    arena_init(&f.arena, ARENA_CHUNK_SIZE);
+    xmp_writer_init(&f.sidecars, NULL);
+    track->count = 0;
+    read_log(&log, track);
+
+    /* whatever is already there goes in first */
+    for(i=0; i<npaths; ++i)
+        add_image(&f, paths[i]);
+    if((d = opendir(import_dir)) != NULL)
+    {
+        while((de = readdir(d)) != NULL)
+        {
+            if(de->d_name[0] == '.' || de->d_type == DT_DIR)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", import_dir, de->d_name);
+            add_image(&f, path);
+        }
+        closedir(d);
+    }
+
+    printf("following '%s' and watching '%s'; ^C to stop\n", log_path, import_dir);
+    fflush(stdout);
+    pfd.fd = ifd;
+    pfd.events = POLLIN;
+    while(!stop_following)
+    {
+        /* the log is checked on every wakeup, not just when inotify says
+         * it changed, in case it lives somewhere inotify can't see */
+        if(poll(&pfd, 1, FOLLOW_POLL_MS) > 0)
+            read_events(&f, ifd, dir_wd, import_dir);
+        if(read_log(&log, track) > 0)
+            run_pending(&f, 0);
+    }
+
+    /* the log has stopped; tag what's left with what we have */
+    read_log(&log, track);
+    run_pending(&f, 1);
+
+    free(f.pending);
+    free(f.seen);
+    free(log.buf);
+    arena_free(&f.arena);
+    xmp_writer_free(&f.sidecars);
+    close(ifd);
+    close(log.fd);
+    return 1;
+}
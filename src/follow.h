@@ -0,0 +1,21 @@
+/*
+ * follow.h
+ * tag images as they arrive while the gps log is still being written
+ */
+
+#ifndef _FOLLOW_H_
+#define _FOLLOW_H_
+
+#include "tag.h"
+#include "track.h"
+
+/* how much of the log is read at a time */
+#define FOLLOW_READ_SIZE 65536
+
+/* how often (ms) the log is checked even if no change was reported */
+#define FOLLOW_POLL_MS 1000
+
+int follow_run(const char* log_path, const char* import_dir, tag_config_t* cfg,
+               track_t* track, char** paths, int npaths);
+
+#endif
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# follow_demo.sh
+# exercise follow mode locally: replay an nmea log into a growing file a
+# few lines at a time, drop copies of sample images into an import
+# directory part way through, then stop neftag and show what happened.
+#
+# usage: follow_demo.sh <nmea_log> <sample.nef>+
+#
+# the sample images' times (after any -o offset in NEFTAG_ARGS) should
+# fall inside the log, e.g. logs/GPS_20091107_053557.log covers
+# 2009-11-07 05:35 to 05:57 utc.
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <nmea_log> <sample.nef>+" >&2
+    exit 1
+fi
+
+NEFTAG=${NEFTAG:-$(dirname "$0")/neftag}
+LOG=$1
+shift
+
+DIR=$(mktemp -d)
+mkdir "$DIR/import"
+: > "$DIR/gps.log"
+trap 'rm -rf "$DIR"' EXIT
+
+$NEFTAG $NEFTAG_ARGS -f "$DIR/import" "$DIR/gps.log" &
+PID=$!
+sleep 1
+
+# the log grows by STEP lines every tick; the images are dropped in once
+# the first third of it has been written, so some of them have to wait
+LINES=$(wc -l < "$LOG")
+STEP=$(( LINES / 30 + 1 ))
+DROP=$(( LINES / 3 ))
+DONE=0
+DROPPED=0
+while [ $DONE -lt $LINES ]; do
+    sed -n "$(( DONE + 1 )),$(( DONE + STEP ))p" "$LOG" >> "$DIR/gps.log"
+    DONE=$(( DONE + STEP ))
+    if [ $DROPPED -eq 0 ] && [ $DONE -ge $DROP ]; then
+        for f in "$@"; do
+            cp "$f" "$DIR/import/"
+        done
+        DROPPED=1
+    fi
+    sleep 0.2
+done
+
+sleep 2
+kill -INT $PID
+wait $PID
+
+for f in "$@"; do
+    if cmp -s "$f" "$DIR/import/$(basename "$f")"; then
+        echo "$(basename "$f"): unchanged"
+    else
+        echo "$(basename "$f"): tagged"
+    fi
+done
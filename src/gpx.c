@@ -0,0 +1,275 @@
+/*
+ * gpx.c
+ * functions for reading GPX track logs
+ *
+ * this isn't an xml parser. it streams through the file looking for
+ * <trkpt> elements and picks the few children it cares about out of
+ * each one, which is all a gps log needs and runs about as fast as the
+ * file can be read.
+ */
+
+#define _GNU_SOURCE /* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "gpx.h"
+#include "track.h"
+#include "date.h"
+#include "util.h"
+#include "types.h"
+
+/*
+ * true if the log looks like xml rather than nmea. leading whitespace is
+ * consumed; the first real character is pushed back.
+ */
+int is_gpx_file(FILE* fp)
+{
+    int ch;
+
+    while((ch = fgetc(fp)) != EOF && isspace(ch))
+        ;
+    if(ch == EOF)
+        return 0;
+    ungetc(ch, fp);
+    return ch == '<' || ch == 0xef; /* 0xef starts a utf-8 byte order mark */
+}
+
+/*
+ * convert signed decimal degrees to the ddmm.mmmm form nmea uses, plus
+ * a hemisphere letter
+ */
+static void degrees_to_nmea(double deg, char pos, char neg, double* nmea, char* ref)
+{
+    double a = fabs(deg);
+    double d = floor(a);
+
+    *nmea = d * 100 + (a - d) * 60;
+    *ref = (deg < 0) ? neg : pos;
+}
+
+/*
+ * value of attribute name within a start tag, or NULL
+ */
+static const char* tag_attr(const char* tag, const char* tag_end, const char* name)
+{
+    size_t n = strlen(name);
+    const char* p = tag;
+
+    while((p = memmem(p, tag_end - p, name, n)) != NULL)
+    {
+        /* must be a whole attribute name followed by =" or =' */
+        if(isspace((unsigned char)p[-1]) && p + n + 1 < tag_end && p[n] == '=' &&
+           (p[n+1] == '"' || p[n+1] == '\''))
+            return p + n + 2;
+        p += n;
+    }
+    return NULL;
+}
+
+/*
+ * an xml schema dateTime: yyyy-mm-ddThh:mm:ss[.sss][Z|+hh:mm|-hh:mm].
+ * returns 0 if it can't be read.
+ */
+static int parse_time(const char* p, location_t* rec)
+{
+    static const char pattern[] = "0000-00-00T00:00:00";
+    int year, mon, mday, hour, min, sec;
+    int scale;
+    int off;
+    int i;
+
+    /* digits where the pattern has 0s, and the separators exactly */
+    for(i=0; i<19; ++i)
+    {
+        if(pattern[i] == '0' ? !isdigit((unsigned char)p[i]) : p[i] != pattern[i])
+            return 0;
+    }
+
+    year = atoi(p);
+    mon = (p[5] - '0')*10 + (p[6] - '0');
+    mday = (p[8] - '0')*10 + (p[9] - '0');
+    hour = (p[11] - '0')*10 + (p[12] - '0');
+    min = (p[14] - '0')*10 + (p[15] - '0');
+    sec = (p[17] - '0')*10 + (p[18] - '0');
+    p += 19;
+
+    rec->msec = 0;
+    if(*p == '.')
+    {
+        for(++p, scale = 100; isdigit((unsigned char)*p); ++p)
+        {
+            rec->msec += (*p - '0') * scale;
+            scale /= 10;
+        }
+    }
+
+    rec->when = (time_t)days_from_civil(year, mon, mday) * 86400 + hour * 3600 + min * 60 + sec;
+
+    /* times are utc unless an offset says otherwise */
+    if((*p == '+' || *p == '-') && isdigit((unsigned char)p[1]) && isdigit((unsigned char)p[2]))
+    {
+        off = ((p[1] - '0')*10 + (p[2] - '0')) * 3600;
+        if(p[3] == ':' && isdigit((unsigned char)p[4]) && isdigit((unsigned char)p[5]))
+            off += ((p[4] - '0')*10 + (p[5] - '0')) * 60;
+        rec->when += (*p == '+') ? -off : off;
+    }
+    return 1;
+}
+
+/*
+ * build a fix from one <trkpt> element; tag points at its start tag,
+ * body..body_end at its contents (empty for <trkpt .../>)
+ */
+static int parse_trkpt(const char* tag, const char* tag_end, const char* body,
+                       const char* body_end, location_t* rec)
+{
+    const char* lat = tag_attr(tag, tag_end, "lat");
+    const char* lon = tag_attr(tag, tag_end, "lon");
+    const char* p;
+    int have_time = 0;
+
+    if(!lat || !lon)
+        return 0;
+
+    memset(rec, 0, sizeof(location_t));
+    rec->status = 'A';
+    degrees_to_nmea(parse_decimal(lat), 'N', 'S', &rec->latitude, &rec->lat_ref);
+    degrees_to_nmea(parse_decimal(lon), 'E', 'W', &rec->longitude, &rec->lon_ref);
+
+    /* each child is <name>value</name>; anything else is passed over */
+    for(p = body; (p = memchr(p, '<', body_end - p)) != NULL; ++p)
+    {
+        const char* v = memchr(p, '>', body_end - p);
+        if(!v)
+            break;
+        ++v;
+        if(strncmp(p, "<ele>", 5) == 0)
+        {
+            rec->altitude = parse_decimal(v);
+            rec->have_altitude = 1;
+        }
+        else if(strncmp(p, "<time>", 6) == 0)
+            have_time = parse_time(v, rec);
+        else if(strncmp(p, "<course>", 8) == 0)
+            rec->heading = parse_decimal(v);
+        else if(strncmp(p, "<speed>", 7) == 0)
+            rec->speed = parse_decimal(v) * GPX_MS_TO_KNOTS;
+        else if(strncmp(p, "<sat>", 5) == 0)
+            rec->num_sat = (int)parse_decimal(v);
+        else if(strncmp(p, "<fix>", 5) == 0)
+        {
+            /* same numbering as the quality field of nmea GPGGA */
+            if(strncmp(v, "none", 4) == 0)
+            {
+                rec->status = 'V';
+                rec->quality = 0;
+            }
+            else if(strncmp(v, "dgps", 4) == 0)
+                rec->quality = 2;
+            else if(strncmp(v, "pps", 3) == 0)
+                rec->quality = 3;
+            else
+                rec->quality = 1;
+        }
+        p = v - 1;
+    }
+
+    /* a point with no time can't be matched against anything */
+    return have_time;
+}
+
+/*
+ * parse the complete <trkpt> elements in buf, appending fixes to the
+ * track. buf must be terminated with a '\0' at buf[len]. returns how
+ * many bytes were used up; an element cut off by the end of the buffer
+ * is left for the next call, unless at_eof says no more is coming.
+ */
+size_t parse_gpx_buffer(const char* buf, size_t len, int at_eof, track_t* track)
+{
+    const char* p = buf;
+    const char* end = buf + len;
+    location_t rec;
+
+    while(p < end)
+    {
+        const char* s = memmem(p, end - p, "<trkpt", 6);
+        const char* tag_end;
+        const char* close;
+        const char* next;
+
+        if(!s)
+        {
+            /* keep enough to finish a "<trkpt" split across the boundary */
+            if(at_eof || end - p < 6)
+                return at_eof ? len : (size_t)(p - buf);
+            return (end - buf) - 5;
+        }
+        if(s + 6 >= end)
+            return at_eof ? len : (size_t)(s - buf);
+        if(!isspace((unsigned char)s[6]) && s[6] != '>' && s[6] != '/')
+        {
+            p = s + 6; /* <trkptsomething> */
+            continue;
+        }
+
+        tag_end = memchr(s, '>', end - s);
+        if(!tag_end)
+            return at_eof ? len : (size_t)(s - buf);
+        if(tag_end[-1] == '/')
+        {
+            /* <trkpt lat=".." lon=".."/> has no children */
+            close = tag_end + 1;
+            next = close;
+        }
+        else
+        {
+            close = memmem(tag_end, end - tag_end, "</trkpt>", 8);
+            if(!close)
+                return at_eof ? len : (size_t)(s - buf);
+            next = close + 8;
+        }
+
+        if(parse_trkpt(s, tag_end, tag_end + 1, close, &rec))
+            track_append(track, &rec);
+        p = next;
+    }
+    return len;
+}
+
+/*
+ * parse a GPX file into a track. the file is streamed through a fixed
+ * size buffer, so memory use doesn't depend on how big the log is.
+ */
+void parse_gpx_file(FILE* fp, track_t* track)
+{
+    char* buf = (char*)malloc(GPX_BUFFER_SIZE + 1);
+    size_t len = 0;
+    size_t used;
+    size_t n;
+    int at_eof = 0;
+
+    if(!buf)
+    {
+        fprintf(stderr, "out of memory reading gps log\n");
+        exit(EXIT_FAILURE);
+    }
+    while(!at_eof)
+    {
+        n = fread(buf + len, 1, GPX_BUFFER_SIZE - len, fp);
+        at_eof = (n == 0);
+        len += n;
+        buf[len] = '\0';
+
+        used = parse_gpx_buffer(buf, len, at_eof, track);
+
+        /* a single element bigger than the whole buffer isn't a track
+         * point anyone wrote on purpose; drop it and carry on */
+        if(used == 0 && len == GPX_BUFFER_SIZE)
+            used = 1;
+        memmove(buf, buf + used, len - used);
+        len -= used;
+    }
+    free(buf);
+}
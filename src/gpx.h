@@ -0,0 +1,22 @@
+/*
+ * gpx.h
+ * functions for reading GPX track logs
+ */
+
+#ifndef _GPX_H_
+#define _GPX_H_
+
+#include <stdio.h>
+#include "track.h"
+
+/* the file is read through a buffer this big, whatever its size */
+#define GPX_BUFFER_SIZE (1 << 20)
+
+/* meters per second to knots */
+#define GPX_MS_TO_KNOTS (3600.0 / 1852.0)
+
+int is_gpx_file(FILE* fp);
+void parse_gpx_file(FILE* fp, track_t* track);
+size_t parse_gpx_buffer(const char* buf, size_t len, int at_eof, track_t* track);
+
+#endif
@@ -0,0 +1,512 @@
+/*
+ * journal.c
+ * undo journal of the bytes tagging overwrites, so an interrupted or
+ * unwanted run can be rolled back
+ */
+
+#define _GNU_SOURCE /* syncfs */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+/*
+ * 64 bit FNV-1a, continuing from h
+ */
+static unsigned int64 fnv1a(unsigned int64 h, const unsigned byte* p, size_t n)
+{
+    size_t i;
+    for(i=0; i<n; ++i)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int write_all(int fd, const void* buf, size_t len, off_t offset, int append)
+{
+    const unsigned byte* p = (const unsigned byte*)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = append ? write(fd, p, len) : pwrite(fd, p, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/*
+ * remember the filesystem fd lives on, so it gets synced with the rest.
+ * call with the lock held.
+ */
+static void track_device(journal_t* j, int fd)
+{
+    struct stat st;
+    int i;
+
+    if(j->sync_all || fstat(fd, &st) != 0)
+        return;
+    for(i=0; i<j->ndevices; ++i)
+        if(j->device_ids[i] == st.st_dev)
+            return;
+    if(j->ndevices == JOURNAL_MAX_DEVICES || (fd = dup(fd)) < 0)
+    {
+        j->sync_all = 1;
+        return;
+    }
+    j->device_ids[j->ndevices] = st.st_dev;
+    j->devices[j->ndevices++] = fd;
+}
+
+/* flush everything written to the files so far, one filesystem at a time */
+static int sync_devices(journal_t* j)
+{
+    int devices[JOURNAL_MAX_DEVICES];
+    int ndevices;
+    int sync_all;
+    int ok = 1;
+    int i;
+
+    pthread_mutex_lock(&j->lock);
+    ndevices = j->ndevices;
+    memcpy(devices, j->devices, sizeof(devices));
+    sync_all = j->sync_all;
+    pthread_mutex_unlock(&j->lock);
+
+    if(sync_all)
+        sync();
+    else
+        for(i=0; i<ndevices; ++i)
+            ok = (syncfs(devices[i]) == 0) && ok;
+    return ok;
+}
+
+static void init_devices(journal_t* j)
+{
+    memset(j, 0, sizeof(journal_t));
+    j->fd = -1;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->synced_cond, NULL);
+}
+
+static void free_devices(journal_t* j)
+{
+    int i;
+    for(i=0; i<j->ndevices; ++i)
+        close(j->devices[i]);
+    pthread_cond_destroy(&j->synced_cond);
+    pthread_mutex_destroy(&j->lock);
+}
+
+/*
+ * offset just past the last whole record of a journal size bytes long:
+ * the first whose length runs past the end or whose hash doesn't match
+ * ends the journal, as it does for journal_rollback
+ */
+static off_t whole_records(int fd, off_t size)
+{
+    journal_record_t r;
+    unsigned byte* body = NULL;
+    size_t capacity = 0;
+    off_t pos = sizeof(journal_header_t);
+
+    while(pos + (off_t)sizeof(r) <= size)
+    {
+        if(pread(fd, &r, sizeof(r), pos) != sizeof(r) ||
+           r.len > size - pos - sizeof(r))
+            break;
+        if(r.len > capacity)
+        {
+            capacity = r.len;
+            body = (unsigned byte*)realloc(body, capacity);
+        }
+        if(pread(fd, body, r.len, pos + sizeof(r)) != (ssize_t)r.len ||
+           fnv1a(0xcbf29ce484222325ULL, body, r.len) != r.hash)
+            break;
+        pos += sizeof(r) + r.len;
+    }
+    free(body);
+    return pos;
+}
+
+/*
+ * open the journal at path to add this run's records to, creating it if
+ * need be. records from earlier runs are kept, so rolling back always
+ * gets back to the files as they were before the first of them. a torn
+ * record left by a run that died is cut off first; anything appended
+ * after it could never be reached by a rollback.
+ */
+int journal_open(journal_t* j, const char* path)
+{
+    journal_header_t h;
+    struct stat st;
+    off_t end;
+
+    init_devices(j);
+    if((j->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0 || fstat(j->fd, &st) != 0)
+    {
+        fprintf(stderr, "could not open journal '%s'\n", path);
+        if(j->fd >= 0)
+            close(j->fd);
+        free_devices(j);
+        return 0;
+    }
+
+    if(st.st_size == 0)
+    {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+        h.version = JOURNAL_VERSION;
+        if(!write_all(j->fd, &h, sizeof(h), 0, 1) || fdatasync(j->fd) != 0)
+        {
+            fprintf(stderr, "could not write journal '%s'\n", path);
+            close(j->fd);
+            free_devices(j);
+            return 0;
+        }
+    }
+    else if(pread(j->fd, &h, sizeof(h), 0) != sizeof(h) ||
+            memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 ||
+            h.version != JOURNAL_VERSION)
+    {
+        fprintf(stderr, "'%s' isn't a neftag journal\n", path);
+        close(j->fd);
+        free_devices(j);
+        return 0;
+    }
+    else if((end = whole_records(j->fd, st.st_size)) < st.st_size)
+    {
+        fprintf(stderr, "journal '%s' ends in a torn record; dropping it\n", path);
+        if(ftruncate(j->fd, end) != 0 || fdatasync(j->fd) != 0)
+        {
+            fprintf(stderr, "could not write journal '%s'\n", path);
+            close(j->fd);
+            free_devices(j);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* append one record in a single write, so workers' records don't interleave */
+static unsigned int64 append_record(journal_t* j, unsigned int32 type, const unsigned byte* body,
+                                    unsigned int32 len)
+{
+    journal_record_t r;
+    unsigned byte* buf;
+    unsigned int64 seq = 0;
+
+    r.type = type;
+    r.len = len;
+    r.hash = fnv1a(0xcbf29ce484222325ULL, body, len);
+    buf = (unsigned byte*)malloc(sizeof(r) + len);
+    memcpy(buf, &r, sizeof(r));
+    memcpy(buf + sizeof(r), body, len);
+
+    pthread_mutex_lock(&j->lock);
+    if(!j->failed && write_all(j->fd, buf, sizeof(r) + len, 0, 1))
+        seq = ++j->appended;
+    else
+        j->failed = 1;
+    pthread_mutex_unlock(&j->lock);
+    free(buf);
+    return seq;
+}
+
+/*
+ * record what the runs of p are about to overwrite in the file t, and
+ * the file's size, so both can be put back. returns the record's number
+ * for journal_commit, or 0 if it couldn't be written.
+ */
+unsigned int64 journal_log(journal_t* j, const char* path, tiff_t* t, const patch_t* p)
+{
+    char full[PATH_MAX];
+    struct stat st;
+    unsigned byte* body;
+    unsigned byte* q;
+    unsigned int64 size;
+    unsigned int32 path_len;
+    unsigned int32 n;
+    unsigned int32 len = 8 + 4 + 4;
+    unsigned int64 seq;
+    int i;
+
+    /* a rollback may well be run from somewhere else */
+    if(!realpath(path, full) || fstat(t->fd, &st) != 0)
+        return 0;
+    size = st.st_size;
+    path_len = strlen(full);
+    len += path_len;
+    for(i=0; i<p->count; ++i)
+        len += 8 + p->runs[i].len;
+
+    q = body = (unsigned byte*)malloc(len);
+    memcpy(q, &size, 8);
+    memcpy(q + 8, &p->count, 4);
+    memcpy(q + 12, &path_len, 4);
+    memcpy(q + 16, full, path_len);
+    q += 16 + path_len;
+    for(i=0; i<p->count; ++i)
+    {
+        const patch_run_t* run = &p->runs[i];
+
+        /* only what's inside the old end of file is worth keeping */
+        n = (run->offset < size) ? run->len : 0;
+        if(n && run->offset + n > size)
+            n = size - run->offset;
+        memcpy(q, &run->offset, 4);
+        memcpy(q + 4, &n, 4);
+        if(run->offset + n <= t->size)
+            memcpy(q + 8, t->data + run->offset, n);
+        else if(pread(t->fd, q + 8, n, run->offset) != (ssize_t)n)
+        {
+            free(body);
+            return 0;
+        }
+        q += 8 + n;
+    }
+
+    seq = append_record(j, JOURNAL_FILE, body, q - body);
+    free(body);
+    if(seq)
+    {
+        pthread_mutex_lock(&j->lock);
+        track_device(j, t->fd);
+        pthread_mutex_unlock(&j->lock);
+    }
+    return seq;
+}
+
+/*
+ * wait until record seq is on disk. whoever finds no sync under way
+ * starts one for every record appended so far; the rest wait for it, or
+ * the next one, instead of syncing again themselves. returns 0 if the
+ * journal can't be relied on, in which case the file mustn't be written.
+ */
+int journal_commit(journal_t* j, unsigned int64 seq)
+{
+    unsigned int64 upto;
+    int ok;
+
+    pthread_mutex_lock(&j->lock);
+    while(j->synced < seq && !j->failed)
+    {
+        if(j->syncing)
+        {
+            pthread_cond_wait(&j->synced_cond, &j->lock);
+            continue;
+        }
+        j->syncing = 1;
+        upto = j->appended;
+        pthread_mutex_unlock(&j->lock);
+        ok = (fdatasync(j->fd) == 0);
+        pthread_mutex_lock(&j->lock);
+        j->syncing = 0;
+        if(ok)
+            j->synced = upto;
+        else
+            j->failed = 1;
+        pthread_cond_broadcast(&j->synced_cond);
+    }
+    ok = !j->failed;
+    pthread_mutex_unlock(&j->lock);
+    return ok;
+}
+
+/*
+ * a file whose record was committed has been patched. every JOURNAL_GROUP
+ * of them, the filesystems they're on are synced.
+ */
+void journal_done(journal_t* j)
+{
+    int due;
+
+    pthread_mutex_lock(&j->lock);
+    j->files++;
+    due = (++j->pending >= JOURNAL_GROUP);
+    if(due)
+        j->pending = 0;
+    pthread_mutex_unlock(&j->lock);
+    if(due)
+        sync_devices(j);
+}
+
+/*
+ * sync whatever the run wrote, mark the run finished and close the
+ * journal. returns 0 if anything couldn't be made durable.
+ */
+int journal_close(journal_t* j)
+{
+    unsigned int32 files = j->files;
+    int ok;
+
+    ok = sync_devices(j) && !j->failed;
+    if(ok)
+        ok = append_record(j, JOURNAL_END, (const unsigned byte*)&files, 4) &&
+             fdatasync(j->fd) == 0;
+    if(!ok)
+        fprintf(stderr, "could not sync the journal or the files it covers\n");
+    close(j->fd);
+    free_devices(j);
+    return ok;
+}
+
+/*
+ * put back one file the way its record says it was
+ */
+static int restore_file(journal_t* sync, const unsigned byte* body, unsigned int32 len)
+{
+    char path[PATH_MAX];
+    unsigned int64 size;
+    unsigned int32 nruns;
+    unsigned int32 path_len;
+    unsigned int32 offset;
+    unsigned int32 n;
+    const unsigned byte* q = body + 16;
+    const unsigned byte* end = body + len;
+    struct stat st;
+    unsigned int32 i;
+    int fd;
+    int ok = 1;
+
+    if(len < 16)
+        return 0;
+    memcpy(&size, body, 8);
+    memcpy(&nruns, body + 8, 4);
+    memcpy(&path_len, body + 12, 4);
+    if(path_len >= sizeof(path) || path_len > (unsigned int32)(end - q))
+        return 0;
+    memcpy(path, q, path_len);
+    path[path_len] = '\0';
+    q += path_len;
+
+    if((fd = open(path, O_RDWR)) < 0)
+    {
+        fprintf(stderr, "could not open '%s' to roll it back\n", path);
+        return 0;
+    }
+    for(i=0; i<nruns && ok; ++i)
+    {
+        if(end - q < 8)
+        {
+            ok = 0;
+            break;
+        }
+        memcpy(&offset, q, 4);
+        memcpy(&n, q + 4, 4);
+        q += 8;
+        if(n > (unsigned int32)(end - q))
+            ok = 0;
+        else
+            ok = write_all(fd, q, n, offset, 0);
+        q += n;
+    }
+
+    /* whatever was appended goes */
+    if(ok && fstat(fd, &st) == 0 && (unsigned int64)st.st_size > size)
+        ok = (ftruncate(fd, size) == 0);
+    if(ok)
+        track_device(sync, fd);
+    else
+        fprintf(stderr, "could not roll back '%s'\n", path);
+    close(fd);
+    return ok;
+}
+
+/*
+ * undo every file patch the journal at path records, newest first, so a
+ * file patched more than once ends up as it was before the first. a torn
+ * record at the end (the run died before syncing it, so its file was
+ * never written) is ignored. returns the number of files put back, or -1
+ * if the journal can't be read.
+ */
+int journal_rollback(const char* path)
+{
+    journal_t sync;
+    journal_header_t h;
+    journal_record_t r;
+    unsigned byte* buf;
+    size_t* records;
+    size_t nrecords = 0;
+    size_t pos;
+    size_t size;
+    int finished = 0;
+    int restored = 0;
+    int failed = 0;
+    FILE* fp;
+    struct stat st;
+
+    if((fp = fopen(path, "rb")) == NULL || fstat(fileno(fp), &st) != 0)
+    {
+        fprintf(stderr, "could not open journal '%s'\n", path);
+        if(fp)
+            fclose(fp);
+        return -1;
+    }
+    size = st.st_size;
+    buf = (unsigned byte*)malloc(size ? size : 1);
+    if(fread(buf, 1, size, fp) != size || size < sizeof(h))
+    {
+        fprintf(stderr, "could not read journal '%s'\n", path);
+        fclose(fp);
+        free(buf);
+        return -1;
+    }
+    fclose(fp);
+    memcpy(&h, buf, sizeof(h));
+    if(memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 || h.version != JOURNAL_VERSION)
+    {
+        fprintf(stderr, "'%s' isn't a neftag journal\n", path);
+        free(buf);
+        return -1;
+    }
+
+    /* find every whole record, front to back */
+    records = (size_t*)malloc((size / sizeof(r) + 1) * sizeof(size_t));
+    for(pos=sizeof(h); pos + sizeof(r) <= size; pos += sizeof(r) + r.len)
+    {
+        memcpy(&r, buf + pos, sizeof(r));
+        if(r.len > size - pos - sizeof(r) ||
+           fnv1a(0xcbf29ce484222325ULL, buf + pos + sizeof(r), r.len) != r.hash)
+        {
+            fprintf(stderr, "journal '%s' ends in a torn record; ignoring it\n", path);
+            break;
+        }
+        if(r.type == JOURNAL_FILE)
+            records[nrecords++] = pos;
+        finished = (r.type == JOURNAL_END);
+    }
+
+    /* then undo them back to front */
+    init_devices(&sync);
+    while(nrecords-- > 0)
+    {
+        memcpy(&r, buf + records[nrecords], sizeof(r));
+        if(restore_file(&sync, buf + records[nrecords] + sizeof(r), r.len))
+            restored++;
+        else
+            failed++;
+    }
+    if(!sync_devices(&sync))
+        failed++;
+    free_devices(&sync);
+
+    printf("rolled back %d file%s from '%s'; the run that wrote it %s\n", restored,
+           restored == 1 ? "" : "s", path, finished ? "had finished" : "was interrupted");
+    free(records);
+    free(buf);
+    return failed ? -1 : restored;
+}
@@ -0,0 +1,90 @@
+/*
+ * journal.h
+ * undo journal of the bytes tagging overwrites, so an interrupted or
+ * unwanted run can be rolled back
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "tiff.h"
+#include "patch.h"
+#include "types.h"
+
+#define JOURNAL_MAGIC "NEFTAGJL"
+#define JOURNAL_VERSION 1
+
+/* files patched between syncs of the filesystems they live on */
+#define JOURNAL_GROUP 64
+
+/* filesystems kept track of for syncing; past this the whole system is synced */
+#define JOURNAL_MAX_DEVICES 8
+
+/* kinds of record */
+#define JOURNAL_FILE 1  /* one file's bytes from before it was patched */
+#define JOURNAL_END 2   /* the run finished and everything it wrote was synced */
+
+/*
+ * the journal starts with this header, followed by records appended as
+ * the run goes. nothing in it is byte swapped: it's only ever read back
+ * on the machine that wrote it.
+ */
+typedef struct
+{
+    char magic[8];
+    unsigned int32 version;
+    unsigned int32 pad;
+} journal_header_t;
+
+/*
+ * every record is this followed by len bytes of body. a JOURNAL_FILE
+ * body is the file's size (unsigned int64), the number of runs and the
+ * length of the path (unsigned int32 each), the path, then for each run
+ * its offset and length (unsigned int32 each) and the bytes that were
+ * there. runs past the old end of the file hold nothing; rolling back
+ * truncates the file to its old size instead. a record whose hash
+ * doesn't match its body was cut short by a crash before the sync that
+ * would have let its file be written, and ends the journal.
+ */
+typedef struct
+{
+    unsigned int32 type;
+    unsigned int32 len;
+    unsigned int64 hash;  /* FNV-1a of the body */
+} journal_record_t;
+
+/*
+ * an open journal, shared by all the workers of a run. each file's record
+ * has to be on disk before the file is written, but a worker that finds
+ * a sync already under way waits for the next one rather than starting
+ * its own, so one fdatasync covers every record appended meanwhile. the
+ * files themselves are synced a filesystem at a time, every JOURNAL_GROUP
+ * files and at the end, instead of one fsync each.
+ */
+typedef struct
+{
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t synced_cond;
+    unsigned int64 appended;  /* records written to the journal */
+    unsigned int64 synced;    /* records known to be on disk */
+    int syncing;              /* a worker is in fdatasync for everyone */
+    int failed;               /* a write or sync failed; nothing more gets patched */
+    int pending;              /* files patched since their filesystems were synced */
+    int files;
+    int devices[JOURNAL_MAX_DEVICES]; /* an open fd on each filesystem written to */
+    dev_t device_ids[JOURNAL_MAX_DEVICES];
+    int ndevices;
+    int sync_all;             /* too many filesystems to keep track of */
+} journal_t;
+
+int journal_open(journal_t* j, const char* path);
+int journal_close(journal_t* j);
+unsigned int64 journal_log(journal_t* j, const char* path, tiff_t* t, const patch_t* p);
+int journal_commit(journal_t* j, unsigned int64 seq);
+void journal_done(journal_t* j);
+int journal_rollback(const char* path);
+
+#endif
@@ -9,27 +9,93 @@
 #include <assert.h>
 #include <time.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #include <math.h>
 #include "tiff.h"
 #include "util.h"
+#include "arena.h"
+#include "tag.h"
+#include "pool.h"
+#include "track.h"
+#include "cache.h"
 #include "csv.h"
 #include "nmea.h"
+#include "gpx.h"
+#include "follow.h"
+#include "stats.h"
+#include "prefetch.h"
+#include "journal.h"
 #include "nikond90.h"
 #include "date.h"
 #include "types.h"
 
+/* state shared by the workers tagging a batch of files */
+typedef struct
+{
+    tag_config_t* cfg;
+    tag_job_t* jobs;
+    arena_t* arenas; /* one per worker */
+    stats_t* stats;  /* one per worker, or NULL if not wanted */
+    prefetch_t* prefetch; /* NULL unless prefetching headers */
+    xmp_writer_t* writers; /* one per worker, when writing sidecars */
+} batch_t;
+
 static void print_usage();
 static int parse_coordinates(char* coord_string, double* lat, double* lon);
+static int is_gps_log(const char* path);
+static int load_log(const char* path, int use_cache, track_t* track);
+static void read_one(int worker, int item, void* arg);
+static void write_one(int worker, int item, void* arg);
+static void plan_one(int worker, int item, void* arg);
+static void apply_one(int worker, int item, void* arg);
+static void write_journaled(batch_t* b, int jobs, int nfiles);
 
 void print_usage()
 {
-    printf("usage: neftag [-o utc_offset] [-w window_size] [-c coord_string] [gpslog] <rawfile>+\n\n"
+    printf("usage: neftag [-o utc_offset] [-w window_size] [-j jobs] [-N] [-f import_dir] [--io-uring]\n"
+           "              [--prefetch] [--stats[=text|json]] [--stats-file=path] [--journal=path]\n"
+           "              [--xmp] [-c coord_string] [gpslog]+ <rawfile>+\n"
+           "       neftag --rollback=path\n\n"
            "\tutc_offset is specified as X where GMT=local+X,\n"
            "\te.g., CST is GMT-6, so to tag images taken in CST, specify\n"
            "\t-o6, not -o-6. (default: 0)\n\n"
            "\twindow_size sets maximum number of seconds that the GPS timestamp\n"
            "\tmay differ from the camera's timestamp and still be considered to\n"
-           "\tmatch. (default 3600, e.g., one hour)\n"
+           "\tmatch. (default 3600, e.g., one hour)\n\n"
+           "\tjobs is the number of files to tag in parallel; 0 means one per\n"
+           "\tcore. (default 1)\n\n"
+           "\tgpslog may be an NMEA log or a GPX file. any number may be given,\n"
+           "\tup to the first raw file; they're merged into one track in time\n"
+           "\torder, and fixes stamped at the same time in more than one log\n"
+           "\tare collapsed into the best of them.\n\n"
+           "\t-N stops neftag reading or writing the index it keeps of each\n"
+           "\tparsed gps log (gpslog" TRACK_CACHE_SUFFIX ", or in $XDG_CACHE_HOME/neftag).\n\n"
+           "\timport_dir turns on follow mode: gpslog (NMEA only) is read as it\n"
+           "\tgrows, and each image written into import_dir is tagged as soon as\n"
+           "\tthe log reaches its time. runs until interrupted.\n\n"
+           "\t--io-uring opens, reads the headers of and writes to files in\n"
+           "\tbatches through io_uring, with a handful of system calls per\n"
+           "\tbatch instead of several per file. -j is ignored. falls back to\n"
+           "\tthe ordinary path if the kernel won't give us a ring.\n\n"
+           "\t--prefetch asks the kernel for the headers of the next few files\n"
+           "\twhile each one is read, going further ahead when reads stall on\n"
+           "\tstorage. only the headers are read, never the image data.\n\n"
+           "\t--journal records the bytes each file is about to have overwritten,\n"
+           "\tand its size, in the journal at path before writing it. records are\n"
+           "\tsynced a group of files at a time, and the files a filesystem at\n"
+           "\ta time, rather than with an fsync per file.\n\n"
+           "\t--rollback puts back every file the journal at path records, as it\n"
+           "\twas before the first run that wrote to the journal.\n\n"
+           "\t--xmp writes each match to an xmp sidecar next to the raw file\n"
+           "\t(DSC_0001.NEF gets DSC_0001.xmp) as exif:GPS properties, and only\n"
+           "\tever opens the raw files to read them. a sidecar that already\n"
+           "\texists keeps everything else in it. --io-uring and --journal are\n"
+           "\tignored.\n\n"
+           "\t--stats reports how long each phase took (log ingest, open,\n"
+           "\tvalid_tiff_file, ifd_load, match, write, close) with latency\n"
+           "\thistograms, and counts of files tagged, skipped and unmatched and\n"
+           "\tbytes moved, as text or json, to stdout or --stats-file.\n\n"
            "\tcoord_string is a string specifying a set of GPS coordinates. If it\n"
            "\tis specified, then no gpslog file is expected.\n\n");
 }
@@ -44,29 +110,187 @@ int parse_coordinates(char* coord_string, double* lat, double* lon)
     return 0;
 }
 
-int main(int argc, char** argv)
+/*
+ * what a file on the command line is, going by its contents: 1 for a gpx
+ * or nmea log, 0 for a tiff file (or one that can't be opened), which
+ * ends the logs, and -1 for anything else
+ */
+int is_gps_log(const char* path)
 {
-    unsigned int32 offset;
-    unsigned int i;
     FILE* fp;
+    int log;
+
+    if((fp = fopen(path, "r")) == NULL)
+        return 0;
+    if(is_tiff_file(fp))
+        log = 0;
+    else if(is_gpx_file(fp) || is_nmea_file(fp))
+        log = 1;
+    else
+        log = -1;
+    fclose(fp);
+    return log;
+}
+
+/*
+ * read one gps log into a track, in time order. if the log hasn't
+ * changed since it was last indexed, the index (which was sorted before
+ * it was written) is mapped and used as is.
+ */
+int load_log(const char* path, int use_cache, track_t* track)
+{
+    FILE* gpsf;
+    track_cache_header_t key;
+
+    if((gpsf = fopen(path, "r")) == NULL)
+    {
+        fprintf(stderr, "could not open gps log file: '%s'\n", path);
+        return 0;
+    }
+
+    /* the key describes the log as it was before any of it was parsed */
+    use_cache = use_cache && track_cache_key(fileno(gpsf), &key);
+    if(use_cache && track_cache_load(path, &key, track))
+    {
+        fclose(gpsf);
+        return 1;
+    }
+
+    /* parse the gps log file */
+    track_init(track, 1024);
+    if(is_gpx_file(gpsf))
+        parse_gpx_file(gpsf, track);
+    else
+        parse_nmea_file(gpsf, track);
+    fclose(gpsf);
+    if(track_sort(track))
+        fprintf(stderr, "gps log '%s' was out of time order; sorted it\n", path);
+    if(track->count == 0)
+        fprintf(stderr, "gps log '%s' has no fixes\n", path);
+    else if(use_cache)
+        track_cache_store(path, &key, track);
+    return 1;
+}
+
+/*
+ * pool callbacks for the two passes over the files, each using the
+ * calling worker's arena
+ */
+void read_one(int worker, int item, void* arg)
+{
+    batch_t* b = (batch_t*)arg;
+    unsigned int64 t = 0;
+
+    /* get the next few headers on their way before waiting on this one */
+    if(b->prefetch)
+    {
+        prefetch_ahead(b->prefetch, item);
+        t = stats_clock();
+    }
+    tag_read_time(&b->jobs[item], b->cfg, &b->arenas[worker],
+                  b->stats ? &b->stats[worker] : NULL);
+    if(b->prefetch)
+        prefetch_observe(b->prefetch, stats_clock() - t, b->jobs[item].header_end);
+}
+
+void write_one(int worker, int item, void* arg)
+{
+    batch_t* b = (batch_t*)arg;
+    if(b->writers)
+    {
+        tag_sidecar(&b->jobs[item], b->cfg, &b->writers[worker],
+                    b->stats ? &b->stats[worker] : NULL);
+        return;
+    }
+    tag_write(&b->jobs[item], b->cfg, &b->arenas[worker],
+              b->stats ? &b->stats[worker] : NULL);
+}
+
+void plan_one(int worker, int item, void* arg)
+{
+    batch_t* b = (batch_t*)arg;
+    tag_plan(&b->jobs[item], b->cfg, &b->arenas[worker],
+             b->stats ? &b->stats[worker] : NULL);
+}
+
+void apply_one(int worker, int item, void* arg)
+{
+    batch_t* b = (batch_t*)arg;
+    tag_apply(&b->jobs[item], b->cfg, b->stats ? &b->stats[worker] : NULL);
+}
+
+/*
+ * the write pass when there's a journal: JOURNAL_GROUP files at a time
+ * are laid out and journaled, then written, so the whole group shares a
+ * single sync of the journal however many workers there are
+ */
+void write_journaled(batch_t* b, int jobs, int nfiles)
+{
+    tag_job_t* all = b->jobs;
+    int base;
+    int n;
+
+    for(base=0; base<nfiles; base+=n)
+    {
+        n = (nfiles - base < JOURNAL_GROUP) ? nfiles - base : JOURNAL_GROUP;
+        b->jobs = all + base;
+        pool_run(jobs, n, plan_one, b);
+        pool_run(jobs, n, apply_one, b);
+    }
+    b->jobs = all;
+}
+
+int main(int argc, char** argv)
+{
     FILE* gpsf;
-    ifd_t ifd0;
-    ifd_t gps_info_ifd;
-    unsigned int32 gps_offset = 0;
-    int num_rows = 0;
-    int init_size = 1024;
-    location_t* rows = (location_t*)malloc(init_size * sizeof(location_t));
+    track_t track;
     char ch;
+    int i;
+    int nfiles;
+    tag_config_t cfg;
+    batch_t batch;
+    track_t* logs;
+    int nlogs;
 
     /* handle the command line parameters */
     int tzoffset = 0;
     int window_size = 3600;
+    int jobs = 1;
+    int use_cache = 1;
+    const char* import_dir = NULL;
+    int stats_mode = STATS_NONE;
+    const char* stats_file = NULL;
+    int use_ring = 0;
+    int use_prefetch = 0;
+    prefetch_t prefetch;
+    const char* journal_path = NULL;
+    const char* rollback_path = NULL;
+    journal_t journal;
+    int status = EXIT_SUCCESS;
+    int use_sidecar = 0;
+    stats_t total;
+    stats_t* stats;
+    unsigned int64 t;
+    struct stat st;
+    FILE* out;
+
+    static const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"stats", optional_argument, NULL, 'S'},
+        {"stats-file", required_argument, NULL, 'F'},
+        {"io-uring", no_argument, NULL, 'U'},
+        {"prefetch", no_argument, NULL, 'P'},
+        {"journal", required_argument, NULL, 'J'},
+        {"rollback", required_argument, NULL, 'R'},
+        {"xmp", no_argument, NULL, 'X'},
+        {NULL, 0, NULL, 0}
+    };
 
     /* these are for the case of coordinates given directly on command line */
     char coords[40];
     int use_nmea_file = 1;
-    double latitude;
-    double longitude;
+    double latitude = 0;
+    double longitude = 0;
     
     /* sanity check the platform */
     assert(sizeof(byte) == 1);
@@ -76,13 +300,13 @@ int main(int argc, char** argv)
     assert(sizeof(float32) == 4);
     assert(sizeof(float64) == 8);
     
-    if(argc < 3)
+    if(argc < 2)
     {
         print_usage();
         return EXIT_FAILURE;
     }
 
-    while((ch = getopt(argc, argv, "ho:w:c:")) != -1)
+    while((ch = getopt_long(argc, argv, "ho:w:j:Nf:c:", long_options, NULL)) != -1)
     {
         switch(ch)
         {
@@ -92,6 +316,46 @@ int main(int argc, char** argv)
         case 'w':
             window_size = atoi(optarg);
             break;
+        case 'j':
+            jobs = atoi(optarg);
+            if(jobs <= 0)
+                jobs = pool_default_threads();
+            break;
+        case 'N':
+            use_cache = 0;
+            break;
+        case 'f':
+            import_dir = optarg;
+            break;
+        case 'S':
+            if(!optarg || strcmp(optarg, "text") == 0)
+                stats_mode = STATS_TEXT;
+            else if(strcmp(optarg, "json") == 0)
+                stats_mode = STATS_JSON;
+            else
+            {
+                fprintf(stderr, "unknown stats format '%s'; use text or json\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            stats_file = optarg;
+            break;
+        case 'U':
+            use_ring = 1;
+            break;
+        case 'P':
+            use_prefetch = 1;
+            break;
+        case 'J':
+            journal_path = optarg;
+            break;
+        case 'R':
+            rollback_path = optarg;
+            break;
+        case 'X':
+            use_sidecar = 1;
+            break;
         case 'c':
             strncpy(coords, optarg, 40);
             if(!parse_coordinates(coords, &latitude, &longitude))
@@ -112,117 +376,203 @@ int main(int argc, char** argv)
         }
     }
 
-    if(use_nmea_file)
+    if(rollback_path)
+        return (journal_rollback(rollback_path) < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    if(optind >= argc)
     {
-        /* parse the gps log file */
-        if((gpsf = fopen(argv[optind], "r")) == NULL)
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if(use_sidecar)
+    {
+        /* nothing in the raw files to undo, and nothing for the ring to write */
+        journal_path = NULL;
+        use_ring = 0;
+    }
+    if(journal_path && !journal_open(&journal, journal_path))
+        return EXIT_FAILURE;
+
+    stats_init(&total);
+    stats = stats_mode ? &total : NULL;
+    t = stats_start(stats);
+
+    memset(&track, 0, sizeof(track_t));
+    if(import_dir)
+    {
+        /* follow mode reads the log itself, a little at a time */
+        if(!use_nmea_file || (gpsf = fopen(argv[optind], "r")) == NULL)
+        {
+            fprintf(stderr, "follow mode needs a gps log file\n");
+            return EXIT_FAILURE;
+        }
+        if(is_gpx_file(gpsf))
         {
-            fprintf(stderr, "could not open gps log file: '%s'\n", argv[optind]);
+            fprintf(stderr, "follow mode needs an NMEA log, not GPX: '%s'\n", argv[optind]);
             return EXIT_FAILURE;
         }
-        parse_nmea_file(gpsf, &rows, &num_rows, init_size);
         fclose(gpsf);
-        optind++;
+
+        track_init(&track, 1024);
+        cfg.track = &track;
+        cfg.tzoffset = tzoffset;
+        cfg.window_size = window_size;
+        cfg.use_nmea_file = use_nmea_file;
+        cfg.latitude = latitude;
+        cfg.longitude = longitude;
+        cfg.prefetch = 0;
+        cfg.journal = journal_path ? &journal : NULL;
+        cfg.sidecar = use_sidecar;
+        i = follow_run(argv[optind], import_dir, &cfg, &track, argv + optind + 1,
+                       argc - optind - 1);
+        track_free(&track);
+        if(journal_path && !journal_close(&journal))
+            i = 0;
+        return i ? EXIT_SUCCESS : EXIT_FAILURE;
     }
-    
-    /* for each image file, open and parse the tiff headers */
-    for(; optind<argc; ++optind)
+    else if(use_nmea_file)
     {
-        if((fp = fopen(argv[optind], "rb+")) == NULL)
+        /* gps logs come first, up to the first tiff file. anything among
+         * them that isn't a log is skipped */
+        logs = (track_t*)calloc(argc - optind, sizeof(track_t));
+        nlogs = 0;
+        while(optind < argc && (i = is_gps_log(argv[optind])) != 0)
         {
-            fprintf(stderr, "could not open raw file '%s'...skipping\n", argv[optind]);
-            continue;
+            if(i < 0)
+                fprintf(stderr, "skipping '%s': not an nmea or gpx log\n", argv[optind]);
+            else
+            {
+                if(!load_log(argv[optind], use_cache, &logs[nlogs]))
+                    return EXIT_FAILURE;
+                if(stat(argv[optind], &st) == 0)
+                    total.log_bytes += st.st_size;
+                nlogs++;
+            }
+            optind++;
         }
+        if(nlogs == 0)
+        {
+            fprintf(stderr, "no nmea or gpx log before the images\n");
+            return EXIT_FAILURE;
+        }
+        if(nlogs == 1)
+            track = logs[0];
+        else
+        {
+            /* rotated or overlapping logs become one track */
+            track_init(&track, 1024);
+            track_merge(&track, logs, nlogs);
+            for(i=0; i<nlogs; ++i)
+                track_free(&logs[i]);
+        }
+        free(logs);
+        total.fixes = track.count;
+    }
+    stats_record(stats, STATS_INGEST, t);
+    
+    /* the track and settings are read-only from here on, so every worker shares them */
+    cfg.track = &track;
+    cfg.tzoffset = tzoffset;
+    cfg.window_size = window_size;
+    cfg.use_nmea_file = use_nmea_file;
+    cfg.latitude = latitude;
+    cfg.longitude = longitude;
+    cfg.prefetch = use_prefetch;
+    cfg.journal = journal_path ? &journal : NULL;
+    cfg.sidecar = use_sidecar;
 
-        if(!valid_tiff_file(fp))
+    /* each worker recycles its own arena from file to file */
+    nfiles = argc - optind;
+    if(jobs > nfiles)
+        jobs = nfiles;
+    if(jobs < 1)
+        jobs = 1;
+    batch.cfg = &cfg;
+    batch.jobs = (tag_job_t*)calloc(nfiles ? nfiles : 1, sizeof(tag_job_t));
+    for(i=0; i<nfiles; ++i)
+        batch.jobs[i].path = argv[optind + i];
+    batch.arenas = (arena_t*)malloc(jobs * sizeof(arena_t));
+    for(i=0; i<jobs; ++i)
+        arena_init(&batch.arenas[i], ARENA_CHUNK_SIZE);
+    batch.stats = stats ? (stats_t*)calloc(jobs, sizeof(stats_t)) : NULL;
+    batch.prefetch = NULL;
+    batch.writers = NULL;
+    if(use_sidecar)
+    {
+        batch.writers = (xmp_writer_t*)malloc(jobs * sizeof(xmp_writer_t));
+        for(i=0; i<jobs; ++i)
+            xmp_writer_init(&batch.writers[i], batch.stats ? &batch.stats[i] : NULL);
+    }
+    if(use_prefetch)
+    {
+        prefetch_init(&prefetch, argv + optind, nfiles);
+        batch.prefetch = &prefetch;
+    }
+    
+    /* read every image's timestamp, match them all against the track in
+     * one sweep, then write the matches. the ring does all three a batch
+     * at a time. */
+    if(!use_ring || !tag_ring(batch.jobs, nfiles, &cfg, &batch.arenas[0], stats))
+    {
+        if(use_ring)
+            fprintf(stderr, "io_uring not available; using blocking i/o\n");
+        pool_run(jobs, nfiles, read_one, &batch);
+        tag_match(batch.jobs, nfiles, &cfg, stats);
+        if(journal_path)
+            write_journaled(&batch, jobs, nfiles);
+        else
+            pool_run(jobs, nfiles, write_one, &batch);
+    }
+    if(journal_path && !journal_close(&journal))
+        status = EXIT_FAILURE;
+    if(batch.writers)
+    {
+        /* whatever each worker still has queued */
+        for(i=0; i<jobs; ++i)
         {
-            fprintf(stderr, "error reading raw file '%s'; invalid tiff header...skipping\n",
-                    argv[optind]);
-            continue;
+            xmp_flush(&batch.writers[i]);
+            xmp_writer_free(&batch.writers[i]);
         }
+        free(batch.writers);
+    }
 
-        /* find the offset of the first ifd */
-        offset = read_uint32(fp);
-        fseek(fp, offset, SEEK_SET);
-        ifd_load(fp, &ifd0);
-        for(i=0; i<ifd0.count; ++i)
+    if(stats)
+    {
+        /* fold the workers' numbers into the total and report */
+        for(i=0; i<jobs; ++i)
+            stats_merge(&total, &batch.stats[i]);
+        for(i=0; i<nfiles; ++i)
         {
-            if(ifd0.dirs[i].tag == GPSInfoIFDPointer) /* GPS Info IFD pointer */
-            {
-                gps_offset = ifd0.dirs[i].uint32_values[0];
-                fseek(fp, gps_offset, SEEK_SET);
-                ifd_load(fp, &gps_info_ifd);
-            }
+            if(batch.jobs[i].status == TAG_OK)
+                total.matched++;
+            else if(batch.jobs[i].status == TAG_NO_MATCH)
+                total.unmatched++;
+            else
+                total.skipped++;
         }
-        
-        /* find the DateTimeOriginal header, and use the data to match a GPS location record */
-        for(i=0; i<ifd0.count; ++i)
+        total.files = nfiles;
+        total.wall_ns = stats_clock() - t;
+
+        out = stats_file ? fopen(stats_file, "w") : stdout;
+        if(!out)
+            fprintf(stderr, "could not open stats file '%s'\n", stats_file);
+        else
         {
-            if(ifd0.dirs[i].tag == DateTimeOriginal)
-            {
-                /*
-                 * basic algorithm is to pull the date/time from the image (in whatever time
-                 * zone the camera is set to), convert it to utc, find the nearest GPS location
-                 * record, populate a new GPSInfoIFD structure, and write it to the image
-                 */
-                struct tm t;
-                unsigned int utc_time;
-                location_t* match;
-                ifd_t gd;
-                
-                parse_datetime((const char*)ifd0.dirs[i].byte_values, &t);
-                add_offset(&t, tzoffset);
-                utc_time = timegm(&t);
-
-                if(use_nmea_file)
-                {
-                    match = find_location_at(rows, num_rows, utc_time, window_size);
-                    if(!match)
-                    {
-                        printf("no match found within 1 hour of photo '%s'...skipping\n", argv[optind]);
-                        break;
-                    }
-                }
-                else
-                {
-                    /*
-                     * if the coordinates were given on the command line, then we write them
-                     * directly into the match structure and mark all the other info as void,
-                     * 0, etc.
-                     */
-                    match->when = utc_time;
-                    match->status = 'V';
-                    match->latitude = fabs(latitude);
-                    match->lat_ref = (latitude > 0) ? 'N' : 'S';
-                    match->longitude = fabs(longitude);
-                    match->lon_ref = (longitude > 0) ? 'E' : 'W';
-                    match->speed = 0;
-                    match->heading = 0;
-                    match->altitude = 0;
-                    match->geoid_ht = 0;
-                    match->num_sat = 0;
-                    match->quality = 0;
-                }
-                
-                /* now fill the gps info ifd structure */
-                populate_gps_info_ifd(&gd, match);
-                gd.next_offset = gps_info_ifd.next_offset;
-                
-                /* write the new gps information */
-                assert(gps_offset > 0);
-                fseek(fp, gps_offset, SEEK_SET);
-                ifd_write(fp, &gd);
-                
-                ifd_free(&gd);
-                break;
-            }
+            if(stats_mode == STATS_JSON)
+                stats_print_json(out, &total);
+            else
+                stats_print_text(out, &total);
+            if(out != stdout)
+                fclose(out);
         }
-        
-        ifd_free(&ifd0);
-        ifd_free(&gps_info_ifd);
-        fclose(fp);
+        free(batch.stats);
     }
 
-    free(rows);
-    return EXIT_SUCCESS;
+    if(batch.prefetch)
+        prefetch_free(batch.prefetch);
+    for(i=0; i<jobs; ++i)
+        arena_free(&batch.arenas[i]);
+    free(batch.arenas);
+    free(batch.jobs);
+    track_free(&track);
+    return status;
 }
@@ -3,110 +3,382 @@
  * functions for parsing NMEA files
  */
 
+#define _GNU_SOURCE /* memrchr */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "nmea.h"
+#include "date.h"
+#include "pool.h"
 #include "util.h"
-#include "csv.h"
+#include "types.h"
+
+/* empty field used in place of any a short sentence doesn't have */
+static const char empty_field[] = "";
 
 /*
- * parse a file of NMEA sentences into an array of location_t records
+ * fields are not copied or terminated; each one runs up to the next
+ * ',' or the '*' checksum marker or the end of the line
  */
-void parse_nmea_file(FILE* fp, location_t** rows, int* num_recs, int max_size)
+static int field_end(char ch)
 {
-    char** toks;
-    char*  line;
-    
-    /* init some memory to use to parse the nmea file */
-    toks = (char**)malloc(NUM_TOKENS * sizeof(char*));
+    return ch == ',' || ch == '*' || ch == '\r' || ch == '\n' || ch == '\0';
+}
+
+/*
+ * unsigned integer at the start of a field
+ */
+static int field_int(const char* p)
+{
+    int n = 0;
+    while(*p >= '0' && *p <= '9')
+        n = n*10 + (*p++ - '0');
+    return n;
+}
+
+/*
+ * two digit number at position i of a field, as in hhmmss and ddmmyy
+ */
+static int field_2digits(const char* p, int i)
+{
+    if(p[i] < '0' || p[i] > '9' || p[i+1] < '0' || p[i+1] > '9')
+        return 0;
+    return (p[i] - '0')*10 + (p[i+1] - '0');
+}
+
+/*
+ * record where each field of the sentence at p starts, up to NUM_TOKENS
+ * fields, and return a pointer just past the end of the line
+ */
+static const char* split_sentence(const char* p, const char* end, const char** toks)
+{
+    int n = 0;
+    toks[n++] = p;
+    while(p < end && *p != '\n')
+    {
+        if(*p == ',' && n < NUM_TOKENS)
+            toks[n++] = p+1;
+        ++p;
+    }
+    while(n < NUM_TOKENS)
+        toks[n++] = empty_field;
+    return (p < end) ? p+1 : end;
+}
+
+/*
+ * parse the complete lines in buf, appending fixes to the track. every
+ * line must end in a newline, so field scans never run off the end.
+ * if first_rec is given it is set to the start of the first GPRMC
+ * sentence that produced a record, or left alone if none did.
+ */
+static void parse_lines(const char* buf, size_t len, track_t* track, nmea_day_t* day,
+                        const char** first_rec)
+{
+    const char* toks[NUM_TOKENS];
+    location_t rec;
+    const char* p = buf;
+    const char* end = buf + len;
 
-    /* parse each GPRMC record */
-    *num_recs = 0;
-    line = (char*)malloc(82 * sizeof(char));
-    while((line = fgets(line, 82, fp)) != NULL)
+    while(p < end)
     {
-        parse_line(line, ",", toks, NUM_TOKENS);
-        if(strncmp(toks[0], "$GPRMC", MAX_TOKEN_LEN) == 0)
+        /* skip to the start of the next sentence */
+        const char* s = memchr(p, '$', end - p);
+        if(!s)
+            break;
+
+        /* only the "$GPxxx," prefix is needed to recognise the sentence */
+        if(end - s < 7 || s[1] != 'G' || s[2] != 'P' || s[6] != ',')
+        {
+            p = s+1;
+            continue;
+        }
+        if(s[3] == 'R' && s[4] == 'M' && s[5] == 'C')
         {
-            init_rmc_rec(&(*rows)[(*num_recs)++], toks);
+            p = split_sentence(s, end, toks);
+            if(!init_rmc_rec(&rec, toks, day))
+                continue;
+            if(first_rec && !*first_rec)
+                *first_rec = s;
+            track_append(track, &rec);
         }
-        else if(strncmp(toks[0], "$GPGGA", MAX_TOKEN_LEN) == 0)
+        else if(s[3] == 'G' && s[4] == 'G' && s[5] == 'A')
         {
             /* if first record is a GPGGA record, ignore it */
-            if(*num_recs > 0)
-                process_gga_rec(&(*rows)[(*num_recs)-1], toks);
+            p = split_sentence(s, end, toks);
+            if(track->count > 0)
+            {
+                track_get(track, track->count-1, &rec);
+                process_gga_rec(&rec, toks);
+                track_set(track, track->count-1, &rec);
+            }
         }
         else
         {
             /* skip other sentence types */
-            continue;
+            p = s+1;
+        }
+    }
+}
+
+/*
+ * one piece of a log being parsed on its own thread
+ */
+typedef struct
+{
+    const char* start;
+    size_t len;
+    const char* first_rec; /* first GPRMC that made a record, if any */
+    track_t track;
+} nmea_chunk_t;
+
+static void parse_chunk(int worker, int item, void* arg)
+{
+    nmea_chunk_t* chunk = &((nmea_chunk_t*)arg)[item];
+    nmea_day_t day;
+
+    memset(&day, 0, sizeof(day));
+    track_init(&chunk->track, chunk->len / 64 + 16);
+    chunk->first_rec = NULL;
+    parse_lines(chunk->start, chunk->len, &chunk->track, &day, &chunk->first_rec);
+}
+
+/*
+ * parse the complete lines in buf on several threads. the buffer is cut
+ * into chunks at line starts, and each chunk is parsed into its own track.
+ * GPGGA sentences before a chunk's first GPRMC belong to the last record
+ * of the chunks before it, so when the tracks are joined back together in
+ * file order those sentences are replayed against it. the result is
+ * exactly what parse_lines would produce on the whole buffer.
+ */
+static void parse_lines_parallel(const char* buf, size_t len, track_t* track, int nthreads)
+{
+    int nchunks = nthreads * NMEA_CHUNKS_PER_THREAD;
+    nmea_chunk_t* chunks = (nmea_chunk_t*)calloc(nchunks, sizeof(nmea_chunk_t));
+    const char* p = buf;
+    const char* end = buf + len;
+    nmea_day_t day;
+    int total;
+    int i;
+
+    /* cut just after a newline at or beyond each nominal boundary, so every
+     * chunk is a run of whole lines starting at a sentence */
+    for(i=0; i<nchunks; ++i)
+    {
+        const char* cut = (i == nchunks-1) ? end : buf + len / nchunks * (i+1);
+        if(cut < p)
+            cut = p;
+        if(cut < end)
+        {
+            cut = memchr(cut, '\n', end - cut);
+            cut = cut ? cut+1 : end;
         }
+        chunks[i].start = p;
+        chunks[i].len = cut - p;
+        p = cut;
+    }
+
+    pool_run(nthreads, nchunks, parse_chunk, chunks);
+
+    total = track->count;
+    for(i=0; i<nchunks; ++i)
+        total += chunks[i].track.count;
+    track_reserve(track, total);
+
+    /* stitch the pieces together in order */
+    memset(&day, 0, sizeof(day));
+    for(i=0; i<nchunks; ++i)
+    {
+        const char* lead_end = chunks[i].first_rec ? chunks[i].first_rec
+            : chunks[i].start + chunks[i].len;
+
+        /* the lead-in has no records of its own, only GPGGA updates for
+         * the last record so far */
+        if(track->count > 0)
+            parse_lines(chunks[i].start, lead_end - chunks[i].start, track, &day, NULL);
+        track_append_track(track, &chunks[i].track);
+        track_free(&chunks[i].track);
+    }
+    free(chunks);
+}
+
+/*
+ * parse a block of NMEA sentences in memory, appending the fixes to the
+ * track. sentences are
+ * scanned in place without copying the text. large blocks are split
+ * across nthreads threads.
+ */
+void parse_nmea_buffer(const char* buf, size_t len, track_t* track, int nthreads)
+{
+    nmea_day_t day;
+    const char* last_nl = memrchr(buf, '\n', len);
+    size_t whole = last_nl ? (size_t)(last_nl - buf) + 1 : 0;
+
+    memset(&day, 0, sizeof(day));
+    if(nthreads > 1 && whole >= NMEA_PARALLEL_MIN)
+        parse_lines_parallel(buf, whole, track, nthreads);
+    else
+        parse_lines(buf, whole, track, &day, NULL);
+
+    /* a final sentence without a newline is copied out and terminated so
+     * the scanner can't read past the end of the mapping */
+    if(len > whole && len - whole <= MAX_SENTENCE_LEN)
+    {
+        char tail[MAX_SENTENCE_LEN + 2];
+        memcpy(tail, buf + whole, len - whole);
+        tail[len - whole] = '\n';
+        tail[len - whole + 1] = '\0';
+        parse_lines(tail, len - whole + 1, track, &day, NULL);
+    }
+}
+
+/*
+ * true if the log starts like nmea: a sentence rather than anything else,
+ * with a gps talker ($GPRMC, $GNGGA and so on) among the first
+ * NMEA_SNIFF_LEN bytes, since some loggers begin with sentences of their
+ * own. the file position is left where it was.
+ */
+int is_nmea_file(FILE* fp)
+{
+    char buf[NMEA_SNIFF_LEN];
+    long pos = ftell(fp);
+    size_t n = fread(buf, 1, sizeof(buf), fp);
+    size_t i = 0, first;
 
-        /* if we've run out of space, realloc twice the space and keep going */
-        if(*num_recs >= max_size)
+    fseek(fp, pos, SEEK_SET);
+    while(i < n && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '\r' || buf[i] == '\n'))
+        i++;
+    if(i == n || buf[i] != '$')
+        return 0;
+    for(first = i; i + 7 <= n; ++i)
+    {
+        if((i == first || buf[i-1] == '\n') && buf[i] == '$' && buf[i+1] == 'G' &&
+           isupper((unsigned char)buf[i+2]) && isupper((unsigned char)buf[i+3]) &&
+           isupper((unsigned char)buf[i+4]) && isupper((unsigned char)buf[i+5]) &&
+           buf[i+6] == ',')
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * parse a file of NMEA sentences into a track.
+ * the file is mapped and scanned in place, using every core for large
+ * logs; if it can't be mapped (a pipe, say) it is read into memory first.
+ */
+void parse_nmea_file(FILE* fp, track_t* track)
+{
+    struct stat st;
+    char* buf;
+    size_t len = 0;
+
+    if(fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+       (buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) != MAP_FAILED)
+    {
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+        parse_nmea_buffer(buf, st.st_size, track, pool_default_threads());
+        munmap(buf, st.st_size);
+        return;
+    }
+
+    /* fall back to slurping the stream */
+    {
+        size_t cap = 65536;
+        size_t n;
+        buf = (char*)malloc(cap);
+        while((n = fread(buf + len, 1, cap - len, fp)) > 0)
         {
-            max_size = max_size * 2;
-            *rows = (location_t*)realloc(*rows, max_size * sizeof(location_t));
-            if(!*rows)
+            len += n;
+            if(len == cap)
             {
-                fprintf(stderr, "error enlarging nmea sentences array\n");
-                exit(EXIT_FAILURE);
+                cap *= 2;
+                buf = (char*)realloc(buf, cap);
+                if(!buf)
+                {
+                    fprintf(stderr, "out of memory reading gps log\n");
+                    exit(EXIT_FAILURE);
+                }
             }
         }
+        parse_nmea_buffer(buf, len, track, pool_default_threads());
+        free(buf);
     }
-    free(toks);
-    free(line);
 }
 
 /*
- * builds up a location_t record based on a parsed GPRMC sentence
+ * true if the field starts with at least n digits
  */
-void init_rmc_rec(location_t* rec, char** toks)
+static int field_digits(const char* p, int n)
 {
-    struct tm fix_time;
-    char tmp[3];
-    
-    /* time */
-    strncpy(tmp, toks[1], 2);
-    fix_time.tm_hour = atoi(tmp);
-    strncpy(tmp, toks[1]+2, 2);
-    fix_time.tm_min = atoi(tmp);
-    strncpy(tmp, toks[1]+4, 2);
-    fix_time.tm_sec = atoi(tmp);
-
-    /* date */
-    strncpy(tmp, toks[9], 2);
-    fix_time.tm_mday = atoi(tmp);
-    strncpy(tmp, toks[9]+2, 2);
-    fix_time.tm_mon = atoi(tmp) - 1;
-    strncpy(tmp, toks[9]+4, 2);
-    fix_time.tm_year = 2000 + atoi(tmp) - 1900;
-
-    /* set the offset from UTC to 0, as GPS reports times in UTC anyway */
-    fix_time.tm_gmtoff = 0;
-    
-    rec->when = timegm(&fix_time);
-    rec->status = toks[2][0];
-    rec->latitude = atof(toks[3]);
-    rec->lat_ref = toks[4][0];
-    rec->longitude = atof(toks[5]); 
-    rec->lon_ref = toks[6][0];
-    rec->speed = atof(toks[7]);
-    rec->heading = atof(toks[8]);
+    int i;
+    for(i=0; i<n; ++i)
+    {
+        if(p[i] < '0' || p[i] > '9')
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * builds up a location_t record based on a parsed GPRMC sentence.
+ * returns 0 if the sentence has no usable time or date.
+ */
+int init_rmc_rec(location_t* rec, const char** toks, nmea_day_t* day)
+{
+    const char* frac;
+    int scale;
+
+    if(!field_digits(toks[1], 6) || !field_digits(toks[9], 6))
+        return 0;
+
+    /* the date only changes at midnight, so the day number is worked out
+     * once and reused for every fix until the ddmmyy field changes */
+    if(memcmp(day->ddmmyy, toks[9], 6) != 0)
+    {
+        memcpy(day->ddmmyy, toks[9], 6);
+        day->midnight = (time_t)days_from_civil(2000 + field_2digits(toks[9], 4),
+                                                field_2digits(toks[9], 2),
+                                                field_2digits(toks[9], 0)) * 86400;
+    }
+
+    /* time is hhmmss with optional fractional seconds; GPS reports UTC,
+     * so there's no time zone to worry about */
+    rec->when = day->midnight + field_2digits(toks[1], 0) * 3600 +
+        field_2digits(toks[1], 2) * 60 + field_2digits(toks[1], 4);
+    rec->msec = 0;
+    if(toks[1][6] == '.')
+    {
+        for(frac = toks[1]+7, scale = 100; scale > 0 && *frac >= '0' && *frac <= '9'; ++frac)
+        {
+            rec->msec += (*frac - '0') * scale;
+            scale /= 10;
+        }
+    }
+
+    rec->status = field_end(toks[2][0]) ? '\0' : toks[2][0];
+    rec->latitude = parse_decimal(toks[3]);
+    rec->lat_ref = field_end(toks[4][0]) ? '\0' : toks[4][0];
+    rec->longitude = parse_decimal(toks[5]); 
+    rec->lon_ref = field_end(toks[6][0]) ? '\0' : toks[6][0];
+    rec->speed = parse_decimal(toks[7]);
+    rec->heading = parse_decimal(toks[8]);
 
     /* these fields aren't part of GPRMS sentence; we'll add them later */
     rec->altitude = 0;
     rec->geoid_ht = 0;
+    rec->have_altitude = 0;
     rec->quality = 0;
     rec->num_sat = 0;
+    return 1;
 }
 
 /*
  * updates a given location_t record with information from a parsed GPGGA sentence
  */
-void process_gga_rec(location_t* rec, char** toks)
+void process_gga_rec(location_t* rec, const char** toks)
 {
     /* if we've already seen a more accurate GPGGA record and used it,
        then bail.  this is because there may be multiple GPGGA records
@@ -116,49 +388,27 @@ void process_gga_rec(location_t* rec, char** toks)
         return;
 
     /* make sure we have at least some kind of fix */
-    if(atoi(toks[6]) == 0)
+    if(field_int(toks[6]) == 0)
         return;
 
     /* update the previous location_t record with the fix and altitude data
        from the currently parsed GPGGA sentence tokens */
-    rec->quality = atoi(toks[6]);
-    rec->num_sat = atoi(toks[7]);
-    rec->altitude = atof(toks[9]);
-    rec->geoid_ht = atof(toks[11]);
-}
-
-/*
- * custom binary search that looks for the record in the array whose timestamp
- * is nearest to the given timestamp.  if no records are stamped within epsilon
- * seconds, returns NULL.
- */
-location_t* find_location_at(location_t* rows, unsigned int nrows, time_t ts, int epsilon)
-{
-    int low = 0;
-    int mid;
-    int high = nrows - 1;
-
-    while(low <= high)
-    {
-        mid = (low + high) / 2;
-        if(rows[mid].when < ts)
-            low = mid + 1;
-        else if(rows[mid].when > ts)
-            high = mid - 1;
-        else
-            return &rows[mid];
-    }
-
-    /* low has passed high, so check which is closer to desired time */
-    if(fabs(rows[high].when - ts) <= fabs(rows[low].when - ts) &&
-       fabs(rows[high].when - ts) <= epsilon)
-        return &rows[high];
-    else if(fabs(rows[low].when - ts) < fabs(rows[high].when - ts) &&
-       fabs(rows[low].when - ts) <= epsilon)
-        return &rows[low];
+    rec->quality = field_int(toks[6]);
+    rec->num_sat = field_int(toks[7]);
+    rec->altitude = parse_decimal(toks[9]);
+    rec->geoid_ht = parse_decimal(toks[11]);
 
-    /* no record found within required time limit */
-    return NULL;
+    /*
+     * only report altitude if we have a geoid height
+     * 
+     * geoid height is the correction required to get accurate MSL (mean sea level)
+     * altitude information. For my SiRF device at least, it appears that the altitude
+     * field is already updated with the correction, so as long as the GPS receiver
+     * had a good enough fix to record a geoid height, then the raw altitude readout
+     * should be accurate. On some devices, you may have to record the altitude as
+     * "altitude - geoid_height".
+     */
+    rec->have_altitude = fabs(rec->geoid_ht) > 1e-3;
 }
 
 /* convert nmea Dm.H format to degrees, minutes, seconds */
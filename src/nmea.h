@@ -8,31 +8,37 @@
 
 #include <stdio.h>
 #include <time.h>
+#include "track.h"
 
 #define NUM_TOKENS 20
-#define MAX_TOKEN_LEN 80
 
+/* longest sentence the standard allows, with a little slack */
+#define MAX_SENTENCE_LEN 128
+
+/* logs smaller than this aren't worth parsing on several threads */
+#define NMEA_PARALLEL_MIN (8 << 20)
+
+/* how much of a file is looked at to tell whether it's nmea */
+#define NMEA_SNIFF_LEN 4096
+
+/* chunks per thread, so work stealing can even out uneven chunks */
+#define NMEA_CHUNKS_PER_THREAD 4
+
+/*
+ * the ddmmyy field of consecutive GPRMC sentences only changes at
+ * midnight, so the epoch of the current day is cached between them
+ */
 typedef struct
 {
-    time_t when;
-    char status; /* A (active), V (void) */
-    double latitude;
-    char lat_ref;
-    double longitude;
-    char lon_ref;
-    double speed; /* in knots */
-    double heading; /* in degrees */
-    double altitude; /* in meters */
-    double geoid_ht; /* in meters */
-    int num_sat;
-    int quality;
-} location_t;
-
-void parse_nmea_file(FILE* fp, location_t** rows, int* num_rows, int max_size);
-void init_rmc_rec(location_t* rec, char** toks);
-void process_gga_rec(location_t* rec, char** toks);
-location_t* find_location_at(location_t* rows, unsigned int nrows, time_t timestamp,
-    int epsilon);
+    char ddmmyy[6];
+    time_t midnight;
+} nmea_day_t;
+
+int is_nmea_file(FILE* fp);
+void parse_nmea_file(FILE* fp, track_t* track);
+void parse_nmea_buffer(const char* buf, size_t len, track_t* track, int nthreads);
+int init_rmc_rec(location_t* rec, const char** toks, nmea_day_t* day);
+void process_gga_rec(location_t* rec, const char** toks);
 void dec2dms(double dec, int* deg, int* min, double* sec);
 
 #endif
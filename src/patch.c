@@ -0,0 +1,113 @@
+/*
+ * patch.c
+ * the list of byte runs to write into a tiff file to tag it
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "patch.h"
+
+void patch_init(patch_t* p)
+{
+    p->count = 0;
+}
+
+/*
+ * add a run to write as it is, after those already added. returns 0 if
+ * the patch is already full.
+ */
+int patch_add(patch_t* p, unsigned int32 offset, const void* data, unsigned int32 len)
+{
+    patch_run_t* run;
+
+    if(len == 0)
+        return 1;
+    if(p->count == PATCH_MAX_RUNS)
+    {
+        fprintf(stderr, "too many runs in one patch\n");
+        return 0;
+    }
+    run = &p->runs[p->count++];
+    run->offset = offset;
+    run->len = len;
+    run->data = (const unsigned byte*)data;
+    return 1;
+}
+
+/*
+ * add only the parts of len bytes of data that differ from what the file
+ * already holds at offset. bytes past the end of what's mapped count as
+ * different. if the file already matches, nothing is added; if the
+ * differences are scattered over more runs than there's room for, the
+ * last one is stretched to cover the rest. returns 0 if the patch is
+ * already full.
+ */
+int patch_diff(patch_t* p, tiff_t* t, unsigned int32 offset, const void* data, unsigned int32 len)
+{
+    const unsigned byte* want = (const unsigned byte*)data;
+    const unsigned byte* have = t->data + offset;
+    int first = p->count;
+    unsigned int32 avail;
+    unsigned int32 i = 0;
+    unsigned int32 start;
+    unsigned int32 same;
+    patch_run_t* last;
+
+    avail = (offset < t->size) ? t->size - offset : 0;
+    if(avail > len)
+        avail = len;
+
+    while(i < len)
+    {
+        /* skip what already matches */
+        while(i < avail && have[i] == want[i])
+            ++i;
+        if(i == len)
+            break;
+
+        /* then take differing bytes until a long enough stretch matches */
+        start = i;
+        same = 0;
+        while(i < len && same < PATCH_MIN_GAP)
+        {
+            if(i < avail && have[i] == want[i])
+                same++;
+            else
+                same = 0;
+            ++i;
+        }
+
+        if(p->count == PATCH_MAX_RUNS && p->count > first)
+        {
+            last = &p->runs[p->count - 1];
+            last->len = offset + i - same - last->offset;
+        }
+        else if(!patch_add(p, offset + start, want + start, i - start - same))
+            return 0;
+    }
+    return 1;
+}
+
+/* total bytes the patch will write */
+unsigned int32 patch_bytes(const patch_t* p)
+{
+    unsigned int32 n = 0;
+    int i;
+    for(i=0; i<p->count; ++i)
+        n += p->runs[i].len;
+    return n;
+}
+
+/*
+ * write every run of the patch with a positioned write each
+ */
+int patch_apply(const patch_t* p, tiff_t* t)
+{
+    int i;
+    for(i=0; i<p->count; ++i)
+    {
+        if(!tiff_write(t, p->runs[i].offset, p->runs[i].data, p->runs[i].len))
+            return 0;
+    }
+    return 1;
+}
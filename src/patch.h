@@ -0,0 +1,45 @@
+/*
+ * patch.h
+ * the list of byte runs to write into a tiff file to tag it
+ */
+
+#ifndef _PATCH_H_
+#define _PATCH_H_
+
+#include "tiff.h"
+#include "types.h"
+
+/* most runs one patch can hold */
+#define PATCH_MAX_RUNS 8
+
+/* differing bytes closer together than this are written as one run,
+ * since a second write costs more than rewriting a few equal bytes */
+#define PATCH_MIN_GAP 16
+
+/* len bytes from data, to be written at offset in the file */
+typedef struct
+{
+    unsigned int32 offset;
+    unsigned int32 len;
+    const unsigned byte* data;
+} patch_run_t;
+
+/*
+ * everything tagging a file will write to it, in the order it's to be
+ * written: new blocks first, then whatever points at them, so a run cut
+ * short leaves the file as it was. the data each run points at belongs
+ * to the caller and must outlive the patch.
+ */
+typedef struct
+{
+    int count;
+    patch_run_t runs[PATCH_MAX_RUNS];
+} patch_t;
+
+void patch_init(patch_t* p);
+int patch_add(patch_t* p, unsigned int32 offset, const void* data, unsigned int32 len);
+int patch_diff(patch_t* p, tiff_t* t, unsigned int32 offset, const void* data, unsigned int32 len);
+unsigned int32 patch_bytes(const patch_t* p);
+int patch_apply(const patch_t* p, tiff_t* t);
+
+#endif
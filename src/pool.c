@@ -0,0 +1,189 @@
+/*
+ * pool.c
+ * work-stealing thread pool for running one job per input file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pool.h"
+
+/*
+ * each worker owns a contiguous range of items, [lo, hi). it takes work
+ * from the front of its own range, and when that runs dry it steals the
+ * back half of whichever other worker has the most left. a file that
+ * takes a long time only holds up the worker that has it.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    int lo;
+    int hi;
+} pool_range_t;
+
+typedef struct
+{
+    int nthreads;
+    pool_range_t* ranges;
+    pool_fn fn;
+    void* arg;
+} pool_t;
+
+typedef struct
+{
+    pool_t* pool;
+    int id;
+} pool_worker_t;
+
+/*
+ * number of workers to use when asked for "as many as there are cores"
+ */
+int pool_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+/*
+ * take the next item from our own range, or -1 if it's empty
+ */
+static int pool_pop(pool_range_t* r)
+{
+    int item = -1;
+    pthread_mutex_lock(&r->lock);
+    if(r->lo < r->hi)
+        item = r->lo++;
+    pthread_mutex_unlock(&r->lock);
+    return item;
+}
+
+/*
+ * number of items left in a range
+ */
+static int pool_remaining(pool_range_t* r)
+{
+    int n;
+    pthread_mutex_lock(&r->lock);
+    n = r->hi - r->lo;
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+/*
+ * move the back half of the fullest other range into ours. returns 0
+ * once there is nothing left anywhere.
+ */
+static int pool_steal(pool_t* p, int self)
+{
+    int i;
+    int victim = -1;
+    int most = 0;
+    int lo = 0;
+    int hi = 0;
+
+    /* pick the victim with the most work left. its range may shrink
+     * before we get to it, which only costs us another pass. */
+    for(i=0; i<p->nthreads; ++i)
+    {
+        int n = (i != self) ? pool_remaining(&p->ranges[i]) : 0;
+        if(n > most)
+        {
+            most = n;
+            victim = i;
+        }
+    }
+    if(victim < 0)
+        return 0;
+
+    /* only ever hold one lock at a time, so two thieves can't deadlock */
+    pthread_mutex_lock(&p->ranges[victim].lock);
+    if(p->ranges[victim].lo < p->ranges[victim].hi)
+    {
+        pool_range_t* v = &p->ranges[victim];
+        lo = v->lo + (v->hi - v->lo) / 2;
+        hi = v->hi;
+        v->hi = lo;
+    }
+    pthread_mutex_unlock(&p->ranges[victim].lock);
+
+    pthread_mutex_lock(&p->ranges[self].lock);
+    p->ranges[self].lo = lo;
+    p->ranges[self].hi = hi;
+    pthread_mutex_unlock(&p->ranges[self].lock);
+    return 1;
+}
+
+static void* pool_worker(void* data)
+{
+    pool_worker_t* w = (pool_worker_t*)data;
+    pool_t* p = w->pool;
+    int item;
+
+    for(;;)
+    {
+        while((item = pool_pop(&p->ranges[w->id])) >= 0)
+            p->fn(w->id, item, p->arg);
+        if(!pool_steal(p, w->id))
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * run fn on every item in [0, nitems) using nthreads workers, and wait
+ * for them all to finish. with a single worker everything runs on the
+ * calling thread.
+ */
+void pool_run(int nthreads, int nitems, pool_fn fn, void* arg)
+{
+    pool_t p;
+    pool_worker_t* workers;
+    pthread_t* threads;
+    int i;
+
+    if(nthreads > nitems)
+        nthreads = nitems;
+    if(nthreads <= 1)
+    {
+        for(i=0; i<nitems; ++i)
+            fn(0, i, arg);
+        return;
+    }
+
+    p.nthreads = nthreads;
+    p.fn = fn;
+    p.arg = arg;
+    p.ranges = (pool_range_t*)malloc(nthreads * sizeof(pool_range_t));
+    workers = (pool_worker_t*)malloc(nthreads * sizeof(pool_worker_t));
+    threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+
+    /* start everyone off with an equal share */
+    for(i=0; i<nthreads; ++i)
+    {
+        pthread_mutex_init(&p.ranges[i].lock, NULL);
+        p.ranges[i].lo = (int)((long long)nitems * i / nthreads);
+        p.ranges[i].hi = (int)((long long)nitems * (i+1) / nthreads);
+        workers[i].pool = &p;
+        workers[i].id = i;
+    }
+
+    /* the calling thread doubles as worker 0 */
+    for(i=1; i<nthreads; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, pool_worker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "could not start worker thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pool_worker(&workers[0]);
+    for(i=1; i<nthreads; ++i)
+        pthread_join(threads[i], NULL);
+
+    for(i=0; i<nthreads; ++i)
+        pthread_mutex_destroy(&p.ranges[i].lock);
+    free(threads);
+    free(workers);
+    free(p.ranges);
+}
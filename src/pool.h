@@ -0,0 +1,15 @@
+/*
+ * pool.h
+ * work-stealing thread pool for running one job per input file
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/* job callback; worker is in [0, nthreads) and item in [0, nitems) */
+typedef void (*pool_fn)(int worker, int item, void* arg);
+
+int pool_default_threads(void);
+void pool_run(int nthreads, int nitems, pool_fn fn, void* arg);
+
+#endif
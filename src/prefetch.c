@@ -0,0 +1,110 @@
+/*
+ * prefetch.c
+ * read the headers of the next few files into the page cache while the
+ * current one is being tagged
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "prefetch.h"
+
+#define PREFETCH_PAGE 4096
+
+void prefetch_init(prefetch_t* pf, char** paths, int npaths)
+{
+    memset(pf, 0, sizeof(prefetch_t));
+    pthread_mutex_init(&pf->lock, NULL);
+    pf->paths = paths;
+    pf->npaths = npaths;
+    pf->issued = (unsigned byte*)calloc(npaths ? npaths : 1, 1);
+    pf->depth = PREFETCH_MIN_DEPTH;
+    pf->size = PREFETCH_MIN_SIZE;
+}
+
+void prefetch_free(prefetch_t* pf)
+{
+    pthread_mutex_destroy(&pf->lock);
+    free(pf->issued);
+    pf->issued = NULL;
+}
+
+/*
+ * about to read the given item: ask the kernel to start reading the
+ * headers of it and the files after it, up to the current depth. only
+ * the header is asked for, so none of the image data lands in the cache.
+ */
+void prefetch_ahead(prefetch_t* pf, int item)
+{
+    int want[PREFETCH_MAX_DEPTH + 1];
+    int n = 0;
+    int last;
+    int i;
+    int fd;
+    unsigned int32 size;
+
+    pthread_mutex_lock(&pf->lock);
+    last = item + pf->depth;
+    if(last >= pf->npaths)
+        last = pf->npaths - 1;
+    for(i=item; i<=last; ++i)
+    {
+        if(!pf->issued[i])
+        {
+            pf->issued[i] = 1;
+            want[n++] = i;
+        }
+    }
+    size = pf->size;
+    pthread_mutex_unlock(&pf->lock);
+
+    /* WILLNEED starts the reads and returns; nobody waits for them here */
+    for(i=0; i<n; ++i)
+    {
+        if((fd = open(pf->paths[want[i]], O_RDONLY)) < 0)
+            continue;
+        posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+/*
+ * a header read took ns and needed the first header_end bytes of the
+ * file; adjust the depth and size for the reads to come
+ */
+void prefetch_observe(prefetch_t* pf, unsigned int64 ns, unsigned int32 header_end)
+{
+    unsigned int32 size;
+
+    pthread_mutex_lock(&pf->lock);
+
+    /* cover the largest header seen, to the page */
+    size = (header_end + PREFETCH_PAGE - 1) & ~(PREFETCH_PAGE - 1);
+    if(size > pf->size)
+        pf->size = (size < PREFETCH_MAX_SIZE) ? size : PREFETCH_MAX_SIZE;
+
+    if(pf->fast_ns && ns > PREFETCH_STALL * pf->fast_ns)
+    {
+        /* waited on storage: the prefetch isn't far enough ahead */
+        pf->depth *= 2;
+        if(pf->depth > PREFETCH_MAX_DEPTH)
+            pf->depth = PREFETCH_MAX_DEPTH;
+        pf->hits = 0;
+    }
+    else
+    {
+        /* drop straight to a faster read, drift up to slower ones */
+        if(!pf->fast_ns || ns < pf->fast_ns)
+            pf->fast_ns = ns;
+        else
+            pf->fast_ns = (7 * pf->fast_ns + ns) / 8;
+        if(++pf->hits >= pf->depth && pf->depth > PREFETCH_MIN_DEPTH)
+        {
+            pf->depth--;
+            pf->hits = 0;
+        }
+    }
+    pthread_mutex_unlock(&pf->lock);
+}
@@ -0,0 +1,48 @@
+/*
+ * prefetch.h
+ * read the headers of the next few files into the page cache while the
+ * current one is being tagged
+ */
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <pthread.h>
+#include "types.h"
+
+/* bounds on how many files ahead of the current one are prefetched */
+#define PREFETCH_MIN_DEPTH 2
+#define PREFETCH_MAX_DEPTH 64
+
+/* bounds on how much of the start of each file is prefetched. it starts
+ * at the minimum and grows to cover the largest header seen so far. */
+#define PREFETCH_MIN_SIZE 16384
+#define PREFETCH_MAX_SIZE (1 << 20)
+
+/* a header read this many times slower than usual had to wait on storage */
+#define PREFETCH_STALL 4
+
+/*
+ * the prefetch window over a list of files. the depth doubles whenever a
+ * read stalls, meaning the prefetch didn't get far enough ahead, and
+ * shrinks back one at a time while reads keep finding their header
+ * already cached. shared by all the workers of a pass.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    char** paths;
+    int npaths;
+    unsigned byte* issued;    /* nonzero once a file's header has been asked for */
+    int depth;                /* files ahead of the current one to prefetch */
+    unsigned int32 size;      /* bytes from the start of each file to prefetch */
+    unsigned int64 fast_ns;   /* running average time of reads that didn't stall */
+    int hits;                 /* reads since the last stall or shrink */
+} prefetch_t;
+
+void prefetch_init(prefetch_t* pf, char** paths, int npaths);
+void prefetch_free(prefetch_t* pf);
+void prefetch_ahead(prefetch_t* pf, int item);
+void prefetch_observe(prefetch_t* pf, unsigned int64 ns, unsigned int32 header_end);
+
+#endif
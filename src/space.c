@@ -0,0 +1,333 @@
+/*
+ * space.c
+ * map of which bytes of a tiff file's header are spoken for, for finding
+ * room for blocks that have grown
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "space.h"
+#include "nikond90.h"
+
+/* image data and ifd links that aren't in nikond90.h */
+#define TileOffsets 0x0144
+#define TileByteCounts 0x0145
+#define JPEGInterchangeFormat 0x0201
+#define JPEGInterchangeFormatLength 0x0202
+#define InteropIFDPointer 0xa005
+
+static void push_span(span_t** spans, int* count, int* capacity, arena_t* arena,
+                      unsigned int32 start, unsigned int32 end)
+{
+    span_t* grown;
+
+    if(*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 32;
+        grown = (span_t*)arena_alloc(arena, *capacity * sizeof(span_t));
+        if(*count)
+            memcpy(grown, *spans, *count * sizeof(span_t));
+        *spans = grown;
+    }
+    (*spans)[*count].start = start;
+    (*spans)[*count].end = end;
+    (*count)++;
+}
+
+/* add an ifd to visit, unless it's already been seen */
+static void push_ifd(unsigned int32* queue, int* count, unsigned int32 offset)
+{
+    int i;
+
+    if(offset == 0 || *count == SPACE_MAX_IFDS)
+        return;
+    for(i=0; i<*count; ++i)
+        if(queue[i] == offset)
+            return;
+    queue[(*count)++] = offset;
+}
+
+static int compare_spans(const void* a, const void* b)
+{
+    const span_t* sa = (const span_t*)a;
+    const span_t* sb = (const span_t*)b;
+    if(sa->start != sb->start)
+        return (sa->start < sb->start) ? -1 : 1;
+    return 0;
+}
+
+/* the bytes an entry's values take up outside the entry, if any */
+static int value_span(direntry_t* dir, span_t* span)
+{
+    unsigned int64 nbytes;
+
+    if(dir->type < BYTE || dir->type > DOUBLE)
+        return 0;
+    nbytes = (unsigned int64)dir->count * type_bytes[dir->type];
+    if(nbytes <= 4 || dir->offset + nbytes > 0xFFFFFFFFULL)
+        return 0;
+    span->start = dir->offset;
+    span->end = (unsigned int32)(dir->offset + nbytes);
+    return 1;
+}
+
+/* value i of a SHORT or LONG entry whose values have been decoded */
+static unsigned int32 int_value(direntry_t* dir, unsigned int32 i)
+{
+    return (dir->type == SHORT) ? dir->uint16_values[i] : dir->uint32_values[i];
+}
+
+/*
+ * how far the block of the ifd at offset runs without a break: its entry
+ * table plus any of its out-of-line values laid out right after it (give
+ * or take a pad byte each), as gps_ifd_encode lays them out. a new block
+ * no longer than this can go straight over the old one.
+ */
+unsigned int32 space_ifd_extent(tiff_t* t, unsigned int32 offset, ifd_t* ifd)
+{
+    unsigned int32 end = offset + IFD_SIZE(ifd->count);
+    span_t span;
+    int grew = 1;
+    int i;
+
+    while(grew)
+    {
+        grew = 0;
+        for(i=0; i<ifd->count; ++i)
+        {
+            if(value_span(&ifd->dirs[i], &span) && span.start >= offset &&
+               span.start <= end + 1 && span.end > end)
+            {
+                end = span.end;
+                grew = 1;
+            }
+        }
+    }
+
+    /* values start on word boundaries, so a pad byte is never anything's */
+    return (end + 1) & ~1;
+}
+
+/*
+ * record a range as in use, keeping the list in order
+ */
+void space_mark(space_t* s, unsigned int32 start, unsigned int32 len)
+{
+    int i;
+
+    if(len == 0)
+        return;
+    push_span(&s->used, &s->count, &s->capacity, s->arena, start, start + len);
+    for(i=s->count-1; i>0 && s->used[i-1].start > start; --i)
+    {
+        span_t tmp = s->used[i];
+        s->used[i] = s->used[i-1];
+        s->used[i-1] = tmp;
+    }
+    if(start + len > s->eof)
+        s->eof = start + len;
+}
+
+/*
+ * hand a used range back as spare, for a block that's going to be
+ * rewritten bigger in place (an ifd's entry table, say, whose values
+ * stay where they are)
+ */
+void space_release(space_t* s, unsigned int32 start, unsigned int32 len)
+{
+    int i;
+
+    for(i=0; i<s->count; ++i)
+    {
+        if(s->used[i].start == start && s->used[i].end == start + len)
+        {
+            memmove(&s->used[i], &s->used[i+1], (s->count - i - 1) * sizeof(span_t));
+            s->count--;
+            break;
+        }
+    }
+    push_span(&s->spare, &s->nspare, &s->spare_capacity, s->arena, start, start + len);
+}
+
+/*
+ * map a file's header, starting from ifd0 and following every chain,
+ * SubIFDs, Exif, GPS and interoperability pointer from there. the ifd at
+ * the offset replacing (0 for none) is about to be rewritten, so its
+ * ranges are spare rather than used. returns 0 if some part of the header
+ * couldn't be read; the map then offers no gaps, only the end of file.
+ */
+int space_build(space_t* s, tiff_t* t, ifd_t* ifd0, unsigned int32 replacing, arena_t* arena)
+{
+    unsigned int32 queue[SPACE_MAX_IFDS];
+    int nqueued = 0;
+    int next;
+    int ok = 1;
+    int i;
+    unsigned int32 j;
+    unsigned int32 off;
+    ifd_t loaded;
+    ifd_t* ifd;
+    direntry_t* dir;
+    direntry_t* lengths;
+    span_t span;
+
+    memset(s, 0, sizeof(space_t));
+    s->arena = arena;
+    s->header_end = t->size;
+    s->eof = t->size;
+    push_span(&s->used, &s->count, &s->capacity, arena, 0, 8);
+
+    push_ifd(queue, &nqueued, t->first_ifd);
+    for(next=0; next<nqueued; ++next)
+    {
+        off = queue[next];
+        if(next == 0)
+            ifd = ifd0;
+        else if(ifd_load(t, off, &loaded, arena))
+            ifd = &loaded;
+        else
+        {
+            ok = 0;
+            continue;
+        }
+
+        /* the ifd's own table and values */
+        if(off == replacing)
+            push_span(&s->spare, &s->nspare, &s->spare_capacity, arena, off, off + IFD_SIZE(ifd->count));
+        else
+            push_span(&s->used, &s->count, &s->capacity, arena, off, off + IFD_SIZE(ifd->count));
+        for(i=0; i<ifd->count; ++i)
+        {
+            dir = &ifd->dirs[i];
+            if(!value_span(dir, &span))
+                continue;
+            if(off == replacing)
+                push_span(&s->spare, &s->nspare, &s->spare_capacity, arena, span.start, span.end);
+            else
+                push_span(&s->used, &s->count, &s->capacity, arena, span.start, span.end);
+        }
+
+        /* the ifds it leads to */
+        for(i=0; i<ifd->count; ++i)
+        {
+            dir = &ifd->dirs[i];
+            if(dir->tag != SubIFDs && dir->tag != ExifIFDPointer &&
+               dir->tag != GPSInfoIFDPointer && dir->tag != InteropIFDPointer)
+                continue;
+            if(dir->type != LONG || !direntry_values(t, dir, arena))
+            {
+                ok = 0;
+                continue;
+            }
+            for(j=0; j<dir->count; ++j)
+                push_ifd(queue, &nqueued, dir->uint32_values[j]);
+        }
+        push_ifd(queue, &nqueued, ifd->next_offset);
+
+        /* and the image data it describes */
+        for(i=0; i<ifd->count; ++i)
+        {
+            dir = &ifd->dirs[i];
+            if(dir->tag == StripOffsets)
+                lengths = ifd_find(ifd, StripByteCounts);
+            else if(dir->tag == TileOffsets)
+                lengths = ifd_find(ifd, TileByteCounts);
+            else if(dir->tag == JPEGInterchangeFormat)
+                lengths = ifd_find(ifd, JPEGInterchangeFormatLength);
+            else
+                continue;
+            if(!lengths || lengths->count < dir->count ||
+               (dir->type != SHORT && dir->type != LONG) ||
+               (lengths->type != SHORT && lengths->type != LONG) ||
+               !direntry_values(t, dir, arena) || !direntry_values(t, lengths, arena))
+            {
+                ok = 0;
+                continue;
+            }
+            for(j=0; j<dir->count; ++j)
+            {
+                unsigned int32 start = int_value(dir, j);
+                push_span(&s->used, &s->count, &s->capacity, arena, start,
+                          start + int_value(lengths, j));
+                if(start < s->header_end)
+                    s->header_end = start;
+            }
+        }
+    }
+
+    qsort(s->used, s->count, sizeof(span_t), compare_spans);
+    if(!ok)
+        s->header_end = 0;
+    return ok;
+}
+
+/*
+ * nonzero if len bytes at start can be written without touching anything
+ * in use: no used range overlaps them, and every byte is zero or spare
+ */
+int space_fits(space_t* s, tiff_t* t, unsigned int32 start, unsigned int32 len)
+{
+    unsigned int32 end = start + len;
+    unsigned int32 i;
+    int k;
+
+    if(end < start || end > s->header_end || end > t->size)
+        return 0;
+    for(k=0; k<s->count; ++k)
+    {
+        if(s->used[k].start >= end)
+            break;
+        if(s->used[k].end > start)
+            return 0;
+    }
+    for(i=start; i<end; ++i)
+    {
+        if(t->data[i] == 0)
+            continue;
+        for(k=0; k<s->nspare; ++k)
+            if(i >= s->spare[k].start && i < s->spare[k].end)
+                break;
+        if(k == s->nspare)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * find a word aligned home for len bytes: the first gap in the header
+ * that fits, or else the end of the file. the range is marked used and
+ * its offset returned, or 0 if the file would grow past 4GB.
+ */
+unsigned int32 space_alloc(space_t* s, tiff_t* t, unsigned int32 len)
+{
+    unsigned int32 reach = 0;
+    unsigned int32 at;
+    int k;
+
+    /* a block that moves mustn't land on the one it replaces, which is
+     * still what the file points at until the last run is written */
+    s->nspare = 0;
+
+    for(k=0; k<s->count; ++k)
+    {
+        if(s->used[k].end > reach)
+            reach = s->used[k].end;
+        at = (reach + 1) & ~1;
+        if(at >= s->header_end)
+            break;
+        if(k + 1 < s->count && s->used[k+1].start < at + len)
+            continue;
+        if(space_fits(s, t, at, len))
+        {
+            space_mark(s, at, len);
+            return at;
+        }
+    }
+
+    at = (s->eof + 1) & ~1;
+    if((unsigned int64)at + len > 0xFFFFFFFFULL)
+        return 0;
+    space_mark(s, at, len);
+    return at;
+}
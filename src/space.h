@@ -0,0 +1,52 @@
+/*
+ * space.h
+ * map of which bytes of a tiff file's header are spoken for, for finding
+ * room for blocks that have grown
+ */
+
+#ifndef _SPACE_H_
+#define _SPACE_H_
+
+#include "tiff.h"
+#include "arena.h"
+#include "types.h"
+
+/* most ifds followed when mapping a file, in case the links loop */
+#define SPACE_MAX_IFDS 64
+
+/* a byte range [start, end) of the file */
+typedef struct
+{
+    unsigned int32 start;
+    unsigned int32 end;
+} span_t;
+
+/*
+ * everything known to be in use in a file: the header, every ifd's entry
+ * table and out-of-line values, and the image data. gaps between them
+ * before the first image data are only handed out if they're all zeros,
+ * since something we don't know how to find (a maker note's own
+ * pointers, say) could be living there. the ranges of a block that's
+ * being replaced are spare: they can be reused though they aren't zero.
+ */
+typedef struct
+{
+    span_t* used;              /* kept sorted by start */
+    int count;
+    int capacity;
+    span_t* spare;
+    int nspare;
+    int spare_capacity;
+    unsigned int32 header_end; /* gaps are only looked for below here */
+    unsigned int32 eof;        /* end of the file, and of anything put after it */
+    arena_t* arena;
+} space_t;
+
+unsigned int32 space_ifd_extent(tiff_t* t, unsigned int32 offset, ifd_t* ifd);
+int space_build(space_t* s, tiff_t* t, ifd_t* ifd0, unsigned int32 replacing, arena_t* arena);
+void space_release(space_t* s, unsigned int32 start, unsigned int32 len);
+void space_mark(space_t* s, unsigned int32 start, unsigned int32 len);
+int space_fits(space_t* s, tiff_t* t, unsigned int32 start, unsigned int32 len);
+unsigned int32 space_alloc(space_t* s, tiff_t* t, unsigned int32 len);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * stats.c
+ * per-phase timers and counters for a tagging run
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "stats.h"
+#include "types.h"
+
+static const char* phase_names[STATS_NUM_PHASES] = {
+    "ingest", "open", "valid_tiff_file", "ifd_load", "match", "write", "close"
+};
+
+void stats_init(stats_t* s)
+{
+    memset(s, 0, sizeof(stats_t));
+}
+
+void stats_merge(stats_t* dst, const stats_t* src)
+{
+    int i;
+    int b;
+
+    for(i=0; i<STATS_NUM_PHASES; ++i)
+    {
+        stats_phase_t* d = &dst->phases[i];
+        const stats_phase_t* p = &src->phases[i];
+        d->count += p->count;
+        d->total_ns += p->total_ns;
+        if(p->max_ns > d->max_ns)
+            d->max_ns = p->max_ns;
+        for(b=0; b<STATS_BUCKETS; ++b)
+            d->buckets[b] += p->buckets[b];
+    }
+    dst->files += src->files;
+    dst->matched += src->matched;
+    dst->unchanged += src->unchanged;
+    dst->skipped += src->skipped;
+    dst->unmatched += src->unmatched;
+    dst->fixes += src->fixes;
+    dst->log_bytes += src->log_bytes;
+    dst->bytes_mapped += src->bytes_mapped;
+    dst->bytes_written += src->bytes_written;
+    if(src->wall_ns > dst->wall_ns)
+        dst->wall_ns = src->wall_ns;
+}
+
+/*
+ * end a phase that began at start (from stats_start)
+ */
+void stats_record(stats_t* s, int phase, unsigned int64 start)
+{
+    stats_phase_t* p;
+    unsigned int64 ns;
+    int b;
+
+    if(!s)
+        return;
+    ns = stats_clock() - start;
+    p = &s->phases[phase];
+    p->count++;
+    p->total_ns += ns;
+    if(ns > p->max_ns)
+        p->max_ns = ns;
+    b = ns ? 63 - __builtin_clzll(ns) : 0;
+    p->buckets[b < STATS_BUCKETS ? b : STATS_BUCKETS-1]++;
+}
+
+void stats_print_text(FILE* fp, const stats_t* s)
+{
+    int i;
+
+    fprintf(fp, "files %llu: %llu tagged (%llu already up to date), %llu skipped, %llu unmatched\n",
+            (unsigned long long)s->files, (unsigned long long)s->matched,
+            (unsigned long long)s->unchanged, (unsigned long long)s->skipped, (unsigned long long)s->unmatched);
+    fprintf(fp, "log: %llu fixes from %llu bytes; images: %llu bytes mapped, %llu written\n",
+            (unsigned long long)s->fixes, (unsigned long long)s->log_bytes,
+            (unsigned long long)s->bytes_mapped, (unsigned long long)s->bytes_written);
+    fprintf(fp, "%-16s %10s %12s %12s %12s\n", "phase", "count", "total ms", "mean us", "max us");
+    for(i=0; i<STATS_NUM_PHASES; ++i)
+    {
+        const stats_phase_t* p = &s->phases[i];
+        fprintf(fp, "%-16s %10llu %12.3f %12.3f %12.3f\n", phase_names[i],
+                (unsigned long long)p->count, p->total_ns / 1e6,
+                p->count ? p->total_ns / 1e3 / p->count : 0.0, p->max_ns / 1e3);
+    }
+    fprintf(fp, "wall time %.3f ms\n", s->wall_ns / 1e6);
+}
+
+/*
+ * the same report as a single json object. histogram buckets are only
+ * listed if something landed in them; "lt" is the bucket's upper bound.
+ */
+void stats_print_json(FILE* fp, const stats_t* s)
+{
+    int i;
+    int b;
+
+    fprintf(fp, "{\"files\":%llu,\"matched\":%llu,\"unchanged\":%llu,\"skipped\":%llu,"
+            "\"unmatched\":%llu,\"fixes\":%llu,\"log_bytes\":%llu,\"bytes_mapped\":%llu,"
+            "\"bytes_written\":%llu,\"wall_ns\":%llu,\"phases\":{",
+            (unsigned long long)s->files, (unsigned long long)s->matched,
+            (unsigned long long)s->unchanged, (unsigned long long)s->skipped, (unsigned long long)s->unmatched,
+            (unsigned long long)s->fixes, (unsigned long long)s->log_bytes,
+            (unsigned long long)s->bytes_mapped, (unsigned long long)s->bytes_written,
+            (unsigned long long)s->wall_ns);
+    for(i=0; i<STATS_NUM_PHASES; ++i)
+    {
+        const stats_phase_t* p = &s->phases[i];
+        int first = 1;
+
+        fprintf(fp, "%s\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"max_ns\":%llu,\"histogram\":[",
+                i ? "," : "", phase_names[i], (unsigned long long)p->count,
+                (unsigned long long)p->total_ns, (unsigned long long)p->max_ns);
+        for(b=0; b<STATS_BUCKETS; ++b)
+        {
+            if(!p->buckets[b])
+                continue;
+            fprintf(fp, "%s{\"lt\":%llu,\"count\":%llu}", first ? "" : ",",
+                    1ULL << (b+1), (unsigned long long)p->buckets[b]);
+            first = 0;
+        }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "}}\n");
+}
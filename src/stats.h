@@ -0,0 +1,83 @@
+/*
+ * stats.h
+ * per-phase timers and counters for a tagging run
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <time.h>
+#include "types.h"
+
+/* report formats */
+#define STATS_NONE 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/* the phases timed separately */
+#define STATS_INGEST   0   /* reading the gps log (or its index) */
+#define STATS_OPEN     1   /* open and map a raw file */
+#define STATS_VALIDATE 2   /* valid_tiff_file */
+#define STATS_IFD_LOAD 3   /* indexing IFD0 and the GPS IFD */
+#define STATS_MATCH    4   /* matching the batch against the track */
+#define STATS_WRITE    5   /* encoding and writing the GPS IFD */
+#define STATS_CLOSE    6   /* unmap and close */
+#define STATS_NUM_PHASES 7
+
+/* latency histograms have a bucket per power of two nanoseconds */
+#define STATS_BUCKETS 40
+
+typedef struct
+{
+    unsigned int64 count;
+    unsigned int64 total_ns;
+    unsigned int64 max_ns;
+    unsigned int64 buckets[STATS_BUCKETS]; /* bucket i: [2^i, 2^(i+1)) ns */
+} stats_phase_t;
+
+/*
+ * one of these per worker, so recording never takes a lock; they're
+ * added together at the end of the run
+ */
+typedef struct
+{
+    stats_phase_t phases[STATS_NUM_PHASES];
+    unsigned int64 files;
+    unsigned int64 matched;
+    unsigned int64 unchanged;     /* matched, but already tagged with the same fix */
+    unsigned int64 skipped;
+    unsigned int64 unmatched;
+    unsigned int64 fixes;
+    unsigned int64 log_bytes;
+    unsigned int64 bytes_mapped;
+    unsigned int64 bytes_written;
+    unsigned int64 wall_ns;
+} stats_t;
+
+void stats_init(stats_t* s);
+void stats_merge(stats_t* dst, const stats_t* src);
+void stats_record(stats_t* s, int phase, unsigned int64 start);
+void stats_print_text(FILE* fp, const stats_t* s);
+void stats_print_json(FILE* fp, const stats_t* s);
+
+/*
+ * monotonic clock in nanoseconds
+ */
+static inline unsigned int64 stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * start timing a phase; with no stats to record into, the clock isn't
+ * even read
+ */
+static inline unsigned int64 stats_start(stats_t* s)
+{
+    return s ? stats_clock() : 0;
+}
+
+#endif
@@ -0,0 +1,899 @@
+/*
+ * tag.c
+ * tag raw files with the gps locations matching their timestamps
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tag.h"
+#include "tiff.h"
+#include "util.h"
+#include "arena.h"
+#include "nmea.h"
+#include "nikond90.h"
+#include "date.h"
+#include "stats.h"
+#include "uring.h"
+#include "patch.h"
+#include "space.h"
+#include "types.h"
+
+/*
+ * open and map a raw file and index its first ifd. returns the open
+ * descriptor, or -1 (having said why) if the file isn't usable. if
+ * header_only, the header has been prefetched, and a fault anywhere
+ * shouldn't read around into the image data.
+ */
+static int open_raw(const char* path, int flags, tiff_t* tif, ifd_t* ifd0, arena_t* arena,
+                    int header_only, stats_t* stats)
+{
+    int fd;
+    int ok;
+    unsigned int64 t = stats_start(stats);
+    
+    if((fd = open(path, flags)) < 0)
+    {
+        fprintf(stderr, "could not open raw file '%s'...skipping\n", path);
+        return -1;
+    }
+
+    /* map the file once; everything up to the final write is read from memory */
+    if(!tiff_map(tif, fd))
+    {
+        fprintf(stderr, "could not map raw file '%s'...skipping\n", path);
+        close(fd);
+        return -1;
+    }
+    if(header_only)
+        madvise((void*)tif->data, tif->size, MADV_RANDOM);
+    stats_record(stats, STATS_OPEN, t);
+    if(stats)
+        stats->bytes_mapped += tif->size;
+
+    t = stats_start(stats);
+    ok = valid_tiff_file(tif);
+    stats_record(stats, STATS_VALIDATE, t);
+    if(!ok)
+    {
+        fprintf(stderr, "error reading raw file '%s'; invalid tiff header...skipping\n", path);
+        tiff_unmap(tif);
+        close(fd);
+        return -1;
+    }
+
+    /* load the first ifd */
+    t = stats_start(stats);
+    ok = ifd_load(tif, tif->first_ifd, ifd0, arena);
+    stats_record(stats, STATS_IFD_LOAD, t);
+    if(!ok)
+    {
+        fprintf(stderr, "error reading raw file '%s'; corrupt ifd0...skipping\n", path);
+        tiff_unmap(tif);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void close_raw(int fd, tiff_t* tif, stats_t* stats)
+{
+    unsigned int64 t = stats_start(stats);
+    tiff_unmap(tif);
+    close(fd);
+    stats_record(stats, STATS_CLOSE, t);
+}
+
+/*
+ * pull the date/time from the image (in whatever time zone the camera is
+ * set to) and convert it to utc. returns 0 if ifd0 doesn't have it.
+ */
+static int header_time(tiff_t* tif, ifd_t* ifd0, const tag_config_t* cfg, arena_t* arena,
+                       time_t* utc)
+{
+    direntry_t* dir;
+    struct tm t;
+
+    /* only the entry we need is decoded; everything else stays in the file */
+    dir = ifd_find(ifd0, DateTimeOriginal);
+    if(!dir || dir->type != ASCII || !direntry_values(tif, dir, arena))
+        return 0;
+    parse_datetime((const char*)dir->byte_values, &t);
+    add_offset(&t, cfg->tzoffset);
+    *utc = timegm(&t);
+    return 1;
+}
+
+/*
+ * how far into the file the header reaches: the end of ifd0 and of the
+ * values read from it, and room for the gps info ifd it points to
+ */
+static unsigned int32 header_extent(tiff_t* tif, ifd_t* ifd0, arena_t* arena)
+{
+    unsigned int64 end = (unsigned int64)tif->first_ifd + 2 + 12 * ifd0->count + 4;
+    unsigned int64 e;
+    direntry_t* dir;
+
+    dir = ifd_find(ifd0, DateTimeOriginal);
+    if(dir && dir->type >= BYTE && dir->type <= DOUBLE)
+    {
+        e = dir->offset + (unsigned int64)dir->count * type_bytes[dir->type];
+        if(e > end)
+            end = e;
+    }
+    dir = ifd_find(ifd0, GPSInfoIFDPointer);
+    if(dir && dir->type == LONG && direntry_values(tif, dir, arena))
+    {
+        e = (unsigned int64)dir->uint32_values[0] + GPS_IFD_MAX_SIZE;
+        if(e > end)
+            end = e;
+    }
+    return (end < tif->size) ? (unsigned int32)end : tif->size;
+}
+
+/*
+ * find and index the image's GPSInfoIFD. returns its offset, or 0 if
+ * there isn't a usable one.
+ */
+static unsigned int32 find_gps_ifd(tiff_t* tif, ifd_t* ifd0, ifd_t* gps_info_ifd, const char* path,
+                                   arena_t* arena, stats_t* stats)
+{
+    direntry_t* dir;
+    unsigned int32 gps_offset;
+    unsigned int64 t;
+    int ok;
+
+    dir = ifd_find(ifd0, GPSInfoIFDPointer);
+    if(!dir || dir->type != LONG || !direntry_values(tif, dir, arena))
+        return 0;
+    gps_offset = dir->uint32_values[0];
+    t = stats_start(stats);
+    ok = ifd_load(tif, gps_offset, gps_info_ifd, arena);
+    stats_record(stats, STATS_IFD_LOAD, t);
+    if(!ok)
+    {
+        if(!tif->partial)
+            fprintf(stderr, "error reading gps info ifd in '%s'\n", path);
+        return 0;
+    }
+    return gps_offset;
+}
+
+/*
+ * the location to write into a file: its matching fix, or the
+ * coordinates given on the command line
+ */
+static void job_location(const tag_job_t* job, const tag_config_t* cfg, location_t* match)
+{
+    if(cfg->use_nmea_file)
+        track_get(cfg->track, job->match, match);
+    else
+    {
+        /*
+         * if the coordinates were given on the command line, then we write them
+         * directly into the match structure and mark all the other info as void,
+         * 0, etc.
+         */
+        match->when = job->utc_time;
+        match->msec = 0;
+        match->status = 'V';
+        match->latitude = fabs(cfg->latitude);
+        match->lat_ref = (cfg->latitude > 0) ? 'N' : 'S';
+        match->longitude = fabs(cfg->longitude);
+        match->lon_ref = (cfg->longitude > 0) ? 'E' : 'W';
+        match->speed = 0;
+        match->heading = 0;
+        match->altitude = 0;
+        match->geoid_ht = 0;
+        match->have_altitude = 0;
+        match->num_sat = 0;
+        match->quality = 0;
+    }
+}
+
+/*
+ * lay out a patch writing match over a file's gps info ifd. the new
+ * block goes where the old one is if it fits in the old one's space, or
+ * can grow into free space right after it. otherwise it goes in the first
+ * gap in the header big enough for it, or at the end of the file, and
+ * the pointer to it in ifd0 is moved. only bytes that differ from what
+ * the file has are written. returns 0 if it can't be done.
+ */
+static int replace_gps_ifd(tiff_t* tif, ifd_t* ifd0, unsigned int32 gps_offset,
+                           ifd_t* gps_info_ifd, location_t* match, arena_t* arena, patch_t* patch)
+{
+    space_t space;
+    unsigned byte* block = (unsigned byte*)arena_alloc(arena, GPS_IFD_MAX_SIZE);
+    unsigned byte* pointer;
+    unsigned int32 len;
+    unsigned int32 at;
+
+    len = gps_ifd_encode(tif, match, gps_offset, gps_info_ifd->next_offset, block);
+    if(gps_offset + len <= space_ifd_extent(tif, gps_offset, gps_info_ifd))
+        return patch_diff(patch, tif, gps_offset, block, len);
+
+    /* grown: it has to be checked against everything else in the header */
+    space_build(&space, tif, ifd0, gps_offset, arena);
+    if(space_fits(&space, tif, gps_offset, len))
+        return patch_diff(patch, tif, gps_offset, block, len);
+    if((at = space_alloc(&space, tif, len)) == 0)
+        return 0;
+    gps_ifd_encode(tif, match, at, gps_info_ifd->next_offset, block);
+
+    pointer = (unsigned byte*)arena_alloc(arena, 4);
+    put_uint32(pointer, at, tif->swap);
+    return patch_add(patch, at, block, len) &&
+           patch_add(patch, ifd_find(ifd0, GPSInfoIFDPointer)->offset, pointer, 4);
+}
+
+/*
+ * lay out a patch giving a file with no gps info ifd a new one, without
+ * moving anything already in the file. ifd0 gains a pointer to it: in
+ * place if there's free space for the extra entry right after it, or else
+ * as a copy wherever the space map finds room, with the header pointed at
+ * the copy and the old ifd0 left unreferenced. the gps block goes in the
+ * first gap big enough or at the end of the file. returns 0 if it can't
+ * be done.
+ */
+static int add_gps_ifd(tiff_t* tif, ifd_t* ifd0, location_t* match, arena_t* arena,
+                       patch_t* patch)
+{
+    space_t space;
+    unsigned int32 ifd0_len = IFD_SIZE(ifd0->count + 1);
+    unsigned byte* block = (unsigned byte*)arena_alloc(arena, GPS_IFD_MAX_SIZE);
+    unsigned byte* ifd0_block = (unsigned byte*)arena_alloc(arena, ifd0_len);
+    unsigned byte* header;
+    unsigned int32 ifd0_at = 0;
+    unsigned int32 gps_at;
+    unsigned int32 len;
+
+    /* ifd0's values stay where they are; only its table grows */
+    space_build(&space, tif, ifd0, 0, arena);
+    space_release(&space, tif->first_ifd, IFD_SIZE(ifd0->count));
+    if(space_fits(&space, tif, tif->first_ifd, ifd0_len))
+    {
+        ifd0_at = tif->first_ifd;
+        space_mark(&space, ifd0_at, ifd0_len);
+    }
+
+    /* the size of the block doesn't depend on where it goes */
+    len = gps_ifd_encode(tif, match, 0, 0, block);
+    if((gps_at = space_alloc(&space, tif, len)) == 0)
+        return 0;
+    gps_ifd_encode(tif, match, gps_at, 0, block);
+    if(!ifd0_at && (ifd0_at = space_alloc(&space, tif, ifd0_len)) == 0)
+        return 0;
+    if(!ifd_copy_insert(tif, tif->first_ifd, ifd0, GPSInfoIFDPointer, gps_at, ifd0_block))
+        return 0;
+
+    if(!patch_add(patch, gps_at, block, len))
+        return 0;
+    if(ifd0_at == tif->first_ifd)
+        return patch_diff(patch, tif, ifd0_at, ifd0_block, ifd0_len);
+    header = (unsigned byte*)arena_alloc(arena, 4);
+    put_uint32(header, ifd0_at, tif->swap);
+    return patch_add(patch, ifd0_at, ifd0_block, ifd0_len) && patch_add(patch, 4, header, 4);
+}
+
+/*
+ * with a journal, get what patch is about to overwrite onto disk before
+ * any of it is written
+ */
+static int journal_ahead(const tag_config_t* cfg, const char* path, tiff_t* tif, patch_t* patch)
+{
+    unsigned int64 seq;
+
+    if(!cfg->journal || patch->count == 0)
+        return 1;
+    if((seq = journal_log(cfg->journal, path, tif, patch)) && journal_commit(cfg->journal, seq))
+        return 1;
+    fprintf(stderr, "could not journal '%s'\n", path);
+    return 0;
+}
+
+/*
+ * first pass over a file: read its timestamp. the file is only opened
+ * for reading.
+ */
+int tag_read_time(tag_job_t* job, const tag_config_t* cfg, arena_t* arena, stats_t* stats)
+{
+    int fd;
+    tiff_t tif;
+    ifd_t ifd0;
+
+    arena_reset(arena);
+    job->status = TAG_SKIPPED;
+    job->match = -1;
+    job->header_end = 0;
+    if((fd = open_raw(job->path, O_RDONLY, &tif, &ifd0, arena, cfg->prefetch, stats)) < 0)
+        return job->status;
+
+    if(header_time(&tif, &ifd0, cfg, arena, &job->utc_time))
+        job->status = TAG_OK;
+    else
+        fprintf(stderr, "raw file '%s' has no DateTimeOriginal...skipping\n", job->path);
+    job->header_end = header_extent(&tif, &ifd0, arena);
+
+    close_raw(fd, &tif, stats);
+    return job->status;
+}
+
+/*
+ * find the nearest GPS location record for every file whose time has
+ * been read, in one sweep over the track
+ */
+void tag_match(tag_job_t* jobs, int njobs, const tag_config_t* cfg, stats_t* stats)
+{
+    time_t* ts;
+    int* matches;
+    int* which;
+    int n = 0;
+    int i;
+    unsigned int64 t;
+
+    if(!cfg->use_nmea_file)
+        return;
+
+    t = stats_start(stats);
+    ts = (time_t*)malloc((njobs ? njobs : 1) * sizeof(time_t));
+    matches = (int*)malloc((njobs ? njobs : 1) * sizeof(int));
+    which = (int*)malloc((njobs ? njobs : 1) * sizeof(int));
+    for(i=0; i<njobs; ++i)
+    {
+        if(jobs[i].status == TAG_OK)
+        {
+            ts[n] = jobs[i].utc_time;
+            which[n++] = i;
+        }
+    }
+
+    find_locations(cfg->track, ts, n, cfg->window_size, matches);
+
+    for(i=0; i<n; ++i)
+    {
+        tag_job_t* job = &jobs[which[i]];
+        job->match = matches[i];
+        if(job->match < 0)
+        {
+            printf("no match found within %d seconds of photo '%s'...skipping\n",
+                   cfg->window_size, job->path);
+            job->status = TAG_NO_MATCH;
+        }
+    }
+    free(which);
+    free(matches);
+    free(ts);
+    stats_record(stats, STATS_MATCH, t);
+}
+
+/*
+ * lay out the patch that tags an open file with its job's match. returns
+ * 0, having said why, if it can't be done.
+ */
+static int tag_layout(tag_job_t* job, const tag_config_t* cfg, tiff_t* tif, ifd_t* ifd0,
+                      arena_t* arena, stats_t* stats, patch_t* patch)
+{
+    ifd_t gps_info_ifd;
+    unsigned int32 gps_offset;
+    location_t match;
+
+    gps_offset = find_gps_ifd(tif, ifd0, &gps_info_ifd, job->path, arena, stats);
+    if(gps_offset == 0 && ifd_find(ifd0, GPSInfoIFDPointer))
+    {
+        fprintf(stderr, "raw file '%s' has no usable gps info ifd...skipping\n", job->path);
+        return 0;
+    }
+    job_location(job, cfg, &match);
+
+    /* lay out the whole gps info ifd in memory, then write only the bytes
+     * of it the file doesn't already have. a file already tagged with
+     * this fix isn't written at all. a file without one gets one added. */
+    patch_init(patch);
+    if(gps_offset)
+        return replace_gps_ifd(tif, ifd0, gps_offset, &gps_info_ifd, &match, arena, patch);
+    return add_gps_ifd(tif, ifd0, &match, arena, patch);
+}
+
+/*
+ * second pass over a file: encode a new GPSInfoIFD block for the
+ * matched location and write it over the one in the image
+ */
+int tag_write(tag_job_t* job, const tag_config_t* cfg, arena_t* arena, stats_t* stats)
+{
+    int fd;
+    tiff_t tif;
+    ifd_t ifd0;
+    patch_t patch;
+    unsigned int64 t;
+    int ok;
+
+    if(job->status != TAG_OK)
+        return job->status;
+
+    arena_reset(arena);
+    job->status = TAG_SKIPPED;
+    if((fd = open_raw(job->path, O_RDWR, &tif, &ifd0, arena, cfg->prefetch, stats)) < 0)
+        return job->status;
+
+    t = stats_start(stats);
+    if(!tag_layout(job, cfg, &tif, &ifd0, arena, stats, &patch))
+    {
+        close_raw(fd, &tif, stats);
+        return job->status;
+    }
+    ok = journal_ahead(cfg, job->path, &tif, &patch) && patch_apply(&patch, &tif);
+    stats_record(stats, STATS_WRITE, t);
+    if(ok)
+    {
+        job->status = TAG_OK;
+        if(cfg->journal && patch.count)
+            journal_done(cfg->journal);
+        if(stats)
+        {
+            stats->bytes_written += patch_bytes(&patch);
+            stats->unchanged += (patch.count == 0);
+        }
+    }
+    else
+        fprintf(stderr, "error writing gps info to '%s'\n", job->path);
+
+    close_raw(fd, &tif, stats);
+    return job->status;
+}
+
+/*
+ * the second pass split in two for a journal, so that a whole group of
+ * files can be journaled with one sync: lay out a file's patch and
+ * journal what it will overwrite, but keep the patch for tag_apply to
+ * write once the journal is synced
+ */
+int tag_plan(tag_job_t* job, const tag_config_t* cfg, arena_t* arena, stats_t* stats)
+{
+    int fd;
+    tiff_t tif;
+    ifd_t ifd0;
+    patch_t patch;
+    unsigned byte* data;
+    unsigned int64 t;
+    int i;
+
+    job->planned = NULL;
+    if(job->status != TAG_OK)
+        return job->status;
+
+    arena_reset(arena);
+    job->status = TAG_SKIPPED;
+    if((fd = open_raw(job->path, O_RDONLY, &tif, &ifd0, arena, cfg->prefetch, stats)) < 0)
+        return job->status;
+
+    t = stats_start(stats);
+    if(tag_layout(job, cfg, &tif, &ifd0, arena, stats, &patch))
+    {
+        job->status = TAG_OK;
+        if(patch.count == 0)
+        {
+            if(stats)
+                stats->unchanged++;
+        }
+        else if((job->seq = journal_log(cfg->journal, job->path, &tif, &patch)) == 0)
+        {
+            fprintf(stderr, "could not journal '%s'\n", job->path);
+            job->status = TAG_SKIPPED;
+        }
+        else
+        {
+            /* the runs' data lives in the arena, which the next file reuses */
+            job->planned = (patch_t*)malloc(sizeof(patch_t) + patch_bytes(&patch));
+            *job->planned = patch;
+            data = (unsigned byte*)(job->planned + 1);
+            for(i=0; i<patch.count; ++i)
+            {
+                memcpy(data, patch.runs[i].data, patch.runs[i].len);
+                job->planned->runs[i].data = data;
+                data += patch.runs[i].len;
+            }
+        }
+    }
+    stats_record(stats, STATS_WRITE, t);
+    close_raw(fd, &tif, stats);
+    return job->status;
+}
+
+/*
+ * write the patch tag_plan kept, once the journal has it on disk. the
+ * first of a group to get here does the sync for all of them.
+ */
+int tag_apply(tag_job_t* job, const tag_config_t* cfg, stats_t* stats)
+{
+    tiff_t tif;
+    int fd;
+    unsigned int64 t;
+
+    if(job->status != TAG_OK || !job->planned)
+        return job->status;
+
+    t = stats_start(stats);
+    job->status = TAG_SKIPPED;
+    if(!journal_commit(cfg->journal, job->seq))
+        fprintf(stderr, "could not journal '%s'\n", job->path);
+    else if((fd = open(job->path, O_RDWR)) < 0)
+        fprintf(stderr, "could not open raw file '%s'...skipping\n", job->path);
+    else
+    {
+        tiff_attach(&tif, fd, NULL, 0, 0);
+        if(patch_apply(job->planned, &tif))
+        {
+            job->status = TAG_OK;
+            journal_done(cfg->journal);
+            if(stats)
+                stats->bytes_written += patch_bytes(job->planned);
+        }
+        else
+            fprintf(stderr, "error writing gps info to '%s'\n", job->path);
+        close(fd);
+    }
+    stats_record(stats, STATS_WRITE, t);
+    free(job->planned);
+    job->planned = NULL;
+    return job->status;
+}
+
+/*
+ * the second pass in sidecar mode: queue the match up to be written to
+ * the file's xmp sidecar. the raw file itself isn't opened again.
+ */
+int tag_sidecar(tag_job_t* job, const tag_config_t* cfg, xmp_writer_t* w, stats_t* stats)
+{
+    location_t match;
+    unsigned int64 t;
+
+    if(job->status != TAG_OK)
+        return job->status;
+
+    job_location(job, cfg, &match);
+    t = stats_start(stats);
+    if(!xmp_queue(w, job->path, &match, &job->status))
+        job->status = TAG_SKIPPED;
+    stats_record(stats, STATS_WRITE, t);
+    return job->status;
+}
+
+/*
+ * tag a single file on its own: read its time, look up the nearest fix
+ * and write it
+ */
+int tag_file(const char* path, const tag_config_t* cfg, arena_t* arena, stats_t* stats)
+{
+    tag_job_t job;
+    xmp_writer_t w;
+
+    job.path = path;
+    if(tag_read_time(&job, cfg, arena, stats) != TAG_OK)
+        return job.status;
+    tag_match(&job, 1, cfg, stats);
+    if(cfg->sidecar)
+    {
+        xmp_writer_init(&w, stats);
+        tag_sidecar(&job, cfg, &w, stats);
+        xmp_flush(&w);
+        xmp_writer_free(&w);
+        return job.status;
+    }
+    return tag_write(&job, cfg, arena, stats);
+}
+
+/*
+ * a file in flight on the ring. it's opened read-write once and kept
+ * open from the header read through to the write.
+ */
+typedef struct
+{
+    int fd;
+    int mapped;          /* tif maps the whole file rather than the prefix */
+    tiff_t tif;
+    ifd_t ifd0;
+    unsigned int32 gps_offset;
+    patch_t patch;       /* what the file needs writing to tag it */
+} ring_file_t;
+
+/*
+ * the header ran past the prefix that was read, so map the whole file
+ * and carry on from there, the same as the blocking path would have
+ */
+static int ring_remap(ring_file_t* f, stats_t* stats)
+{
+    if(!f->tif.partial || !tiff_map(&f->tif, f->fd))
+        return 0;
+    f->mapped = 1;
+    if(stats)
+        stats->bytes_mapped += f->tif.size;
+    return valid_tiff_file(&f->tif);
+}
+
+/* the ring's version of tag_read_time, working from the prefix read into buf */
+static void ring_read_header(tag_job_t* job, const tag_config_t* cfg, ring_file_t* f,
+                             const unsigned byte* buf, int nread, arena_t* arena, stats_t* stats)
+{
+    unsigned int64 t = stats_start(stats);
+
+    tiff_attach(&f->tif, f->fd, buf, nread, nread == TAG_HEADER_PREFIX);
+    if(nread < 8 || !valid_tiff_file(&f->tif))
+    {
+        fprintf(stderr, "error reading raw file '%s'; invalid tiff header...skipping\n", job->path);
+        return;
+    }
+    while(!ifd_load(&f->tif, f->tif.first_ifd, &f->ifd0, arena))
+    {
+        if(!ring_remap(f, stats))
+        {
+            fprintf(stderr, "error reading raw file '%s'; corrupt ifd0...skipping\n", job->path);
+            return;
+        }
+    }
+    stats_record(stats, STATS_IFD_LOAD, t);
+
+    while(!header_time(&f->tif, &f->ifd0, cfg, arena, &job->utc_time))
+    {
+        if(!ring_remap(f, stats))
+        {
+            fprintf(stderr, "raw file '%s' has no DateTimeOriginal...skipping\n", job->path);
+            return;
+        }
+    }
+    job->status = TAG_OK;
+}
+
+/*
+ * the ring's version of the first half of tag_write: lay out the new
+ * block and work out which of its bytes need writing. returns 0 if the
+ * file can't be tagged.
+ */
+static int ring_encode(tag_job_t* job, const tag_config_t* cfg, ring_file_t* f,
+                       arena_t* arena, stats_t* stats)
+{
+    ifd_t gps_info_ifd;
+    location_t match;
+    unsigned byte block[GPS_IFD_MAX_SIZE];
+    unsigned int32 len;
+
+    while(!(f->gps_offset = find_gps_ifd(&f->tif, &f->ifd0, &gps_info_ifd, job->path, arena, stats)))
+    {
+        if(!f->tif.partial)
+            break;
+        if(!ring_remap(f, stats))
+        {
+            fprintf(stderr, "error reading raw file '%s'; could not map it...skipping\n", job->path);
+            return 0;
+        }
+    }
+    job_location(job, cfg, &match);
+    patch_init(&f->patch);
+
+    /* placing a block anywhere but over the old one needs the whole file
+     * mapped, to know what else is in it and where it ends */
+    if(!f->gps_offset)
+    {
+        if(f->tif.partial || ifd_find(&f->ifd0, GPSInfoIFDPointer))
+        {
+            fprintf(stderr, "raw file '%s' has no usable gps info ifd...skipping\n", job->path);
+            return 0;
+        }
+        return add_gps_ifd(&f->tif, &f->ifd0, &match, arena, &f->patch);
+    }
+    if(f->tif.partial)
+    {
+        len = gps_ifd_encode(&f->tif, &match, f->gps_offset, gps_info_ifd.next_offset, block);
+        if((f->gps_offset + len > f->tif.size ||
+            f->gps_offset + len > space_ifd_extent(&f->tif, f->gps_offset, &gps_info_ifd)) &&
+           !ring_remap(f, stats))
+        {
+            fprintf(stderr, "error reading raw file '%s'; could not map it...skipping\n", job->path);
+            return 0;
+        }
+    }
+    return replace_gps_ifd(&f->tif, &f->ifd0, f->gps_offset, &gps_info_ifd, &match, arena, &f->patch);
+}
+
+/*
+ * journal what a batch's patches are about to overwrite, with a single
+ * sync for the lot. a file that can't be journaled isn't written.
+ */
+static void ring_journal(tag_job_t* batch, int n, const tag_config_t* cfg, ring_file_t* files)
+{
+    unsigned int64 seq;
+    unsigned int64 last = 0;
+    int i;
+
+    for(i=0; i<n; ++i)
+    {
+        if(batch[i].status != TAG_OK || files[i].patch.count == 0)
+            continue;
+        if((seq = journal_log(cfg->journal, batch[i].path, &files[i].tif, &files[i].patch)))
+            last = seq;
+        else
+        {
+            fprintf(stderr, "could not journal '%s'\n", batch[i].path);
+            batch[i].status = TAG_SKIPPED;
+        }
+    }
+    if(!last || journal_commit(cfg->journal, last))
+        return;
+    for(i=0; i<n; ++i)
+    {
+        if(batch[i].status == TAG_OK && files[i].patch.count)
+        {
+            fprintf(stderr, "could not journal '%s'\n", batch[i].path);
+            batch[i].status = TAG_SKIPPED;
+        }
+    }
+}
+
+/*
+ * tag a whole list of files with io_uring, TAG_RING_BATCH at a time: all
+ * the opens of a batch go to the kernel in one call, then all the header
+ * reads, then (after the batch is matched) all the writes, then all the
+ * closes. the results are the same as the read, match and write passes
+ * run one file at a time. returns 0 without touching anything if no ring
+ * can be had, in which case the caller should use those passes instead.
+ */
+int tag_ring(tag_job_t* jobs, int njobs, const tag_config_t* cfg, arena_t* arena, stats_t* stats)
+{
+    uring_t ring;
+    ring_file_t* files;
+    unsigned byte* bufs;
+    int* res;
+    int base;
+    int n;
+    int i;
+    int r;
+    unsigned int64 t;
+
+    /* room for every run of every file's patch to be in flight at once */
+    if(!uring_init(&ring, TAG_RING_BATCH * PATCH_MAX_RUNS))
+        return 0;
+    files = (ring_file_t*)malloc(TAG_RING_BATCH * sizeof(ring_file_t));
+    bufs = (unsigned byte*)malloc((size_t)TAG_RING_BATCH * TAG_HEADER_PREFIX);
+    res = (int*)malloc(TAG_RING_BATCH * PATCH_MAX_RUNS * sizeof(int));
+
+    for(base=0; base<njobs; base+=n)
+    {
+        tag_job_t* batch = jobs + base;
+        n = (njobs - base < TAG_RING_BATCH) ? njobs - base : TAG_RING_BATCH;
+        arena_reset(arena);
+
+        /* open every file in the batch, then read all their headers */
+        t = stats_start(stats);
+        for(i=0; i<n; ++i)
+        {
+            batch[i].status = TAG_SKIPPED;
+            batch[i].match = -1;
+            memset(&files[i], 0, sizeof(ring_file_t));
+            res[i] = -EIO;
+            uring_prep_open(&ring, batch[i].path, O_RDWR, i);
+        }
+        uring_run(&ring, res);
+        for(i=0; i<n; ++i)
+        {
+            /* anything the ring turns down as invalid is done the blocking
+             * way instead, a file at a time */
+            if(res[i] == -EINVAL)
+                res[i] = open(batch[i].path, O_RDWR);
+            files[i].fd = res[i];
+            if(files[i].fd < 0)
+                fprintf(stderr, "could not open raw file '%s'...skipping\n", batch[i].path);
+            else
+                uring_prep_read(&ring, files[i].fd, bufs + (size_t)i * TAG_HEADER_PREFIX,
+                                TAG_HEADER_PREFIX, 0, i);
+            res[i] = -EIO;
+        }
+        uring_run(&ring, res);
+        stats_record(stats, STATS_OPEN, t);
+
+        for(i=0; i<n; ++i)
+        {
+            if(files[i].fd < 0)
+                continue;
+            if(res[i] == -EINVAL)
+                res[i] = (int)pread(files[i].fd, bufs + (size_t)i * TAG_HEADER_PREFIX,
+                                    TAG_HEADER_PREFIX, 0);
+            if(res[i] < 0)
+            {
+                fprintf(stderr, "could not read raw file '%s'...skipping\n", batch[i].path);
+                continue;
+            }
+            if(stats)
+                stats->bytes_mapped += res[i];
+            ring_read_header(&batch[i], cfg, &files[i], bufs + (size_t)i * TAG_HEADER_PREFIX,
+                             res[i], arena, stats);
+        }
+
+        tag_match(batch, n, cfg, stats);
+
+        /* write whatever each matched file needs of its new gps block */
+        t = stats_start(stats);
+        for(i=0; i<n; ++i)
+        {
+            if(batch[i].status == TAG_OK && !ring_encode(&batch[i], cfg, &files[i], arena, stats))
+                batch[i].status = TAG_SKIPPED;
+        }
+        if(cfg->journal)
+            ring_journal(batch, n, cfg, files);
+        for(i=0; i<n; ++i)
+        {
+            if(batch[i].status != TAG_OK)
+                continue;
+            for(r=0; r<files[i].patch.count; ++r)
+            {
+                patch_run_t* run = &files[i].patch.runs[r];
+                res[i * PATCH_MAX_RUNS + r] = -EIO;
+                uring_prep_write(&ring, files[i].fd, run->data, run->len, run->offset,
+                                 i * PATCH_MAX_RUNS + r);
+            }
+        }
+        uring_run(&ring, res);
+        for(i=0; i<n; ++i)
+        {
+            if(batch[i].status != TAG_OK)
+                continue;
+            for(r=0; r<files[i].patch.count; ++r)
+            {
+                /* a short write, or one the ring wouldn't take, is
+                 * finished off the ordinary way */
+                patch_run_t* run = &files[i].patch.runs[r];
+                int done = res[i * PATCH_MAX_RUNS + r];
+                if(done == -EINVAL)
+                    done = 0;
+                if(done != (int)run->len &&
+                   (done < 0 || !tiff_write(&files[i].tif, run->offset + done, run->data + done,
+                                            run->len - done)))
+                    break;
+            }
+            if(r < files[i].patch.count)
+            {
+                fprintf(stderr, "error writing gps info to '%s'\n", batch[i].path);
+                batch[i].status = TAG_SKIPPED;
+            }
+            else
+            {
+                if(cfg->journal && files[i].patch.count)
+                    journal_done(cfg->journal);
+                if(stats)
+                {
+                    stats->bytes_written += patch_bytes(&files[i].patch);
+                    stats->unchanged += (files[i].patch.count == 0);
+                }
+            }
+        }
+        stats_record(stats, STATS_WRITE, t);
+
+        /* and close the lot */
+        t = stats_start(stats);
+        for(i=0; i<n; ++i)
+        {
+            if(files[i].mapped)
+                tiff_unmap(&files[i].tif);
+            res[i] = 0;
+            if(files[i].fd >= 0)
+                uring_prep_close(&ring, files[i].fd, i);
+        }
+        uring_run(&ring, res);
+        for(i=0; i<n; ++i)
+        {
+            if(files[i].fd >= 0 && res[i] == -EINVAL)
+                close(files[i].fd);
+        }
+        stats_record(stats, STATS_CLOSE, t);
+    }
+
+    free(res);
+    free(bufs);
+    free(files);
+    uring_free(&ring);
+    return 1;
+}
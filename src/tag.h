@@ -0,0 +1,71 @@
+/*
+ * tag.h
+ * tag raw files with the gps locations matching their timestamps
+ */
+
+#ifndef _TAG_H_
+#define _TAG_H_
+
+#include <time.h>
+#include "nmea.h"
+#include "arena.h"
+#include "stats.h"
+#include "journal.h"
+#include "xmp.h"
+
+/* outcomes of tagging one file */
+#define TAG_OK 0
+#define TAG_SKIPPED 1   /* file couldn't be opened or isn't a usable tiff */
+#define TAG_NO_MATCH 2  /* no gps fix close enough to the image timestamp */
+
+/* files kept in flight together by tag_ring */
+#define TAG_RING_BATCH 64
+
+/* bytes read from the start of each file for its header by tag_ring; a
+ * header that runs on past this is mapped instead */
+#define TAG_HEADER_PREFIX 65536
+
+/*
+ * settings shared by every file in a run. nothing in here is written
+ * once tagging starts, so any number of workers can use it at once.
+ */
+typedef struct
+{
+    const track_t* track; /* fixes parsed from the gps log */
+    int tzoffset;        /* hours to add to camera time to get utc */
+    int window_size;     /* max seconds between image and gps fix */
+    int use_nmea_file;   /* if 0, tag with latitude/longitude below */
+    double latitude;
+    double longitude;
+    int prefetch;        /* headers are prefetched; don't let faults read around them */
+    journal_t* journal;  /* NULL unless keeping an undo journal */
+    int sidecar;         /* write xmp sidecars; the raw files are only read */
+} tag_config_t;
+
+/*
+ * one file working its way through a batch: its timestamp is read,
+ * then the whole batch is matched against the track at once, then the
+ * matches are written
+ */
+typedef struct
+{
+    const char* path;
+    time_t utc_time;     /* DateTimeOriginal, converted to utc */
+    int status;          /* TAG_OK while there's still work to do */
+    int match;           /* index of the matching fix in the track, or -1 */
+    unsigned int32 header_end; /* bytes from the start the header needed */
+    patch_t* planned;    /* tag_plan's patch, waiting on the journal; NULL if none */
+    unsigned int64 seq;  /* the journal record for planned */
+} tag_job_t;
+
+/* stats may be NULL wherever it's taken */
+int tag_read_time(tag_job_t* job, const tag_config_t* cfg, arena_t* arena, stats_t* stats);
+void tag_match(tag_job_t* jobs, int njobs, const tag_config_t* cfg, stats_t* stats);
+int tag_write(tag_job_t* job, const tag_config_t* cfg, arena_t* arena, stats_t* stats);
+int tag_plan(tag_job_t* job, const tag_config_t* cfg, arena_t* arena, stats_t* stats);
+int tag_apply(tag_job_t* job, const tag_config_t* cfg, stats_t* stats);
+int tag_sidecar(tag_job_t* job, const tag_config_t* cfg, xmp_writer_t* w, stats_t* stats);
+int tag_file(const char* path, const tag_config_t* cfg, arena_t* arena, stats_t* stats);
+int tag_ring(tag_job_t* jobs, int njobs, const tag_config_t* cfg, arena_t* arena, stats_t* stats);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * alloc.c
+ * check that tagging an image makes the same number of heap calls
+ * however many tags it has
+ *
+ * usage: alloc_count rawfile+
+ *
+ * every file is tagged in turn with one arena, the way a worker does it,
+ * and the heap calls made by neftag's own code are counted. the link
+ * wraps malloc, calloc, realloc and free (ld --wrap), so calls made
+ * inside libc aren't seen. the first file warms the arena up, so it
+ * should be the one with the most tags; every file after it has to take
+ * the same number of calls as the second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../tag.h"
+#include "../arena.h"
+#include "../types.h"
+
+static unsigned long heap_calls;
+
+void* __real_malloc(size_t n);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t n);
+void __real_free(void* p);
+
+void* __wrap_malloc(size_t n)
+{
+    heap_calls++;
+    return __real_malloc(n);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+    heap_calls++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t n)
+{
+    heap_calls++;
+    return __real_realloc(p, n);
+}
+
+void __wrap_free(void* p)
+{
+    if(p)
+        heap_calls++;
+    __real_free(p);
+}
+
+int main(int argc, char** argv)
+{
+    tag_config_t cfg;
+    arena_t arena;
+    unsigned long before;
+    unsigned long calls;
+    unsigned long expected = 0;
+    int failed = 0;
+    int i;
+
+    if(argc < 3)
+    {
+        fprintf(stderr, "usage: alloc_count rawfile+\n");
+        return EXIT_FAILURE;
+    }
+
+    /* a fixed location, so there's no track to match against */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.use_nmea_file = 0;
+    cfg.latitude = 35.30389;
+    cfg.longitude = -89.50139;
+
+    arena_init(&arena, ARENA_CHUNK_SIZE);
+    for(i=1; i<argc; ++i)
+    {
+        before = heap_calls;
+        if(tag_file(argv[i], &cfg, &arena, NULL) != TAG_OK)
+        {
+            fprintf(stderr, "alloc_count: could not tag '%s'\n", argv[i]);
+            failed = 1;
+            continue;
+        }
+        calls = heap_calls - before;
+        if(i == 1)
+            continue;
+        if(i == 2)
+            expected = calls;
+        else if(calls != expected)
+        {
+            fprintf(stderr, "alloc_count: '%s' took %lu heap calls, not %lu\n",
+                    argv[i], calls, expected);
+            failed = 1;
+        }
+    }
+    arena_free(&arena);
+
+    if(!failed)
+        printf("alloc_count: %lu heap calls per image over %d images after a warm-up\n",
+               expected, argc - 2);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
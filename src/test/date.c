@@ -0,0 +1,50 @@
+/*
+ * date.c
+ * check days_from_civil against timegm
+ *
+ * usage: date_check
+ *
+ * walks every day from the start of FIRST_YEAR to the end of LAST_YEAR,
+ * which takes in ordinary leap years, the century years that aren't
+ * leap years (1700, 1800, 1900, 2100...) and the ones that are (1600,
+ * 2000, 2400). the dates come from gmtime stepping a day at a time, so
+ * the calendar being checked against is libc's, not ours.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../date.h"
+
+#define FIRST_YEAR 1
+#define LAST_YEAR 2800
+
+int main(int argc, char** argv)
+{
+    struct tm tm = {0};
+    time_t t;
+    long days = 0;
+    int failed = 0;
+
+    tm.tm_year = FIRST_YEAR - 1900;
+    tm.tm_mday = 1;
+    for(t = timegm(&tm); gmtime_r(&t, &tm) && tm.tm_year + 1900 <= LAST_YEAR; t += 86400)
+    {
+        long want = (long)(t / 86400);
+        long got = days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+
+        if(got != want)
+        {
+            fprintf(stderr, "date_check: %04d-%02d-%02d is day %ld, not %ld\n",
+                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, got, want);
+            if(++failed == 10)
+                break;
+        }
+        days++;
+    }
+
+    if(!failed)
+        printf("date_check: %ld days from %d to %d agree with timegm\n",
+               days, FIRST_YEAR, LAST_YEAR);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
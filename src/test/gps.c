@@ -0,0 +1,95 @@
+/*
+ * gps.c
+ * check what gps_ifd_encode writes for altitudes above and below sea
+ * level, in both byte orders
+ *
+ * usage: gps_check
+ *
+ * GPSAltitude is an unsigned rational, so a fix below sea level has to
+ * come out as its distance below with GPSAltitudeRef set to 1, not as a
+ * negative number wrapped round to four billion decimetres.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../tiff.h"
+#include "../util.h"
+#include "../arena.h"
+#include "../nikond90.h"
+#include "../types.h"
+
+/* where the block goes, just past a bare tiff header */
+#define BLOCK_OFFSET 8
+
+/*
+ * encode a fix at the given altitude and read back its altitude fields.
+ * returns 0, with a message, if they aren't ref and numerator/10.
+ */
+static int check_altitude(unsigned int byte_order, double altitude,
+                          unsigned byte ref, unsigned int32 numerator)
+{
+    unsigned byte buf[BLOCK_OFFSET + GPS_IFD_MAX_SIZE];
+    location_t loc;
+    tiff_t t;
+    ifd_t ifd;
+    arena_t arena;
+    direntry_t* dir;
+    unsigned byte* got_ref = NULL;
+    rational_t* got = NULL;
+    unsigned int32 len;
+    int ok;
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, byte_order == TIFF_BIG_ENDIAN ? "MM" : "II", 2);
+    put_uint16(buf + 2, TIFF_MAGIC, byte_order != HOST_BYTE_ORDER);
+    put_uint32(buf + 4, BLOCK_OFFSET, byte_order != HOST_BYTE_ORDER);
+    tiff_attach(&t, -1, buf, sizeof(buf), 0);
+    if(!valid_tiff_file(&t))
+        return 0;
+
+    memset(&loc, 0, sizeof(loc));
+    loc.when = 1257572157;
+    loc.status = 'A';
+    loc.latitude = 3518.2337;
+    loc.lat_ref = 'N';
+    loc.longitude = 8930.0836;
+    loc.lon_ref = 'W';
+    loc.altitude = altitude;
+    loc.have_altitude = 1;
+    len = gps_ifd_encode(&t, &loc, BLOCK_OFFSET, 0, buf + BLOCK_OFFSET);
+
+    arena_init(&arena, ARENA_CHUNK_SIZE);
+    if(len > 0 && ifd_load(&t, BLOCK_OFFSET, &ifd, &arena))
+    {
+        if((dir = ifd_find(&ifd, GPSAltitudeRef)) != NULL)
+            got_ref = (unsigned byte*)direntry_values(&t, dir, &arena);
+        if((dir = ifd_find(&ifd, GPSAltitude)) != NULL)
+            got = (rational_t*)direntry_values(&t, dir, &arena);
+    }
+    ok = got_ref && got && *got_ref == ref &&
+         got->numerator == numerator && got->denominator == 10;
+    if(!ok)
+        fprintf(stderr, "gps_check: altitude %.2f (%s) came out as ref %d, %u/%u\n",
+                altitude, byte_order == TIFF_BIG_ENDIAN ? "MM" : "II",
+                got_ref ? *got_ref : -1, got ? got->numerator : 0, got ? got->denominator : 0);
+    arena_free(&arena);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    static const unsigned int orders[2] = { TIFF_LITTLE_ENDIAN, TIFF_BIG_ENDIAN };
+    int ok = 1;
+    int i;
+
+    for(i=0; i<2; ++i)
+    {
+        ok = check_altitude(orders[i], 88.56, 0, 886) && ok;
+        ok = check_altitude(orders[i], -12.34, 1, 123) && ok;
+        ok = check_altitude(orders[i], -0.04, 1, 0) && ok;
+    }
+    if(ok)
+        printf("gps_check: altitudes above and below sea level encode correctly\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# journal.sh
+# check that a journal torn by a crash still rolls back every run: tag a
+# file with a journal, cut the journal off part way through its last
+# record, tag another file with the same journal, then roll back and
+# expect both files as they were.
+#
+# usage: journal.sh <dir>
+#
+# run from src/ after make check has built neftag and the generators.
+
+if [ $# -ne 1 ]; then
+    echo "usage: $0 <dir>" >&2
+    exit 1
+fi
+
+DIR=$1
+rm -rf "$DIR"
+mkdir -p "$DIR/nef" "$DIR/orig"
+
+fail() {
+    echo "journal: $*" >&2
+    exit 1
+}
+
+bench/gen_nef -n 2 -s 4096 "$DIR/nef" || fail "could not generate images"
+bench/gen_log -n 600 "$DIR/track.log" || fail "could not generate a log"
+cp "$DIR"/nef/*.NEF "$DIR/orig/"
+
+./neftag -N --journal="$DIR/journal" "$DIR/track.log" "$DIR/nef/DSC_00000.NEF" ||
+    fail "first run failed"
+cmp -s "$DIR/nef/DSC_00000.NEF" "$DIR/orig/DSC_00000.NEF" && fail "first run changed nothing"
+
+# the last record is the first run's end marker; tear it in half
+SIZE=$(wc -c < "$DIR/journal")
+truncate -s $((SIZE - 10)) "$DIR/journal"
+
+./neftag -N --journal="$DIR/journal" "$DIR/track.log" "$DIR/nef/DSC_00001.NEF" ||
+    fail "second run failed"
+cmp -s "$DIR/nef/DSC_00001.NEF" "$DIR/orig/DSC_00001.NEF" && fail "second run changed nothing"
+
+./neftag --rollback="$DIR/journal" || fail "rollback failed"
+for f in DSC_00000.NEF DSC_00001.NEF; do
+    cmp -s "$DIR/nef/$f" "$DIR/orig/$f" || fail "$f wasn't rolled back"
+done
+echo "journal: both runs rolled back past a torn record"
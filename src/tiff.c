@@ -8,8 +8,13 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tiff.h"
 #include "util.h"
+#include "arena.h"
 #include "csv.h"
 #include "date.h"
 #include "nmea.h"
@@ -18,227 +23,232 @@
 /* size in bytes of each of the TIFF data types */
 unsigned int type_bytes[13] = {-1, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8};
 
-/* little or big endian */
-unsigned int byte_order;
+/*
+ * byte swap an array of count values of the given type in place. this is
+ * the only difference between the little and big endian decode paths, and
+ * it runs on whole arrays rather than one value at a time.
+ */
+static void swap_values(unsigned int16 type, void* values, unsigned int32 count)
+{
+    switch(type)
+    {
+    case SHORT:
+    case SSHORT:
+        swap_endian2_array((unsigned int16*)values, count);
+        break;
+    case LONG:
+    case SLONG:
+    case FLOAT:
+        swap_endian4_array((unsigned int32*)values, count);
+        break;
+    case RATIONAL:
+    case SRATIONAL:
+        /* numerator and denominator are swapped independently */
+        swap_endian4_array((unsigned int32*)values, 2*count);
+        break;
+    case DOUBLE:
+        swap_endian8_array((unsigned int64*)values, count);
+        break;
+    }
+}
 
 /*
- * load an ifd_t from a given tiff file
- * reads all the direntry_t blocks and sets up the next_offset pointer
- * for the block
+ * map the whole of an open tiff file read-only. pages are only faulted in
+ * as the header walk touches them, so the image data itself is never read.
  */
-void ifd_load(FILE* f, ifd_t* ifd)
+int tiff_map(tiff_t* t, int fd)
 {
-    /* must be called when the file pointer is at the beginning of the IFD */
-    int i, j;
+    struct stat st;
+    void* p;
+
+    memset(t, 0, sizeof(tiff_t));
+    t->fd = fd;
+    if(fstat(fd, &st) < 0)
+    {
+        perror("fstat");
+        return 0;
+    }
+
+    /* tiff offsets are 32 bits, so nothing past 4GB is addressable anyway */
+    if(st.st_size < 8 || st.st_size > 0xFFFFFFFFLL)
+    {
+        fprintf(stderr, "file size %lld not valid for tiff file\n", (long long)st.st_size);
+        return 0;
+    }
+    
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+    t->data = (const unsigned byte*)p;
+    t->size = (unsigned int32)st.st_size;
+    return 1;
+}
+
+/*
+ * release the mapping set up by tiff_map. the descriptor belongs to the
+ * caller and is left open.
+ */
+void tiff_unmap(tiff_t* t)
+{
+    if(t->data)
+        munmap((void*)t->data, t->size);
+    t->data = NULL;
+    t->size = 0;
+}
+
+/*
+ * use bytes already read from the start of an open file in place of a
+ * mapping. if partial, the file is longer than len, and a failed lookup
+ * may only mean the header runs past what was read.
+ */
+void tiff_attach(tiff_t* t, int fd, const void* buf, unsigned int32 len, int partial)
+{
+    memset(t, 0, sizeof(tiff_t));
+    t->fd = fd;
+    t->data = (const unsigned byte*)buf;
+    t->size = len;
+    t->partial = partial;
+}
+
+/*
+ * load an ifd_t from the given offset of a mapped tiff file
+ * indexes all the direntry_t blocks and sets up the next_offset pointer
+ * for the block. only the tag, type, count and location of each value
+ * are recorded; the values themselves are left in the file until asked
+ * for with direntry_values. returns 0 if the directory lies outside the
+ * file.
+ */
+int ifd_load(tiff_t* t, unsigned int32 offset, ifd_t* ifd, arena_t* arena)
+{
+    int i;
+    cursor_t c;
     memset(ifd, 0, sizeof(ifd_t));
+    cursor_init(&c, t->data, t->size, offset, t->swap);
     
     /* get the number of directory entries */
-    ifd->count = read_uint16(f);
-    ifd->dirs = (direntry_t*)malloc(ifd->count * sizeof(direntry_t));
+    ifd->count = cursor_read_uint16(&c);
+    if(c.error)
+        return 0;
+    ifd->dirs = (direntry_t*)arena_calloc(arena, ifd->count * sizeof(direntry_t));
     
-    /* read each directory entry */
+    /* index each directory entry */
     for(i=0; i<ifd->count; ++i)
     {
-        ifd->dirs[i].tag = read_uint16(f);
-        ifd->dirs[i].type = read_uint16(f);
-        ifd->dirs[i].count = read_uint32(f);
-        switch(ifd->dirs[i].type)
-        {
-        case BYTE:
-        case ASCII:
-        case UNDEFINED:
-            ifd->dirs[i].byte_values = (unsigned byte*)malloc(ifd->dirs[i].count * sizeof(byte));
-            break;
-        case SBYTE:
-            ifd->dirs[i].sbyte_values = (byte*)malloc(ifd->dirs[i].count * sizeof(byte));
-            break;
-        case SHORT:
-            ifd->dirs[i].uint16_values = (unsigned int16*)malloc(ifd->dirs[i].count * sizeof(int16));
-            break;
-        case SSHORT:
-            ifd->dirs[i].int16_values = (int16*)malloc(ifd->dirs[i].count * sizeof(int16));
-            break;
-        case LONG:
-            ifd->dirs[i].uint32_values = (unsigned int32*)malloc(ifd->dirs[i].count * sizeof(int32));
-            break;
-        case SLONG:
-            ifd->dirs[i].int32_values = (int32*)malloc(ifd->dirs[i].count * sizeof(int32));
-            break;
-        case FLOAT:
-            ifd->dirs[i].float32_values = (float32*)malloc(ifd->dirs[i].count * sizeof(float32));
-            break;
-        case DOUBLE:
-            ifd->dirs[i].float64_values = (float64*)malloc(ifd->dirs[i].count * sizeof(float64));
-            break;
-        case RATIONAL:
-            ifd->dirs[i].rational_values = (rational_t*)malloc(ifd->dirs[i].count * sizeof(rational_t));
-            break;
-        }
-
-        if(ifd->dirs[i].count * type_bytes[ifd->dirs[i].type] <= 4)
-        {
-            /* value fits entirely in the 4 byte value offset field */
-            unsigned int bytes_read = 0;
-            for(j=0; j<ifd->dirs[i].count; ++j)
-            {
-                bytes_read+=type_bytes[ifd->dirs[i].type];
-                switch(ifd->dirs[i].type)
-                {
-                case BYTE:
-                case ASCII:
-                case UNDEFINED:
-                    ifd->dirs[i].byte_values[j] = read_byte(f);
-                    break;
-                case SBYTE:
-                    ifd->dirs[i].sbyte_values[j] = read_byte(f);
-                    break;
-                case SHORT:
-                    ifd->dirs[i].uint16_values[j] = read_uint16(f);
-                    break;
-                case SSHORT:
-                    ifd->dirs[i].int16_values[j] = read_int16(f);
-                    break;
-                case LONG:
-                    ifd->dirs[i].uint32_values[j] = read_uint32(f);
-                    break;
-                case SLONG:
-                    ifd->dirs[i].int32_values[j] = read_int32(f);
-                    break;
-                case FLOAT:
-                    ifd->dirs[i].float32_values[j] = read_float32(f);
-                    break;
-                default:
-                    fprintf(stderr, "can't fit specified type '%d' into value offset field\n",
-                            ifd->dirs[i].type);
-                    break;
-                }
-            }
-            for(; bytes_read<4; ++bytes_read)
-            {
-                read_byte(f);
-            }
-        }
+        direntry_t* dir = &ifd->dirs[i];
+        unsigned int32 entry = c.pos;
+        
+        dir->tag = cursor_read_uint16(&c);
+        dir->type = cursor_read_uint16(&c);
+        dir->count = cursor_read_uint32(&c);
+
+        /* values of 4 bytes or less sit in the value offset field itself;
+         * otherwise the field holds the offset where the data is stored */
+        if(dir->type >= BYTE && dir->type <= DOUBLE &&
+           (unsigned int64)dir->count * type_bytes[dir->type] > 4)
+            dir->offset = cursor_read_uint32(&c);
         else
-        {
-            int p;
-            
-            /* read the offset where the data is stored */
-            unsigned int32 dataloc = read_uint32(f);
-            
-            /* save the current offset */
-            unsigned int32 cpos = ftell(f);
-
-            /* jump to the data */
-            fseek(f, dataloc, SEEK_SET);
-
-            /* read it */
-            for(p=0; p<ifd->dirs[i].count; ++p)
-            {
-                switch(ifd->dirs[i].type)
-                {
-                case BYTE:
-                case ASCII:
-                case UNDEFINED:
-                    ifd->dirs[i].byte_values[p] = read_byte(f);
-                    break;
-                case SBYTE:
-                    ifd->dirs[i].sbyte_values[p] = read_byte(f);
-                    break;
-                case SHORT:
-                    ifd->dirs[i].uint16_values[p] = read_uint16(f);
-                    break;
-                case SSHORT:
-                    ifd->dirs[i].int16_values[p] = read_int16(f);
-                    break;
-                case LONG:
-                    ifd->dirs[i].uint32_values[p] = read_uint32(f);
-                    break;
-                case SLONG:
-                    ifd->dirs[i].int32_values[p] = read_int32(f);
-                    break;
-                case FLOAT:
-                    ifd->dirs[i].float32_values[p] = read_float32(f);
-                    break;
-                case DOUBLE:
-                    ifd->dirs[i].float64_values[p] = read_float64(f);
-                    break;
-                case RATIONAL:
-                    ifd->dirs[i].rational_values[p].numerator = read_uint32(f);
-                    ifd->dirs[i].rational_values[p].denominator = read_uint32(f);
-                    break;
-                }
-            }
-
-            /* and jump back */
-            fseek(f, cpos, SEEK_SET);
-        }
+            dir->offset = entry + 8;
+        cursor_seek(&c, entry + 12);
     }
     
     /* read the next ifd offset */
-    ifd->next_offset = read_uint32(f);
+    ifd->next_offset = cursor_read_uint32(&c);
+    if(c.error)
+    {
+        memset(ifd, 0, sizeof(ifd_t));
+        return 0;
+    }
+    return 1;
 }
 
 /*
- * free any allocated memory inside an ifd_t
+ * decode the values of an indexed directory entry on first use. the
+ * array is copied out of the mapping into the arena and fixed up to host
+ * byte order in bulk. returns NULL if the type is unknown or the values
+ * lie outside the file.
  */
-void ifd_free(ifd_t* ifd)
+void* direntry_values(tiff_t* t, direntry_t* dir, arena_t* arena)
+{
+    unsigned int64 nbytes;
+    
+    if(dir->byte_values)
+        return dir->byte_values;
+    if(dir->type < BYTE || dir->type > DOUBLE)
+        return NULL;
+
+    nbytes = (unsigned int64)dir->count * type_bytes[dir->type];
+    if(dir->offset > t->size || nbytes > t->size - dir->offset)
+    {
+        if(!t->partial)
+            fprintf(stderr, "value of tag %x runs past end of file\n", dir->tag);
+        return NULL;
+    }
+        
+    /* all the value pointers share a union, so one buffer serves any type */
+    dir->byte_values = (unsigned byte*)arena_alloc(arena, nbytes);
+    memcpy(dir->byte_values, t->data + dir->offset, nbytes);
+    if(t->swap)
+        swap_values(dir->type, dir->byte_values, dir->count);
+    return dir->byte_values;
+}
+
+/*
+ * find the entry with the given tag in an ifd, or NULL if there isn't one
+ */
+direntry_t* ifd_find(ifd_t* ifd, unsigned int16 tag)
 {
     int i;
     for(i=0; i<ifd->count; ++i)
     {
-        switch(ifd->dirs[i].type)
-        {
-        case BYTE:
-        case ASCII:
-        case UNDEFINED:
-            free(ifd->dirs[i].byte_values);
-            break;
-        case SBYTE:
-            free(ifd->dirs[i].sbyte_values);
-            break;
-        case SHORT:
-            free(ifd->dirs[i].uint16_values);
-            break;
-        case SSHORT:
-            free(ifd->dirs[i].int16_values);
-            break;
-        case LONG:
-            free(ifd->dirs[i].uint32_values);
-            break;
-        case SLONG:
-            free(ifd->dirs[i].int32_values);
-            break;
-        case FLOAT:
-            free(ifd->dirs[i].float32_values);
-            break;
-        case DOUBLE:
-            free(ifd->dirs[i].float64_values);
-            break;
-        case RATIONAL:
-            free(ifd->dirs[i].rational_values);
-            break;
-        }
+        if(ifd->dirs[i].tag == tag)
+            return &ifd->dirs[i];
     }
-    free(ifd->dirs);
+    return NULL;
+}
+
+/*
+ * peek at the start of an open file to see whether it's a tiff file,
+ * without parsing anything. the file is left where it was.
+ */
+int is_tiff_file(FILE* fp)
+{
+    unsigned char head[4];
+    long pos = ftell(fp);
+    size_t n = fread(head, 1, 4, fp);
+
+    fseek(fp, pos, SEEK_SET);
+    if(n < 4)
+        return 0;
+    return (head[0] == 'I' && head[1] == 'I' && head[2] == TIFF_MAGIC && head[3] == 0) ||
+           (head[0] == 'M' && head[1] == 'M' && head[2] == 0 && head[3] == TIFF_MAGIC);
 }
 
 /*
  * check the magic bytes at the beginning of the file to make sure it's
  * really a tiff file, and set the byte ordering in use in the file
  */
-int valid_tiff_file(FILE* f)
+int valid_tiff_file(tiff_t* t)
 {
-    /* assume that file pointer is at offset 0 */
     unsigned int16 magic_number = 0;
+    cursor_t c;
 
-    fread(&byte_order, 1, 2, f);
-    magic_number = read_uint16(f);
-    
-    if(byte_order != TIFF_LITTLE_ENDIAN && byte_order != TIFF_BIG_ENDIAN)
+    /* the byte order mark reads the same either way round. everything
+     * after it is decoded with or without swapping depending on it. */
+    t->byte_order = t->data[0] | (t->data[1] << 8);
+    if(t->byte_order != TIFF_LITTLE_ENDIAN && t->byte_order != TIFF_BIG_ENDIAN)
     {
-        fprintf(stderr, "invalid byte ordering %x\n", byte_order);
+        fprintf(stderr, "invalid byte ordering %x\n", t->byte_order);
         return 0;
     }
+    t->swap = (t->byte_order != HOST_BYTE_ORDER);
+
+    cursor_init(&c, t->data, t->size, 2, t->swap);
+    magic_number = cursor_read_uint16(&c);
+    t->first_ifd = cursor_read_uint32(&c);
+    
     if(magic_number != TIFF_MAGIC)
     {
         fprintf(stderr, "magic number %d (%x) not valid for tiff file\n",
@@ -250,155 +260,32 @@ int valid_tiff_file(FILE* f)
 }
 
 /*
- * write a new ifd_t block into the given tiff file
+ * write len bytes at the given offset of the file with a single
+ * positioned write (retrying only if the kernel comes up short)
  */
-void ifd_write(FILE* f, ifd_t* ifd)
+int tiff_write(tiff_t* t, unsigned int32 offset, const void* buf, unsigned int32 len)
 {
-    /* ifd is the GPSInfoIFD structure; file pointer of f must be positioned
-     * to the location of the gps_info pointer
-     */
-    unsigned int16 i, j;
-    unsigned int32 ifd_block_size;
-    unsigned int32 ifd_value_offset;
-    unsigned int value_bytes_written = 0;
-    
-    /* total block is a two byte header determining count of directory entries,
-     * 12*n bytes for all n directories, and a 4 byte pointer to the next block */
-    ifd_block_size = 2 + 12*ifd->count + 4;
-    ifd_value_offset = ftell(f)+ifd_block_size;
-    
-    /* write the number of directory entries in the gps info section */
-    write_uint16(f, ifd->count);
-    
-    /* write each directory */
-    for(i=0; i<ifd->count; ++i)
+    const unsigned byte* p = (const unsigned byte*)buf;
+    while(len > 0)
     {
-        write_uint16(f, ifd->dirs[i].tag);
-        write_uint16(f, ifd->dirs[i].type);
-        write_uint32(f, ifd->dirs[i].count);
-
-        if(ifd->dirs[i].count * type_bytes[ifd->dirs[i].type] <= 4)
+        ssize_t n = pwrite(t->fd, p, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
         {
-            /* can write the data directly into the value offset field */
-            unsigned int bytes_written = 0;
-            for(j=0; j<ifd->dirs[i].count; ++j)
-            {
-                bytes_written+=type_bytes[ifd->dirs[i].type];
-                switch(ifd->dirs[i].type)
-                {
-                case BYTE:
-                case ASCII:
-                case UNDEFINED:
-                    write_byte(f, ifd->dirs[i].byte_values[j]);
-                    break;
-                case SBYTE:
-                    write_sbyte(f, ifd->dirs[i].sbyte_values[j]);
-                    break;
-                case SHORT:
-                    write_uint16(f, ifd->dirs[i].uint16_values[j]);
-                    break;
-                case SSHORT:
-                    write_int16(f, ifd->dirs[i].int16_values[j]);
-                    break;
-                case LONG:
-                    write_uint32(f, ifd->dirs[i].uint32_values[j]);
-                    break;
-                case SLONG:
-                    write_int32(f, ifd->dirs[i].int32_values[j]);
-                    break;
-                case FLOAT:
-                    write_float32(f, ifd->dirs[i].float32_values[j]);
-                    break;
-                default:
-                    fprintf(stderr, "attempt to write impossible type '%d' into "
-                            "value offset field\n", ifd->dirs[i].type);
-                    break;
-                }
-            }
-            /* make sure we have written an even number of bytes */
-            if(bytes_written % 2 == 1)
-            {
-                unsigned byte c = 0;
-                write_byte(f, c);
-                ++bytes_written;
-            }
-            /* make sure we fill out the value offset field completely */
-            for(; bytes_written<4; ++bytes_written)
-            {
-                unsigned byte c = 0;
-                write_byte(f, c);
-            }
-        }
-        else
-        {
-            /* must write a pointer to where the data will be written */
-            unsigned int32 cpos;
-            unsigned int32 pos = ifd_value_offset + value_bytes_written;
-            write_uint32(f, pos);
-            cpos = ftell(f);
-
-            /* now go to that location and write the data */
-            fseek(f, pos, SEEK_SET);
-            for(j=0; j<ifd->dirs[i].count; ++j)
-            {
-                value_bytes_written+=type_bytes[ifd->dirs[i].type];
-                switch(ifd->dirs[i].type)
-                {
-                case BYTE:
-                case ASCII:
-                case UNDEFINED:
-                    write_byte(f, ifd->dirs[i].byte_values[j]);
-                    break;
-                case SBYTE:
-                    write_sbyte(f, ifd->dirs[i].sbyte_values[j]);
-                    break;
-                case SHORT:
-                    write_uint16(f, ifd->dirs[i].uint16_values[j]);
-                    break;
-                case SSHORT:
-                    write_int16(f, ifd->dirs[i].int16_values[j]);
-                    break;
-                case LONG:
-                    write_uint32(f, ifd->dirs[i].uint32_values[j]);
-                    break;
-                case SLONG:
-                    write_int32(f, ifd->dirs[i].int32_values[j]);
-                    break;
-                case FLOAT:
-                    write_float32(f, ifd->dirs[i].float32_values[j]);
-                    break;
-                case DOUBLE:
-                    write_float64(f, ifd->dirs[i].float64_values[j]);
-                    break;
-                case RATIONAL:
-                    write_uint32(f, ifd->dirs[i].rational_values[j].numerator);
-                    write_uint32(f, ifd->dirs[i].rational_values[j].denominator);
-                    break;
-                default:
-                    fprintf(stderr, "attempt to write impossible type '%d' into "
-                            "value offset field\n", ifd->dirs[i].type);
-                    break;
-                }
-            }
-            /* make sure we have written an even number of bytes */
-            if(value_bytes_written % 2 == 1)
-            {
-                unsigned byte c = 0;
-                write_byte(f, c);
-                ++value_bytes_written;
-            }
-
-            /* now jump back to where we were in the file */
-            fseek(f, cpos, SEEK_SET);
+            perror("pwrite");
+            return 0;
         }
+        p += n;
+        offset += n;
+        len -= n;
     }
-
-    /* and finally, write the offset to the next ifd */
-    write_uint32(f, ifd->next_offset);
+    return 1;
 }
 
 /*
  * debugging aid to print out the information in a particular direntry_t
+ * whose values have already been decoded
  */
 void print_values(direntry_t* dir)
 {
@@ -456,170 +343,229 @@ void print_values(direntry_t* dir)
  */
 void parse_datetime(const char* dt, struct tm* t)
 {
-    char* tmp = (char*)malloc(strlen(dt));
-    char** toks;
+    /* "YYYY:MM:DD HH:MM:SS" plus the terminator */
     const int NUM_DT_TOKENS = 6;
-    const int MAX_DT_TOKEN_LEN = 4;
-    int i;
+    char tmp[20];
+    char* toks[6];
     
     /* make a backup copy of the string */
-    strncpy(tmp, dt, strlen(dt));
-
-    /* init some memory to use to parse the date string */
-    toks = (char**)malloc(NUM_DT_TOKENS * sizeof(char*));
-    for(i=0; i<NUM_DT_TOKENS; ++i)
-    {
-        toks[i] = (char*)malloc((MAX_DT_TOKEN_LEN+1) * sizeof(char));
-        //*toks[i] = '\0';
-    }
+    strncpy(tmp, dt, sizeof(tmp)-1);
+    tmp[sizeof(tmp)-1] = '\0';
 
     /* parse the line */
+    memset(toks, 0, sizeof(toks));
     parse_line(tmp, ": ", toks, NUM_DT_TOKENS);
 
-    t->tm_year = atoi(toks[0]) - 1900;
-    t->tm_mon = atoi(toks[1]) - 1;
-    t->tm_mday = atoi(toks[2]);
-    t->tm_hour = atoi(toks[3]);
-    t->tm_min = atoi(toks[4]);
-    t->tm_sec = atoi(toks[5]);
+    t->tm_year = toks[0] ? atoi(toks[0]) - 1900 : 0;
+    t->tm_mon = toks[1] ? atoi(toks[1]) - 1 : 0;
+    t->tm_mday = toks[2] ? atoi(toks[2]) : 0;
+    t->tm_hour = toks[3] ? atoi(toks[3]) : 0;
+    t->tm_min = toks[4] ? atoi(toks[4]) : 0;
+    t->tm_sec = toks[5] ? atoi(toks[5]) : 0;
+}
+
+/*
+ * state for laying out an ifd block in memory: the entry table is filled
+ * from the front and out-of-line values are appended after it, exactly
+ * as they'll sit in the file
+ */
+typedef struct
+{
+    tiff_t* t;
+    unsigned byte* buf;
+    unsigned int32 base;        /* file offset the block will be written at */
+    unsigned int32 entry_pos;   /* next free entry in buf */
+    unsigned int32 value_pos;   /* next free byte of the value area in buf */
+} ifd_encoder_t;
+
+static void encoder_init(ifd_encoder_t* e, tiff_t* t, unsigned byte* buf, unsigned int32 base,
+                         unsigned int16 count)
+{
+    e->t = t;
+    e->buf = buf;
+    e->base = base;
+    e->entry_pos = 2;
+    e->value_pos = 2 + 12*count + 4;
+    put_uint16(buf, count, t->swap);
 }
 
 /*
- * given an ifd_t structure for the gps information and a location_t
- * structure recorded from the gps logger, populate the useful fields
- * to write the gps info into the tiff headers
+ * add one entry with count host-order values of the given type. values
+ * that fit go in the value offset field; the rest go in the value area,
+ * padded to an even length.
  */
-void populate_gps_info_ifd(ifd_t* ifd, location_t* match)
+static void encoder_add(ifd_encoder_t* e, unsigned int16 tag, unsigned int16 type,
+                        unsigned int32 count, const void* values)
+{
+    unsigned byte* entry = e->buf + e->entry_pos;
+    unsigned int32 nbytes = count * type_bytes[type];
+    unsigned byte* dst;
+
+    put_uint16(entry, tag, e->t->swap);
+    put_uint16(entry+2, type, e->t->swap);
+    put_uint32(entry+4, count, e->t->swap);
+    memset(entry+8, 0, 4);
+    if(nbytes <= 4)
+    {
+        dst = entry+8;
+    }
+    else
+    {
+        dst = e->buf + e->value_pos;
+        put_uint32(entry+8, e->base + e->value_pos, e->t->swap);
+        e->value_pos += nbytes;
+        if(e->value_pos % 2 == 1)
+            e->buf[e->value_pos++] = 0;
+    }
+    memcpy(dst, values, nbytes);
+    if(e->t->swap)
+        swap_values(type, dst, count);
+    e->entry_pos += 12;
+}
+
+/*
+ * finish the block with the next ifd pointer and return its total size
+ */
+static unsigned int32 encoder_finish(ifd_encoder_t* e, unsigned int32 next_offset)
+{
+    put_uint32(e->buf + e->entry_pos, next_offset, e->t->swap);
+    return e->value_pos;
+}
+
+/*
+ * store degrees, minutes and seconds as a triple of rationals
+ */
+static void dms_rationals(double nmea, rational_t* r)
 {
-    int index = 0;
-    struct tm t;
     int deg;
     int min;
     double sec;
     
-    /* now fill the gps info ifd structure */
-    if(fabs(match->geoid_ht) > 1e-3)
-        ifd->count = 10;
-    else
-        ifd->count = 7;
-    ifd->dirs = (direntry_t*)malloc(ifd->count * sizeof(direntry_t));
+    dec2dms(nmea, &deg, &min, &sec);
+    r[0].numerator = deg;
+    r[0].denominator = 1;
+    r[1].numerator = min;
+    r[1].denominator = 1;
+    r[2].numerator = (int32)floor(sec * 100);
+    r[2].denominator = 100;
+}
+
+/*
+ * given a location_t structure recorded from the gps logger, lay out a
+ * complete GPS info ifd block (entries and value area) in buf, ready to
+ * be written at the given file offset. buf must hold GPS_IFD_MAX_SIZE
+ * bytes. returns the size of the block.
+ */
+unsigned int32 gps_ifd_encode(tiff_t* t, location_t* match, unsigned int32 offset,
+                              unsigned int32 next_offset, unsigned byte* buf)
+{
+    ifd_encoder_t e;
+    struct tm tm;
+    unsigned byte version[4] = {2, 2, 0, 0};
+    char ref[2];
+    char date[40];
+    unsigned byte alt_ref;
+    rational_t r[3];
+    
+    int have_altitude = match->have_altitude;
 
+    memset(buf, 0, GPS_IFD_MAX_SIZE);
+    encoder_init(&e, t, buf, offset, have_altitude ? 10 : 7);
+    
     /* hard coded version id */
-    ifd->dirs[index].tag = GPSVersionID;
-    ifd->dirs[index].type = BYTE;
-    ifd->dirs[index].count = 4;
-    ifd->dirs[index].byte_values = (unsigned byte*)malloc(ifd->dirs[index].count * sizeof(byte));
-    ifd->dirs[index].byte_values[0] = 2;
-    ifd->dirs[index].byte_values[1] = 2;
-    ifd->dirs[index].byte_values[2] = 0;
-    ifd->dirs[index].byte_values[3] = 0;
-    ++index;
-
-    /* latitude ref is "N" or "S" */
-    ifd->dirs[index].tag = GPSLatitudeRef;
-    ifd->dirs[index].type = ASCII;
-    ifd->dirs[index].count = 2;
-    ifd->dirs[index].byte_values = (unsigned byte*)malloc(ifd->dirs[index].count);
-    snprintf((char*)ifd->dirs[index].byte_values, ifd->dirs[index].count, "%c", match->lat_ref);
-    ++index;
-
-    /* latitudes recorded in degrees, minutes, seconds as a triple of rational numbers */
-    dec2dms(match->latitude, &deg, &min, &sec);
-    ifd->dirs[index].tag = GPSLatitude;
-    ifd->dirs[index].type = RATIONAL;
-    ifd->dirs[index].count = 3;
-    ifd->dirs[index].rational_values = (rational_t*)malloc(ifd->dirs[index].count * sizeof(rational_t));
-    ifd->dirs[index].rational_values[0].numerator = deg;
-    ifd->dirs[index].rational_values[0].denominator = 1;
-    ifd->dirs[index].rational_values[1].numerator = min;
-    ifd->dirs[index].rational_values[1].denominator = 1;
-    ifd->dirs[index].rational_values[2].numerator = (int32)floor(sec * 100);
-    ifd->dirs[index].rational_values[2].denominator = 100;
-    ++index;
-
-    /* longitude ref is "E" or "W" */
-    ifd->dirs[index].tag = GPSLongitudeRef;
-    ifd->dirs[index].type = ASCII;
-    ifd->dirs[index].count = 2;
-    ifd->dirs[index].byte_values = (unsigned byte*)malloc(ifd->dirs[index].count);
-    snprintf((char*)ifd->dirs[index].byte_values, ifd->dirs[index].count, "%c", match->lon_ref);
-    ++index;
-
-    /* longitude recorded in degrees, minutes, seconds as a triple of rational numbers */
-    dec2dms(match->longitude, &deg, &min, &sec);
-    ifd->dirs[index].tag = GPSLongitude;
-    ifd->dirs[index].type = RATIONAL;
-    ifd->dirs[index].count = 3;
-    ifd->dirs[index].rational_values = (rational_t*)malloc(ifd->dirs[index].count * sizeof(rational_t));
-    ifd->dirs[index].rational_values[0].numerator = deg;
-    ifd->dirs[index].rational_values[0].denominator = 1;
-    ifd->dirs[index].rational_values[1].numerator = min;
-    ifd->dirs[index].rational_values[1].denominator = 1;
-    ifd->dirs[index].rational_values[2].numerator = (int32)floor(sec * 100);
-    ifd->dirs[index].rational_values[2].denominator = 100;
-    ++index;
-                
-    /* only report altitude if we have a geoid height
-     * 
-     * geoid height is the correction required to get accurate MSL (mean sea level)
-     * altitude information. For my SiRF device at least, it appears that the altitude
-     * field is already updated with the correction, so as long as the GPS receiver
-     * had a good enough fix to record a geoid height, then the raw altitude readout
-     * should be accurate. On some devices, you may have to record the altitude as
-     * "altitude - geoid_height".
-     */
-    if(fabs(match->geoid_ht) > 1e-3)
+    encoder_add(&e, GPSVersionID, BYTE, 4, version);
+
+    /* latitudes recorded as "N" or "S", then degrees, minutes, seconds */
+    ref[0] = match->lat_ref;
+    ref[1] = '\0';
+    encoder_add(&e, GPSLatitudeRef, ASCII, 2, ref);
+    dms_rationals(match->latitude, r);
+    encoder_add(&e, GPSLatitude, RATIONAL, 3, r);
+
+    /* same for longitude, with "E" or "W" */
+    ref[0] = match->lon_ref;
+    encoder_add(&e, GPSLongitudeRef, ASCII, 2, ref);
+    dms_rationals(match->longitude, r);
+    encoder_add(&e, GPSLongitude, RATIONAL, 3, r);
+
+    if(have_altitude)
     {
         /* altitude ref is different than other ref fields.  it's a single byte that's
            0 for "above sea level" and 1 for "below sea level" */
-        ifd->dirs[index].tag = GPSAltitudeRef;
-        ifd->dirs[index].type = BYTE;
-        ifd->dirs[index].count = 1;
-        ifd->dirs[index].byte_values = (unsigned byte*)malloc(ifd->dirs[index].count * sizeof(byte));
-        ifd->dirs[index].byte_values[0] = (match->altitude < 0) ? 1 : 0;
-        ++index;
-
-        /* altitude recorded as a rational in meters */
-        ifd->dirs[index].tag = GPSAltitude;
-        ifd->dirs[index].type = RATIONAL;
-        ifd->dirs[index].count = 1;
-        ifd->dirs[index].rational_values = (rational_t*)malloc(ifd->dirs[index].count * sizeof(rational_t));
-        ifd->dirs[index].rational_values[0].numerator = (int32)(match->altitude * 10);
-        ifd->dirs[index].rational_values[0].denominator = 10;
-        ++index;
+        alt_ref = (match->altitude < 0) ? 1 : 0;
+        encoder_add(&e, GPSAltitudeRef, BYTE, 1, &alt_ref);
+
+        /* altitude recorded as an unsigned rational in meters; the ref
+           above carries the sign */
+        r[0].numerator = (unsigned int32)lround(fabs(match->altitude) * 10);
+        r[0].denominator = 10;
+        encoder_add(&e, GPSAltitude, RATIONAL, 1, r);
 
         /* geoidesic specification is WGS-84 */
-        ifd->dirs[index].tag = GPSMapDatum;
-        ifd->dirs[index].type = ASCII;
-        ifd->dirs[index].count = strlen("WGS-84")+1;
-        ifd->dirs[index].byte_values = (unsigned byte*)malloc(ifd->dirs[index].count * sizeof(byte));
-        strncpy((char*)ifd->dirs[index].byte_values, "WGS-84", ifd->dirs[index].count);
-        ++index;
+        encoder_add(&e, GPSMapDatum, ASCII, strlen("WGS-84")+1, "WGS-84");
     }
                 
     /* convert time from gps device back to struct tm format
        so we can write accurate GPS timestamp information */
-    gmtime_r(&(match->when), &t);
+    gmtime_r(&(match->when), &tm);
 
     /* again, time stored as three rationals for h/m/s */
-    ifd->dirs[index].tag = GPSTimeStamp;
-    ifd->dirs[index].type = RATIONAL;
-    ifd->dirs[index].count = 3;
-    ifd->dirs[index].rational_values = (rational_t*)malloc(ifd->dirs[index].count * sizeof(rational_t));
-    ifd->dirs[index].rational_values[0].numerator = t.tm_hour;
-    ifd->dirs[index].rational_values[0].denominator = 1;
-    ifd->dirs[index].rational_values[1].numerator = t.tm_min;
-    ifd->dirs[index].rational_values[1].denominator = 1;
-    ifd->dirs[index].rational_values[2].numerator = t.tm_sec;
-    ifd->dirs[index].rational_values[2].denominator = 1;
-    ++index;
+    r[0].numerator = tm.tm_hour;
+    r[0].denominator = 1;
+    r[1].numerator = tm.tm_min;
+    r[1].denominator = 1;
+    if(match->msec)
+    {
+        /* keep the fraction of a second the logger reported */
+        r[2].numerator = tm.tm_sec * 1000 + match->msec;
+        r[2].denominator = 1000;
+    }
+    else
+    {
+        r[2].numerator = tm.tm_sec;
+        r[2].denominator = 1;
+    }
+    encoder_add(&e, GPSTimeStamp, RATIONAL, 3, r);
 
     /* date, on the other hand, is stored as an ascii string */
-    ifd->dirs[index].tag = GPSDateStamp;
-    ifd->dirs[index].type = ASCII;
-    ifd->dirs[index].count = strlen("yyyy:mm:dd")+1;
-    ifd->dirs[index].byte_values = (unsigned byte*)malloc((ifd->dirs[index].count+1) * sizeof(byte));
-    snprintf((char*)ifd->dirs[index].byte_values, ifd->dirs[index].count,
-             "%04d:%02d:%02d", t.tm_year+1900, t.tm_mon+1, t.tm_mday);
-    ++index;
+    snprintf(date, sizeof(date), "%04d:%02d:%02d", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
+    encoder_add(&e, GPSDateStamp, ASCII, strlen("yyyy:mm:dd")+1, date);
+
+    return encoder_finish(&e, next_offset);
+}
+
+/*
+ * lay out a copy of an ifd already in the file (at offset) with one more
+ * entry added in tag order, holding a single LONG value. the other
+ * entries are copied byte for byte, so values small enough to sit in an
+ * entry come along with it and values it points to stay where they are.
+ * buf must hold IFD_SIZE(ifd->count + 1) bytes. returns the size of the
+ * block, or 0 if the ifd is full or not all in memory.
+ */
+unsigned int32 ifd_copy_insert(tiff_t* t, unsigned int32 offset, const ifd_t* ifd,
+                               unsigned int16 tag, unsigned int32 value, unsigned byte* buf)
+{
+    const unsigned byte* src = t->data + offset + 2;
+    unsigned byte* dst = buf + 2;
+    int i;
+
+    if(ifd->count == 0xffff || offset > t->size || IFD_SIZE(ifd->count) > t->size - offset)
+        return 0;
+
+    put_uint16(buf, ifd->count + 1, t->swap);
+    for(i=0; i<ifd->count && ifd->dirs[i].tag < tag; ++i)
+    {
+        memcpy(dst, src, 12);
+        src += 12;
+        dst += 12;
+    }
+    put_uint16(dst, tag, t->swap);
+    put_uint16(dst+2, LONG, t->swap);
+    put_uint32(dst+4, 1, t->swap);
+    put_uint32(dst+8, value, t->swap);
+    dst += 12;
+    memcpy(dst, src, 12 * (ifd->count - i));
+    dst += 12 * (ifd->count - i);
+    put_uint32(dst, ifd->next_offset, t->swap);
+    return IFD_SIZE(ifd->count + 1);
 }
@@ -3,8 +3,10 @@
  * basic constants for dealing with tiff files
  */
 
+#include <stdio.h>
 #include <time.h>
 #include "nmea.h"
+#include "arena.h"
 #include "types.h"
 
 #ifndef _TIFF_H_
@@ -29,9 +31,21 @@
 #define FLOAT 11
 #define DOUBLE 12
 
-extern unsigned int byte_order;
+/* byte order of the machine we're running on */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BYTE_ORDER TIFF_BIG_ENDIAN
+#else
+#define HOST_BYTE_ORDER TIFF_LITTLE_ENDIAN
+#endif
+
 extern unsigned int type_bytes[13];
 
+/* bytes an ifd of n entries takes, not counting out-of-line values */
+#define IFD_SIZE(n) (2 + 12 * (unsigned int32)(n) + 4)
+
+/* largest block gps_ifd_encode can produce: 10 entries plus their values */
+#define GPS_IFD_MAX_SIZE 256
+
 typedef struct
 {
     unsigned int32 numerator;
@@ -43,7 +57,8 @@ typedef struct
     unsigned int16 tag;
     unsigned int16 type;
     unsigned int32 count;
-    union
+    unsigned int32 offset; /* where the values live in the file */
+    union /* NULL until decoded by direntry_values */
     {
         unsigned byte* byte_values;
         byte* sbyte_values;
@@ -64,12 +79,37 @@ typedef struct
     unsigned int32 next_offset;
 } ifd_t;
 
-void ifd_load(FILE* f, ifd_t* ifd);
-void ifd_free(ifd_t* ifd);
-int valid_tiff_file(FILE* f);
-void ifd_write(FILE* f, ifd_t* ifd);
+/*
+ * a tiff file mapped read-only into memory; all header parsing is done
+ * straight out of the mapping, and writes go through the descriptor.
+ * data may instead hold just a prefix of the file read into a buffer, in
+ * which case partial is set and anything past it looks missing.
+ */
+typedef struct
+{
+    int fd;
+    const unsigned byte* data;
+    unsigned int32 size;
+    int partial;              /* data is a prefix; the file goes on past size */
+    unsigned int byte_order;  /* TIFF_LITTLE_ENDIAN or TIFF_BIG_ENDIAN */
+    int swap;                 /* nonzero if byte_order differs from the host's */
+    unsigned int32 first_ifd; /* offset of ifd0 */
+} tiff_t;
+
+int tiff_map(tiff_t* t, int fd);
+void tiff_unmap(tiff_t* t);
+void tiff_attach(tiff_t* t, int fd, const void* buf, unsigned int32 len, int partial);
+int ifd_load(tiff_t* t, unsigned int32 offset, ifd_t* ifd, arena_t* arena);
+void* direntry_values(tiff_t* t, direntry_t* dir, arena_t* arena);
+direntry_t* ifd_find(ifd_t* ifd, unsigned int16 tag);
+int is_tiff_file(FILE* fp);
+int valid_tiff_file(tiff_t* t);
+int tiff_write(tiff_t* t, unsigned int32 offset, const void* buf, unsigned int32 len);
 void print_values(direntry_t* dir);
 void parse_datetime(const char* dt, struct tm* t);
-void populate_gps_info_ifd(ifd_t* ifd, location_t* match);
+unsigned int32 gps_ifd_encode(tiff_t* t, location_t* match, unsigned int32 offset,
+                              unsigned int32 next_offset, unsigned byte* buf);
+unsigned int32 ifd_copy_insert(tiff_t* t, unsigned int32 offset, const ifd_t* ifd,
+                               unsigned int16 tag, unsigned int32 value, unsigned byte* buf);
 
 #endif
@@ -0,0 +1,517 @@
+/*
+ * track.c
+ * compact column store for the fixes read from a gps log
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "track.h"
+#include "types.h"
+
+/* 1e-5 arc minutes in a degree */
+#define UNITS_PER_DEGREE (60 * TRACK_ANGLE_SCALE)
+
+static int64 clamp(int64 v, int64 lo, int64 hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/*
+ * nmea gives angles as ddmm.mmmm; convert to signed fixed point minutes
+ * and back. converting back divides the same digits by the same power
+ * of ten the parser did, so a fix read from a log comes back bit for bit.
+ */
+static int32 angle_to_fixed(double nmea, int negative)
+{
+    int64 k = llround(fabs(nmea) * TRACK_ANGLE_SCALE);
+    int64 v = (k / (100LL * TRACK_ANGLE_SCALE)) * UNITS_PER_DEGREE + k % (100LL * TRACK_ANGLE_SCALE);
+    v = clamp(v, 0, 0x7fffffff);
+    return (int32)(negative ? -v : v);
+}
+
+static double fixed_to_angle(int32 v)
+{
+    int64 a = v < 0 ? -(int64)v : v;
+    return (double)((a / UNITS_PER_DEGREE) * (100LL * TRACK_ANGLE_SCALE) + a % UNITS_PER_DEGREE)
+        / TRACK_ANGLE_SCALE;
+}
+
+void track_init(track_t* t, int capacity)
+{
+    memset(t, 0, sizeof(track_t));
+    track_reserve(t, capacity > 0 ? capacity : 1);
+}
+
+/*
+ * release a track, whether its columns came from the heap or a mapped index
+ */
+void track_free(track_t* t)
+{
+    track_column_t cols[TRACK_NUM_COLUMNS];
+    int i;
+
+    if(t->map)
+        munmap(t->map, t->map_size);
+    else
+    {
+        track_columns(t, cols);
+        for(i=0; i<TRACK_NUM_COLUMNS; ++i)
+            free(*cols[i].data);
+    }
+    memset(t, 0, sizeof(track_t));
+}
+
+/*
+ * list the columns of a track, so code that moves them around wholesale
+ * (growing, copying, saving to an index) doesn't need to name each one
+ */
+void track_columns(track_t* t, track_column_t* cols)
+{
+    cols[0].data = (void**)&t->when;      cols[0].size = sizeof(*t->when);
+    cols[1].data = (void**)&t->latitude;  cols[1].size = sizeof(*t->latitude);
+    cols[2].data = (void**)&t->longitude; cols[2].size = sizeof(*t->longitude);
+    cols[3].data = (void**)&t->altitude;  cols[3].size = sizeof(*t->altitude);
+    cols[4].data = (void**)&t->flags;     cols[4].size = sizeof(*t->flags);
+    cols[5].data = (void**)&t->speed;     cols[5].size = sizeof(*t->speed);
+    cols[6].data = (void**)&t->heading;   cols[6].size = sizeof(*t->heading);
+    cols[7].data = (void**)&t->geoid_ht;  cols[7].size = sizeof(*t->geoid_ht);
+    cols[8].data = (void**)&t->num_sat;   cols[8].size = sizeof(*t->num_sat);
+    cols[9].data = (void**)&t->quality;   cols[9].size = sizeof(*t->quality);
+}
+
+/*
+ * make room for at least capacity fixes
+ */
+void track_reserve(track_t* t, int capacity)
+{
+    track_column_t cols[TRACK_NUM_COLUMNS];
+    int i;
+
+    if(capacity <= t->capacity)
+        return;
+    track_columns(t, cols);
+    for(i=0; i<TRACK_NUM_COLUMNS; ++i)
+    {
+        *cols[i].data = realloc(*cols[i].data, capacity * cols[i].size);
+        if(!*cols[i].data)
+        {
+            fprintf(stderr, "error enlarging gps track\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->capacity = capacity;
+}
+
+void track_append(track_t* t, const location_t* loc)
+{
+    if(t->count >= t->capacity)
+        track_reserve(t, t->capacity * 2);
+    track_set(t, t->count++, loc);
+}
+
+/*
+ * append every fix of src to t
+ */
+void track_append_track(track_t* t, const track_t* src)
+{
+    track_column_t dst_cols[TRACK_NUM_COLUMNS];
+    track_column_t src_cols[TRACK_NUM_COLUMNS];
+    int i;
+
+    track_reserve(t, t->count + src->count);
+    track_columns(t, dst_cols);
+    track_columns((track_t*)src, src_cols);
+    for(i=0; i<TRACK_NUM_COLUMNS; ++i)
+        memcpy((char*)*dst_cols[i].data + t->count * dst_cols[i].size, *src_cols[i].data,
+               src->count * src_cols[i].size);
+    t->count += src->count;
+}
+
+/*
+ * unpack fix i into a location_t
+ */
+void track_get(const track_t* t, int i, location_t* loc)
+{
+    int64 ms = t->when[i];
+    unsigned byte f = t->flags[i];
+
+    loc->when = (time_t)(ms >= 0 ? ms / 1000 : -((-ms + 999) / 1000));
+    loc->msec = (int)(ms - (int64)loc->when * 1000);
+    loc->status = (f & TRACK_ACTIVE) ? 'A' : ((f & TRACK_VOID) ? 'V' : '\0');
+    loc->latitude = fixed_to_angle(t->latitude[i]);
+    loc->lat_ref = (f & TRACK_NORTH) ? 'N' : ((f & TRACK_SOUTH) ? 'S' : '\0');
+    loc->longitude = fixed_to_angle(t->longitude[i]);
+    loc->lon_ref = (f & TRACK_EAST) ? 'E' : ((f & TRACK_WEST) ? 'W' : '\0');
+    loc->speed = t->speed[i] / 100.0;
+    loc->heading = t->heading[i] / 100.0;
+    loc->altitude = t->altitude[i] / 100.0;
+    loc->geoid_ht = t->geoid_ht[i] / 100.0;
+    loc->have_altitude = (f & TRACK_ALTITUDE) != 0;
+    loc->num_sat = t->num_sat[i];
+    loc->quality = t->quality[i];
+}
+
+/*
+ * pack a location_t into fix i, which must already be allocated
+ */
+void track_set(track_t* t, int i, const location_t* loc)
+{
+    unsigned byte f = 0;
+
+    if(loc->lat_ref == 'N')
+        f |= TRACK_NORTH;
+    else if(loc->lat_ref == 'S')
+        f |= TRACK_SOUTH;
+    if(loc->lon_ref == 'E')
+        f |= TRACK_EAST;
+    else if(loc->lon_ref == 'W')
+        f |= TRACK_WEST;
+    if(loc->status == 'A')
+        f |= TRACK_ACTIVE;
+    else if(loc->status == 'V')
+        f |= TRACK_VOID;
+    if(loc->have_altitude)
+        f |= TRACK_ALTITUDE;
+
+    t->when[i] = (int64)loc->when * 1000 + loc->msec;
+    t->latitude[i] = angle_to_fixed(loc->latitude, f & TRACK_SOUTH);
+    t->longitude[i] = angle_to_fixed(loc->longitude, f & TRACK_WEST);
+    t->altitude[i] = (int32)clamp(llround(loc->altitude * 100), -0x7fffffff, 0x7fffffff);
+    t->flags[i] = f;
+    t->speed[i] = (unsigned int16)clamp(llround(loc->speed * 100), 0, 0xffff);
+    t->heading[i] = (unsigned int16)clamp(llround(loc->heading * 100), 0, 0xffff);
+    t->geoid_ht[i] = (int16)clamp(llround(loc->geoid_ht * 100), -0x7fff, 0x7fff);
+    t->num_sat[i] = (unsigned byte)clamp(loc->num_sat, 0, 0xff);
+    t->quality[i] = (unsigned byte)clamp(loc->quality, 0, 0xff);
+}
+
+/*
+ * custom binary search that looks for the fix whose timestamp is nearest
+ * to the given timestamp. returns its index, or -1 if no fix is stamped
+ * within epsilon seconds.
+ */
+int find_location_at(const track_t* t, time_t ts, int epsilon)
+{
+    int64 target = (int64)ts * 1000;
+    int low = 0;
+    int mid;
+    int high = t->count - 1;
+
+    while(low <= high)
+    {
+        mid = (low + high) / 2;
+        if(t->when[mid] < target)
+            low = mid + 1;
+        else if(t->when[mid] > target)
+            high = mid - 1;
+        else
+            return mid;
+    }
+
+    /* low has passed high, so check which is closer to desired time. either
+     * one may have run off an end of the track. */
+    return nearest_location(t, high, low < t->count ? low : -1, ts, epsilon);
+}
+
+/*
+ * of the last fix before ts and the first one after it (either may be
+ * -1), pick the closer, preferring the earlier on a tie. returns -1 if
+ * neither is within epsilon seconds.
+ */
+int nearest_location(const track_t* t, int before, int after, time_t ts, int epsilon)
+{
+    int64 target = (int64)ts * 1000;
+    int64 limit = (int64)epsilon * 1000;
+    int64 d_before = before >= 0 ? llabs(target - t->when[before]) : -1;
+    int64 d_after = after >= 0 ? llabs(t->when[after] - target) : -1;
+
+    if(before >= 0 && (after < 0 || d_before <= d_after) && d_before <= limit)
+        return before;
+    else if(after >= 0 && (before < 0 || d_after < d_before) && d_after <= limit)
+        return after;
+
+    /* no fix found within required time limit */
+    return -1;
+}
+
+/* a timestamp to match, remembering where it came from */
+typedef struct
+{
+    int64 when;
+    int index;
+} match_key_t;
+
+static int compare_keys(const void* a, const void* b)
+{
+    const match_key_t* ka = (const match_key_t*)a;
+    const match_key_t* kb = (const match_key_t*)b;
+    if(ka->when != kb->when)
+        return (ka->when < kb->when) ? -1 : 1;
+    return ka->index - kb->index;
+}
+
+/*
+ * match a whole batch of timestamps against the track at once. the
+ * timestamps are sorted and the timestamp column is walked once from
+ * start to end alongside them, so each fix is looked at about once
+ * however many images there are. matches[i] is set to the index
+ * find_location_at would return for ts[i], or -1.
+ */
+void find_locations(const track_t* t, const time_t* ts, unsigned int n, int epsilon,
+                    int* matches)
+{
+    match_key_t* keys = (match_key_t*)malloc((n ? n : 1) * sizeof(match_key_t));
+    const int64* when = t->when;
+    int nrows = t->count;
+    unsigned int i;
+    int j = 0;
+
+    for(i=0; i<n; ++i)
+    {
+        keys[i].when = (int64)ts[i] * 1000;
+        keys[i].index = i;
+    }
+    qsort(keys, n, sizeof(match_key_t), compare_keys);
+
+    for(i=0; i<n; ++i)
+    {
+        /* advance to the first fix at or after this timestamp */
+        while(j < nrows && when[j] < keys[i].when)
+            ++j;
+        if(j < nrows && when[j] == keys[i].when)
+            matches[keys[i].index] = j;
+        else
+            matches[keys[i].index] = nearest_location(t, j-1, j < nrows ? j : -1,
+                                                      ts[keys[i].index], epsilon);
+    }
+    free(keys);
+}
+
+/*
+ * copy fix si of src over fix di of dst, which must already be allocated
+ */
+static void copy_fix(track_t* dst, int di, const track_t* src, int si)
+{
+    track_column_t dst_cols[TRACK_NUM_COLUMNS];
+    track_column_t src_cols[TRACK_NUM_COLUMNS];
+    int i;
+
+    track_columns(dst, dst_cols);
+    track_columns((track_t*)src, src_cols);
+    for(i=0; i<TRACK_NUM_COLUMNS; ++i)
+        memcpy((char*)*dst_cols[i].data + di * dst_cols[i].size,
+               (const char*)*src_cols[i].data + si * src_cols[i].size, src_cols[i].size);
+}
+
+/*
+ * nonzero if fix i of a is a better reading than fix j of b: an active
+ * fix beats a void one, then the higher fix quality wins, then the one
+ * with more satellites, then the one with an altitude
+ */
+static int better_fix(const track_t* a, int i, const track_t* b, int j)
+{
+    int active_a = (a->flags[i] & TRACK_ACTIVE) != 0;
+    int active_b = (b->flags[j] & TRACK_ACTIVE) != 0;
+
+    if(active_a != active_b)
+        return active_a;
+    if(a->quality[i] != b->quality[j])
+        return a->quality[i] > b->quality[j];
+    if(a->num_sat[i] != b->num_sat[j])
+        return a->num_sat[i] > b->num_sat[j];
+    return (a->flags[i] & TRACK_ALTITUDE) && !(b->flags[j] & TRACK_ALTITUDE);
+}
+
+/*
+ * stable lsd radix sort of the fixes by time, a byte of the key at a
+ * time. bytes that are the same in every key (most of the high ones, for
+ * a log covering a few days) are skipped, so a typical log takes three
+ * or four passes. the columns are then gathered into the new order.
+ */
+static void sort_by_time(track_t* t)
+{
+    track_column_t cols[TRACK_NUM_COLUMNS];
+    unsigned int64* keys = (unsigned int64*)malloc(t->count * sizeof(unsigned int64));
+    unsigned int64* keys2 = (unsigned int64*)malloc(t->count * sizeof(unsigned int64));
+    int* order = (int*)malloc(t->count * sizeof(int));
+    int* order2 = (int*)malloc(t->count * sizeof(int));
+    unsigned int64 differ = 0;
+    unsigned int64* kt;
+    int* ot;
+    int counts[256];
+    int shift;
+    int sum;
+    int b;
+    int i;
+    int c;
+    char* col;
+
+    /* flipping the sign bit makes the signed times sort as unsigned */
+    for(i=0; i<t->count; ++i)
+    {
+        keys[i] = (unsigned int64)t->when[i] ^ 0x8000000000000000ULL;
+        order[i] = i;
+        differ |= keys[i] ^ keys[0];
+    }
+
+    for(shift=0; shift<64; shift+=8)
+    {
+        if(((differ >> shift) & 0xff) == 0)
+            continue;
+        memset(counts, 0, sizeof(counts));
+        for(i=0; i<t->count; ++i)
+            counts[(keys[i] >> shift) & 0xff]++;
+        for(b=0, sum=0; b<256; ++b)
+        {
+            int n = counts[b];
+            counts[b] = sum;
+            sum += n;
+        }
+        for(i=0; i<t->count; ++i)
+        {
+            int dst = counts[(keys[i] >> shift) & 0xff]++;
+            keys2[dst] = keys[i];
+            order2[dst] = order[i];
+        }
+        kt = keys; keys = keys2; keys2 = kt;
+        ot = order; order = order2; order2 = ot;
+    }
+
+    track_columns(t, cols);
+    for(c=0; c<TRACK_NUM_COLUMNS; ++c)
+    {
+        col = (char*)malloc(t->capacity * cols[c].size);
+        for(i=0; i<t->count; ++i)
+            memcpy(col + i * cols[c].size, (char*)*cols[c].data + order[i] * cols[c].size,
+                   cols[c].size);
+        free(*cols[c].data);
+        *cols[c].data = col;
+    }
+    free(order2);
+    free(order);
+    free(keys2);
+    free(keys);
+}
+
+/*
+ * make a track strictly time ordered, as the searches need. one pass
+ * checks the order, and in the usual case that's all there is to it.
+ * receiver resets, gps week rollovers and concatenated logs all leave
+ * fixes out of order, and those tracks are radix sorted; fixes stamped
+ * with the same millisecond are then collapsed into the best of them.
+ * the track must be one set up by track_init. returns nonzero if the
+ * fixes weren't already in order.
+ */
+int track_sort(track_t* t)
+{
+    int unsorted = 0;
+    int dups = 0;
+    int i;
+    int j;
+
+    for(i=1; i<t->count; ++i)
+    {
+        if(t->when[i] < t->when[i-1])
+        {
+            unsorted = 1;
+            break;
+        }
+        if(t->when[i] == t->when[i-1])
+            dups = 1;
+    }
+    if(!unsorted && !dups)
+        return 0;
+
+    if(unsorted)
+        sort_by_time(t);
+    for(i=1, j=0; i<t->count; ++i)
+    {
+        if(t->when[i] == t->when[j])
+        {
+            if(better_fix(t, i, t, j))
+                copy_fix(t, j, t, i);
+        }
+        else if(++j != i)
+            copy_fix(t, j, t, i);
+    }
+    if(t->count > 0)
+        t->count = j + 1;
+    return unsorted;
+}
+
+/* heap order on the next unread fix of each input; ties go to the earlier input */
+static int merge_before(const track_t* in, const int* pos, int a, int b)
+{
+    int64 wa = in[a].when[pos[a]];
+    int64 wb = in[b].when[pos[b]];
+    return (wa != wb) ? (wa < wb) : (a < b);
+}
+
+static void merge_sift_down(const track_t* in, const int* pos, int* heap, int n, int i)
+{
+    int child;
+    int tmp;
+
+    while((child = 2 * i + 1) < n)
+    {
+        if(child + 1 < n && merge_before(in, pos, heap[child + 1], heap[child]))
+            child++;
+        if(!merge_before(in, pos, heap[child], heap[i]))
+            break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+/*
+ * merge k time-sorted tracks into out, which is emptied first and must
+ * be one set up by track_init. a heap
+ * holds the next unread fix of each input, so each fix costs O(log k)
+ * and every input is read once from front to back. fixes stamped with
+ * the same millisecond, from whichever logs, collapse into the best of
+ * them.
+ */
+void track_merge(track_t* out, const track_t* in, int k)
+{
+    int* heap = (int*)malloc((k ? k : 1) * sizeof(int));
+    int* pos = (int*)calloc(k ? k : 1, sizeof(int));
+    int total = 0;
+    int n = 0;
+    int i;
+    int top;
+
+    for(i=0; i<k; ++i)
+    {
+        total += in[i].count;
+        if(in[i].count > 0)
+            heap[n++] = i;
+    }
+    out->count = 0;
+    track_reserve(out, total);
+    for(i=n/2-1; i>=0; --i)
+        merge_sift_down(in, pos, heap, n, i);
+
+    while(n > 0)
+    {
+        top = heap[0];
+        if(out->count > 0 && out->when[out->count - 1] == in[top].when[pos[top]])
+        {
+            if(better_fix(&in[top], pos[top], out, out->count - 1))
+                copy_fix(out, out->count - 1, &in[top], pos[top]);
+        }
+        else
+            copy_fix(out, out->count++, &in[top], pos[top]);
+
+        /* move that input along, or drop it once it runs out */
+        if(++pos[top] >= in[top].count)
+            heap[0] = heap[--n];
+        merge_sift_down(in, pos, heap, n, 0);
+    }
+    free(pos);
+    free(heap);
+}
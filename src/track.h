@@ -0,0 +1,97 @@
+/*
+ * track.h
+ * compact column store for the fixes read from a gps log
+ */
+
+#ifndef _TRACK_H_
+#define _TRACK_H_
+
+#include <stddef.h>
+#include <time.h>
+#include "types.h"
+
+/*
+ * one fix, unpacked. this is what the parsers build and the tiff writer
+ * reads; the track itself keeps fixes in the packed columns below.
+ */
+typedef struct
+{
+    time_t when;
+    int msec; /* milliseconds past when */
+    char status; /* A (active), V (void) */
+    double latitude;
+    char lat_ref;
+    double longitude;
+    char lon_ref;
+    double speed; /* in knots */
+    double heading; /* in degrees */
+    double altitude; /* in meters */
+    double geoid_ht; /* in meters */
+    int have_altitude; /* altitude is good enough to write out */
+    int num_sat;
+    int quality;
+} location_t;
+
+/* latitude and longitude are fixed point in 1e-5 arc minutes */
+#define TRACK_ANGLE_SCALE 100000
+
+/* bits of the flags column */
+#define TRACK_NORTH  0x01
+#define TRACK_SOUTH  0x02
+#define TRACK_EAST   0x04
+#define TRACK_WEST   0x08
+#define TRACK_ACTIVE 0x10
+#define TRACK_VOID   0x20
+#define TRACK_ALTITUDE 0x40
+
+/*
+ * a track is a set of parallel arrays, one per field. searching only
+ * touches the timestamp column, and nothing is wider than it needs to
+ * be, so a fix takes 29 bytes rather than the 88 of a location_t.
+ */
+typedef struct
+{
+    int64* when;               /* milliseconds since the epoch */
+    int32* latitude;           /* 1e-5 arc minutes, south negative */
+    int32* longitude;          /* 1e-5 arc minutes, west negative */
+    int32* altitude;           /* centimeters */
+    unsigned byte* flags;      /* hemispheres and status */
+
+    /* side columns, only read when a fix is written out */
+    unsigned int16* speed;     /* hundredths of a knot */
+    unsigned int16* heading;   /* hundredths of a degree */
+    int16* geoid_ht;           /* centimeters */
+    unsigned byte* num_sat;
+    unsigned byte* quality;
+
+    int count;
+    int capacity;
+    void* map;                 /* set when the columns point into a mapped index */
+    size_t map_size;
+} track_t;
+
+/* one column: where its pointer lives and how wide its elements are */
+typedef struct
+{
+    void** data;
+    size_t size;
+} track_column_t;
+
+#define TRACK_NUM_COLUMNS 10
+
+void track_init(track_t* t, int capacity);
+void track_free(track_t* t);
+void track_columns(track_t* t, track_column_t* cols);
+void track_reserve(track_t* t, int capacity);
+void track_append(track_t* t, const location_t* loc);
+void track_append_track(track_t* t, const track_t* src);
+void track_get(const track_t* t, int i, location_t* loc);
+void track_set(track_t* t, int i, const location_t* loc);
+int track_sort(track_t* t);
+void track_merge(track_t* out, const track_t* in, int k);
+int find_location_at(const track_t* t, time_t ts, int epsilon);
+int nearest_location(const track_t* t, int before, int after, time_t ts, int epsilon);
+void find_locations(const track_t* t, const time_t* ts, unsigned int n, int epsilon,
+                    int* matches);
+
+#endif
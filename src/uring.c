@@ -0,0 +1,277 @@
+/*
+ * uring.c
+ * minimal io_uring ring for batching the opens, reads, writes and closes
+ * of many files into a few system calls
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+
+#ifdef NEFTAG_HAVE_URING
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static int sys_setup(unsigned int entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int op, void* arg, unsigned int nargs)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+/* the operations the ring is used for, all of which came in with 5.6 */
+static const int uring_ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+
+/*
+ * nonzero if the kernel behind the ring supports every operation we
+ * queue. a kernel too old to answer the probe is too old for them too.
+ */
+static int probe_ops(int fd)
+{
+    struct
+    {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[256];
+    } p;
+    unsigned int i;
+
+    memset(&p, 0, sizeof(p));
+    if(sys_register(fd, IORING_REGISTER_PROBE, &p.probe, 256) < 0)
+        return 0;
+    for(i=0; i<sizeof(uring_ops)/sizeof(uring_ops[0]); ++i)
+    {
+        if(uring_ops[i] > p.probe.last_op || uring_ops[i] >= p.probe.ops_len ||
+           !(p.probe.ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * set up a ring with room for the given number of operations in flight.
+ * returns 0, quietly, if the kernel doesn't offer io_uring, won't let us
+ * have one, or doesn't support the operations we need on it, so the
+ * caller can fall back to blocking calls.
+ */
+int uring_init(uring_t* r, unsigned int entries)
+{
+    struct io_uring_params p;
+    unsigned char* sq;
+    unsigned char* cq;
+
+    memset(r, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_setup(entries, &p);
+    if(r->fd < 0)
+        return 0;
+    if(!probe_ops(r->fd))
+        goto fail;
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_map_size > r->sq_map_size)
+        r->sq_map_size = r->cq_map_size;
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_map == MAP_FAILED)
+        goto fail;
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_map = r->sq_map;
+    else
+    {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_map == MAP_FAILED)
+            goto fail;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = (unsigned char*)r->sq_map;
+    cq = (unsigned char*)r->cq_map;
+    r->sq_head = (unsigned int*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+    r->cqes = cq + p.cq_off.cqes;
+    r->entries = p.sq_entries;
+    return 1;
+
+fail:
+    uring_free(r);
+    return 0;
+}
+
+void uring_free(uring_t* r)
+{
+    if(r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_size);
+    if(r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if(r->sq_map && r->sq_map != MAP_FAILED)
+        munmap(r->sq_map, r->sq_map_size);
+    if(r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(uring_t));
+    r->fd = -1;
+}
+
+/*
+ * claim the next free submission entry, cleared and tagged with the slot
+ * its result belongs in. NULL if the ring is already full.
+ */
+static struct io_uring_sqe* next_sqe(uring_t* r, int op, int fd, int slot)
+{
+    unsigned int tail = *r->sq_tail + r->queued;
+    struct io_uring_sqe* sqe;
+
+    if(r->queued >= r->entries)
+        return NULL;
+    sqe = &((struct io_uring_sqe*)r->sqes)[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned int64)slot;
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    r->queued++;
+    return sqe;
+}
+
+int uring_prep_open(uring_t* r, const char* path, int flags, int slot)
+{
+    struct io_uring_sqe* sqe = next_sqe(r, IORING_OP_OPENAT, AT_FDCWD, slot);
+    if(!sqe)
+        return 0;
+    sqe->addr = (unsigned long)path;
+    sqe->open_flags = flags;
+    return 1;
+}
+
+int uring_prep_read(uring_t* r, int fd, void* buf, unsigned int len, unsigned int64 offset, int slot)
+{
+    struct io_uring_sqe* sqe = next_sqe(r, IORING_OP_READ, fd, slot);
+    if(!sqe)
+        return 0;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    return 1;
+}
+
+int uring_prep_write(uring_t* r, int fd, const void* buf, unsigned int len, unsigned int64 offset, int slot)
+{
+    struct io_uring_sqe* sqe = next_sqe(r, IORING_OP_WRITE, fd, slot);
+    if(!sqe)
+        return 0;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    return 1;
+}
+
+int uring_prep_close(uring_t* r, int fd, int slot)
+{
+    return next_sqe(r, IORING_OP_CLOSE, fd, slot) != NULL;
+}
+
+/*
+ * submit everything queued and wait for all of it to finish. each
+ * operation's result (a descriptor, a byte count or -errno) is stored at
+ * results[slot]. returns the number of operations completed, or -1 if
+ * the ring itself failed.
+ */
+int uring_run(uring_t* r, int* results)
+{
+    unsigned int want = r->queued;
+    unsigned int done = 0;
+    unsigned int head;
+    struct io_uring_cqe* cqe;
+    int n;
+
+    /* publish the new tail only once the entries behind it are written */
+    __atomic_store_n(r->sq_tail, *r->sq_tail + r->queued, __ATOMIC_RELEASE);
+    r->queued = 0;
+
+    while(done < want)
+    {
+        n = sys_enter(r->fd, want - done, want - done, IORING_ENTER_GETEVENTS);
+        if(n < 0 && errno != EINTR)
+        {
+            perror("io_uring_enter");
+            return -1;
+        }
+
+        head = *r->cq_head;
+        while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &((struct io_uring_cqe*)r->cqes)[head & *r->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return (int)done;
+}
+
+#else
+
+/* built without io_uring: there is never a ring, and nothing to queue on one */
+int uring_init(uring_t* r, unsigned int entries)
+{
+    memset(r, 0, sizeof(uring_t));
+    r->fd = -1;
+    return 0;
+}
+
+void uring_free(uring_t* r)
+{
+}
+
+int uring_prep_open(uring_t* r, const char* path, int flags, int slot)
+{
+    return 0;
+}
+
+int uring_prep_read(uring_t* r, int fd, void* buf, unsigned int len, unsigned int64 offset, int slot)
+{
+    return 0;
+}
+
+int uring_prep_write(uring_t* r, int fd, const void* buf, unsigned int len, unsigned int64 offset, int slot)
+{
+    return 0;
+}
+
+int uring_prep_close(uring_t* r, int fd, int slot)
+{
+    return 0;
+}
+
+int uring_run(uring_t* r, int* results)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * uring.h
+ * minimal io_uring ring for batching the opens, reads, writes and closes
+ * of many files into a few system calls
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include "types.h"
+
+/*
+ * the ring is talked to with raw system calls, so only the kernel header
+ * is needed. build with -DNEFTAG_NO_URING (make NO_URING=1) to leave it
+ * out; uring_init then always fails and callers use blocking i/o.
+ */
+#if !defined(NEFTAG_NO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NEFTAG_HAVE_URING 1
+#endif
+#endif
+
+/*
+ * a submission and completion ring pair. operations are queued with the
+ * uring_prep_* calls, each tagged with a slot number, and uring_run
+ * submits them all and waits until every one has completed.
+ */
+typedef struct
+{
+    int fd;
+    unsigned int entries;
+    unsigned int queued;       /* sqes filled in but not yet submitted */
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    void* sqes;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    void* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;              /* same as sq_map if the kernel shares them */
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring_t;
+
+int uring_init(uring_t* r, unsigned int entries);
+void uring_free(uring_t* r);
+int uring_prep_open(uring_t* r, const char* path, int flags, int slot);
+int uring_prep_read(uring_t* r, int fd, void* buf, unsigned int len, unsigned int64 offset, int slot);
+int uring_prep_write(uring_t* r, int fd, const void* buf, unsigned int len, unsigned int64 offset, int slot);
+int uring_prep_close(uring_t* r, int fd, int slot);
+int uring_run(uring_t* r, int* results);
+
+#endif
@@ -5,152 +5,153 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include "util.h"
-#include "tiff.h"
 #include "types.h"
 
-unsigned byte read_byte(FILE* f)
-{
-    unsigned byte b;
-    fread(&b, sizeof(byte), 1, f);
-    return b;
-}
-
-void write_byte(FILE* f, unsigned byte b)
-{
-    fwrite(&b, sizeof(byte), 1, f);
-}
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-byte read_sbyte(FILE* f)
-{
-    byte b;
-    fread(&b, sizeof(byte), 1, f);
-    return b;
-}
-
-void write_sbyte(FILE* f, byte b)
+/*
+ * set up a cursor over size bytes starting at base, positioned at pos
+ */
+void cursor_init(cursor_t* c, const unsigned byte* base, unsigned int32 size, unsigned int32 pos,
+                 int swap)
 {
-    fwrite(&b, sizeof(byte), 1, f);
+    c->base = base;
+    c->size = size;
+    c->pos = pos;
+    c->swap = swap;
+    c->error = 0;
 }
 
-int16 read_int16(FILE* f)
+void cursor_seek(cursor_t* c, unsigned int32 pos)
 {
-    int16 tmp;
-    fread(&tmp, sizeof(int16), 1, f);
-    if(byte_order == TIFF_BIG_ENDIAN)
-    {
-        swap_endian2((unsigned int16*)&tmp);
-    }
-    return tmp;
+    c->pos = pos;
 }
 
-void write_int16(FILE* f, int16 k)
+/*
+ * copy n raw bytes out of the block and advance, or flag an error if
+ * the read would run off the end
+ */
+int cursor_read_bytes(cursor_t* c, void* dst, unsigned int32 n)
 {
-    if(byte_order == TIFF_BIG_ENDIAN)
+    if(c->pos > c->size || c->size - c->pos < n)
     {
-        swap_endian2((unsigned int16*)&k);
+        c->error = 1;
+        memset(dst, 0, n);
+        return 0;
     }
-    fwrite(&k, sizeof(int16), 1, f);
+    memcpy(dst, c->base + c->pos, n);
+    c->pos += n;
+    return 1;
 }
 
-unsigned int16 read_uint16(FILE* f)
+unsigned byte cursor_read_byte(cursor_t* c)
 {
-    unsigned int16 tmp;
-    fread(&tmp, sizeof(int16), 1, f);
-    if(byte_order == TIFF_BIG_ENDIAN)
-    {
-        swap_endian2(&tmp);
-    }
-    return tmp;
+    unsigned byte b;
+    cursor_read_bytes(c, &b, sizeof(byte));
+    return b;
 }
 
-void write_uint16(FILE* f, unsigned int16 k)
+byte cursor_read_sbyte(cursor_t* c)
 {
-    if(byte_order == TIFF_BIG_ENDIAN)
-    {
-        swap_endian2(&k);
-    }
-    fwrite(&k, sizeof(unsigned int16), 1, f);
+    byte b;
+    cursor_read_bytes(c, &b, sizeof(byte));
+    return b;
 }
 
-unsigned int32 read_uint32(FILE* f)
+int16 cursor_read_int16(cursor_t* c)
 {
-    unsigned int32 tmp;
-    fread(&tmp, sizeof(int32), 1, f);
-    if(byte_order == TIFF_BIG_ENDIAN)
+    int16 tmp;
+    cursor_read_bytes(c, &tmp, sizeof(int16));
+    if(c->swap)
     {
-        swap_endian4(&tmp);
+        swap_endian2((unsigned int16*)&tmp);
     }
     return tmp;
 }
 
-void write_uint32(FILE* f, unsigned int32 n)
+unsigned int16 cursor_read_uint16(cursor_t* c)
 {
-    if(byte_order == TIFF_BIG_ENDIAN)
+    unsigned int16 tmp;
+    cursor_read_bytes(c, &tmp, sizeof(int16));
+    if(c->swap)
     {
-        swap_endian4(&n);
+        swap_endian2(&tmp);
     }
-    fwrite(&n, sizeof(unsigned int32), 1, f);
+    return tmp;
 }
 
-int32 read_int32(FILE* f)
+int32 cursor_read_int32(cursor_t* c)
 {
     int32 tmp;
-    fread(&tmp, sizeof(int32), 1, f);
-    if(byte_order == TIFF_BIG_ENDIAN)
+    cursor_read_bytes(c, &tmp, sizeof(int32));
+    if(c->swap)
     {
         swap_endian4((unsigned int32*)&tmp);
     }
     return tmp;
 }
 
-void write_int32(FILE* f, int32 n)
+unsigned int32 cursor_read_uint32(cursor_t* c)
 {
-    if(byte_order == TIFF_BIG_ENDIAN)
+    unsigned int32 tmp;
+    cursor_read_bytes(c, &tmp, sizeof(int32));
+    if(c->swap)
     {
-        swap_endian4((unsigned int32*)&n);
+        swap_endian4(&tmp);
     }
-    fwrite(&n, sizeof(int32), 1, f);
+    return tmp;
 }
 
-float32 read_float32(FILE* f)
+float32 cursor_read_float32(cursor_t* c)
 {
     float32 tmp;
-    fread(&tmp, 1, sizeof(float32), f);
-    if(byte_order == TIFF_BIG_ENDIAN)
+    cursor_read_bytes(c, &tmp, sizeof(float32));
+    if(c->swap)
     {
         swap_endian4((unsigned int32*)&tmp);
     }
     return tmp;
 }
 
-void write_float32(FILE* f, float32 x)
+float64 cursor_read_float64(cursor_t* c)
 {
-    if(byte_order == TIFF_BIG_ENDIAN)
+    float64 tmp;
+    cursor_read_bytes(c, &tmp, sizeof(float64));
+    if(c->swap)
     {
-        swap_endian4((unsigned int32*)&x);
+        swap_endian8((unsigned int64*)&tmp);
     }
-    fwrite(&x, sizeof(float32), 1, f);
+    return tmp;
 }
 
-float64 read_float64(FILE* f)
+/*
+ * store a 16 or 32 bit value into a byte buffer in the file's byte order
+ */
+void put_uint16(unsigned byte* p, unsigned int16 k, int swap)
 {
-    float64 tmp;
-    fread(&tmp, 1, sizeof(float64), f);
-    if(byte_order == TIFF_BIG_ENDIAN)
+    if(swap)
     {
-        swap_endian8((unsigned int64*)&tmp);
+        swap_endian2(&k);
     }
-    return tmp;
+    memcpy(p, &k, sizeof(unsigned int16));
 }
 
-void write_float64(FILE* f, float64 x)
+void put_uint32(unsigned byte* p, unsigned int32 n, int swap)
 {
-    if(byte_order == TIFF_BIG_ENDIAN)
+    if(swap)
     {
-        swap_endian8((unsigned int64*)&x);
+        swap_endian4(&n);
     }
-    fwrite(&x, sizeof(float64), 1, f);
+    memcpy(p, &n, sizeof(unsigned int32));
 }
 
 void swap_endian2(unsigned int16* x)
@@ -177,3 +178,145 @@ void swap_endian8(unsigned int64* x)
         ((*x>>40) & 0x000000000000FF00LL) |
         (*x<<56);
 }
+
+/*
+ * bulk byte swapping for whole value arrays (StripOffsets, StripByteCounts,
+ * CFA tables and so on). each swaps 16 bytes at a time with vector shuffles
+ * where the target has them, and finishes off the tail one value at a time.
+ */
+void swap_endian2_array(unsigned int16* x, unsigned int n)
+{
+    unsigned int i = 0;
+#if defined(__SSSE3__)
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for(; i+8<=n; i+=8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(x+i));
+        _mm_storeu_si128((__m128i*)(x+i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSE2__)
+    for(; i+8<=n; i+=8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(x+i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(x+i), v);
+    }
+#elif defined(__ARM_NEON)
+    for(; i+8<=n; i+=8)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(x+i));
+        vst1q_u8((uint8_t*)(x+i), vrev16q_u8(v));
+    }
+#endif
+    for(; i<n; ++i)
+    {
+        swap_endian2(&x[i]);
+    }
+}
+
+void swap_endian4_array(unsigned int32* x, unsigned int n)
+{
+    unsigned int i = 0;
+#if defined(__SSSE3__)
+    const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for(; i+4<=n; i+=4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(x+i));
+        _mm_storeu_si128((__m128i*)(x+i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSE2__)
+    for(; i+4<=n; i+=4)
+    {
+        /* swap the 16 bit halves of each word, then the bytes in each half */
+        __m128i v = _mm_loadu_si128((const __m128i*)(x+i));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(x+i), v);
+    }
+#elif defined(__ARM_NEON)
+    for(; i+4<=n; i+=4)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(x+i));
+        vst1q_u8((uint8_t*)(x+i), vrev32q_u8(v));
+    }
+#endif
+    for(; i<n; ++i)
+    {
+        swap_endian4(&x[i]);
+    }
+}
+
+void swap_endian8_array(unsigned int64* x, unsigned int n)
+{
+    unsigned int i = 0;
+#if defined(__SSSE3__)
+    const __m128i mask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    for(; i+2<=n; i+=2)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(x+i));
+        _mm_storeu_si128((__m128i*)(x+i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSE2__)
+    for(; i+2<=n; i+=2)
+    {
+        /* reverse the 16 bit words of each quad, then the bytes in each word */
+        __m128i v = _mm_loadu_si128((const __m128i*)(x+i));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(x+i), v);
+    }
+#elif defined(__ARM_NEON)
+    for(; i+2<=n; i+=2)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(x+i));
+        vst1q_u8((uint8_t*)(x+i), vrev64q_u8(v));
+    }
+#endif
+    for(; i<n; ++i)
+    {
+        swap_endian8(&x[i]);
+    }
+}
+
+/*
+ * signed decimal number at the start of p, ending at the first character
+ * that can't be part of it. digits are accumulated as an exact integer
+ * and divided by an exact power of ten, which rounds the same way atof
+ * does for the 15 or so significant digits gps logs use, at a fraction
+ * of the cost.
+ */
+double parse_decimal(const char* p)
+{
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+                                   1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+    int neg = 0;
+    int frac = 0;
+    int digits = 0;
+    unsigned int64 mant = 0;
+
+    if(*p == '-' || *p == '+')
+        neg = (*p++ == '-');
+    for(; *p >= '0' && *p <= '9'; ++p)
+    {
+        if(digits++ < 18)
+            mant = mant*10 + (*p - '0');
+        else
+            --frac; /* too many digits to hold exactly; scale up instead */
+    }
+    if(*p == '.')
+    {
+        for(++p; *p >= '0' && *p <= '9'; ++p)
+        {
+            if(digits++ < 18)
+            {
+                mant = mant*10 + (*p - '0');
+                ++frac;
+            }
+        }
+    }
+    if(frac > 0 && frac < 16)
+        return neg ? -(mant / pow10[frac]) : mant / pow10[frac];
+    return (neg ? -1.0 : 1.0) * (double)mant * pow(10, -frac);
+}
@@ -9,32 +9,44 @@
 #include <stdio.h>
 #include "types.h"
 
-unsigned byte read_byte(FILE* f);
-void write_byte(FILE* f, unsigned byte b);
-
-byte read_sbyte(FILE* f);
-void write_sbyte(FILE* f, byte b);
-
-int16 read_int16(FILE* f);
-void write_int16(FILE* f, int16 k);
-
-unsigned int16 read_uint16(FILE* f);
-void write_uint16(FILE* f, unsigned int16 k);
-
-int32 read_int32(FILE* f);
-void write_int32(FILE* f, int32 n);
-
-unsigned int32 read_uint32(FILE* f);
-void write_uint32(FILE* f, unsigned int32 n);
-
-float32 read_float32(FILE* f);
-void write_float32(FILE* f, float32 x);
-
-float64 read_float64(FILE* f);
-void write_float64(FILE* f, float64 x);
+/*
+ * a bounds-checked read cursor over a block of memory (normally a mapped
+ * tiff file). reads past the end of the block return zero and set the
+ * sticky error flag rather than touching memory outside the block.
+ */
+typedef struct
+{
+    const unsigned byte* base;
+    unsigned int32 size;
+    unsigned int32 pos;
+    int swap;  /* nonzero if the block is in the opposite byte order to the host */
+    int error;
+} cursor_t;
+
+void cursor_init(cursor_t* c, const unsigned byte* base, unsigned int32 size, unsigned int32 pos,
+                 int swap);
+void cursor_seek(cursor_t* c, unsigned int32 pos);
+int cursor_read_bytes(cursor_t* c, void* dst, unsigned int32 n);
+unsigned byte cursor_read_byte(cursor_t* c);
+byte cursor_read_sbyte(cursor_t* c);
+int16 cursor_read_int16(cursor_t* c);
+unsigned int16 cursor_read_uint16(cursor_t* c);
+int32 cursor_read_int32(cursor_t* c);
+unsigned int32 cursor_read_uint32(cursor_t* c);
+float32 cursor_read_float32(cursor_t* c);
+float64 cursor_read_float64(cursor_t* c);
+
+void put_uint16(unsigned byte* p, unsigned int16 k, int swap);
+void put_uint32(unsigned byte* p, unsigned int32 n, int swap);
 
 void swap_endian2(unsigned int16* x);
 void swap_endian4(unsigned int32* x);
 void swap_endian8(unsigned int64* x);
 
+void swap_endian2_array(unsigned int16* x, unsigned int n);
+void swap_endian4_array(unsigned int32* x, unsigned int n);
+void swap_endian8_array(unsigned int64* x, unsigned int n);
+
+double parse_decimal(const char* p);
+
 #endif
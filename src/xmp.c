@@ -0,0 +1,406 @@
+/*
+ * xmp.c
+ * write gps locations to xmp sidecars instead of into the raw files
+ */
+
+#define _GNU_SOURCE /* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "xmp.h"
+#include "tag.h"
+
+/* what goes around the gps block in a sidecar neftag creates */
+static const char xmp_head[] =
+    "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n"
+    " <rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">\n"
+    "  ";
+static const char xmp_tail[] =
+    "\n"
+    " </rdf:RDF>\n"
+    "</x:xmpmeta>\n";
+
+void xmp_writer_init(xmp_writer_t* w, stats_t* stats)
+{
+    memset(w, 0, sizeof(xmp_writer_t));
+    w->stats = stats;
+}
+
+void xmp_writer_free(xmp_writer_t* w)
+{
+    free(w->buf);
+    w->buf = NULL;
+    w->len = w->capacity = 0;
+    w->count = 0;
+}
+
+/* copy len bytes onto the end of the writer's buffer; returns where they went */
+static size_t put(xmp_writer_t* w, const void* data, size_t len)
+{
+    size_t at = w->len;
+
+    if(w->len + len > w->capacity)
+    {
+        w->capacity = w->capacity ? w->capacity * 2 : 65536;
+        if(w->capacity < w->len + len)
+            w->capacity = w->len + len;
+        w->buf = (char*)realloc(w->buf, w->capacity);
+    }
+    memcpy(w->buf + at, data, len);
+    w->len += len;
+    return at;
+}
+
+static int write_all(int fd, const char* p, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = pwrite(fd, p, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/*
+ * the sidecar of a raw file is the same path with the extension swapped
+ * for .xmp, the way most raw converters look for it. returns 0 if it
+ * won't fit in n bytes.
+ */
+int xmp_sidecar_path(const char* raw_path, char* buf, size_t n)
+{
+    const char* slash = strrchr(raw_path, '/');
+    const char* dot = strrchr(raw_path, '.');
+    size_t stem;
+
+    if(!dot || (slash && dot < slash))
+        stem = strlen(raw_path);
+    else
+        stem = dot - raw_path;
+    if(stem + strlen(XMP_SUFFIX) + 1 > n)
+        return 0;
+    memcpy(buf, raw_path, stem);
+    strcpy(buf + stem, XMP_SUFFIX);
+    return 1;
+}
+
+/*
+ * a coordinate as xmp writes them: whole degrees, then decimal minutes to
+ * the precision the track keeps them, and the ref. the fix holds it the
+ * nmea way, 12 degrees 34.5678 minutes as 1234.5678.
+ */
+static void xmp_coordinate(double nmea, char ref, char* buf, size_t n)
+{
+    int deg = (int)floor(nmea / 100);
+    long long min = llround((nmea - deg * 100) * TRACK_ANGLE_SCALE);
+
+    if(min >= 60LL * TRACK_ANGLE_SCALE)
+    {
+        deg++;
+        min -= 60LL * TRACK_ANGLE_SCALE;
+    }
+    snprintf(buf, n, "%d,%lld.%05lld%c", deg, min / TRACK_ANGLE_SCALE, min % TRACK_ANGLE_SCALE, ref);
+}
+
+/*
+ * lay out the location as an rdf:Description holding the exif:GPS*
+ * properties, the same ones gps_ifd_encode writes into a raw file.
+ * every number is written to a fixed precision, so the block for a new
+ * fix is usually the same size as the one it replaces. returns its
+ * length.
+ */
+unsigned int32 xmp_gps_block(const location_t* loc, char* buf, size_t n)
+{
+    struct tm tm;
+    char lat[32];
+    char lon[32];
+    char when[40];
+    char alt[160] = "";
+    int len;
+
+    xmp_coordinate(loc->latitude, loc->lat_ref, lat, sizeof(lat));
+    xmp_coordinate(loc->longitude, loc->lon_ref, lon, sizeof(lon));
+    if(loc->have_altitude)
+        snprintf(alt, sizeof(alt),
+                 "    exif:GPSAltitudeRef=\"%d\"\n"
+                 "    exif:GPSAltitude=\"%ld/10\"\n"
+                 "    exif:GPSMapDatum=\"WGS-84\"\n",
+                 (loc->altitude < 0) ? 1 : 0, lround(fabs(loc->altitude) * 10));
+
+    /* xmp folds the gps date and time into one timestamp */
+    gmtime_r(&loc->when, &tm);
+    len = snprintf(when, sizeof(when), "%04d-%02d-%02dT%02d:%02d:%02d", tm.tm_year+1900,
+                   tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    if(loc->msec)
+        snprintf(when + len, sizeof(when) - len, ".%03d", loc->msec);
+    strcat(when, "Z");
+
+    len = snprintf(buf, n,
+                   "<rdf:Description rdf:about=\"\"\n"
+                   "    xmlns:exif=\"http://ns.adobe.com/exif/1.0/\"\n"
+                   "    exif:GPSVersionID=\"2.2.0.0\"\n"
+                   "    exif:GPSLatitude=\"%s\"\n"
+                   "    exif:GPSLongitude=\"%s\"\n"
+                   "%s"
+                   "    exif:GPSTimeStamp=\"%s\"/>",
+                   lat, lon, alt, when);
+    return (len < 0 || (size_t)len >= n) ? 0 : len;
+}
+
+/* how every block xmp_gps_block lays out starts */
+static const char xmp_block_head[] =
+    "<rdf:Description rdf:about=\"\"\n"
+    "    xmlns:exif=\"http://ns.adobe.com/exif/1.0/\"";
+
+/*
+ * nonzero if the element from p to close (its '>') is one of ours: the
+ * same opening as xmp_gps_block writes, then nothing but exif:GPS
+ * attributes up to the "/>" that ends it
+ */
+static int is_our_block(const char* p, const char* close)
+{
+    size_t head = strlen(xmp_block_head);
+    const char* q;
+
+    if(close[-1] != '/' || (size_t)(close - p) < head || memcmp(p, xmp_block_head, head) != 0)
+        return 0;
+    for(p += head; ; )
+    {
+        while(p < close && (*p == ' ' || *p == '\n'))
+            ++p;
+        if(p == close - 1)
+            return 1;
+        if(close - p < 8 || memcmp(p, "exif:GPS", 8) != 0 ||
+           (q = (const char*)memchr(p, '=', close - p)) == NULL || q[1] != '"' ||
+           (q = (const char*)memchr(q + 2, '"', close - (q + 2))) == NULL)
+            return 0;
+        p = q + 1;
+    }
+}
+
+/*
+ * find the gps block in a sidecar: an rdf:Description laid out exactly
+ * as xmp_gps_block lays them out. returns 1 with its range, 0 if the
+ * sidecar has no gps properties at all, or -1 if it has them in some
+ * other form (alongside other properties, say), which isn't ours to
+ * rewrite.
+ */
+static int find_gps_block(const char* doc, size_t len, size_t* start, size_t* end)
+{
+    const char* e = doc + len;
+    const char* p = doc;
+    const char* close;
+
+    while((p = (const char*)memmem(p, e - p, "<rdf:Description", 16)) != NULL)
+    {
+        if((close = (const char*)memchr(p, '>', e - p)) == NULL)
+            return -1;
+        if(memmem(p, close - p, "exif:GPS", 8))
+        {
+            if(!is_our_block(p, close))
+                return -1;
+            *start = p - doc;
+            *end = close + 1 - doc;
+            return 1;
+        }
+        p = close;
+    }
+    return memmem(doc, len, "exif:GPS", 8) ? -1 : 0;
+}
+
+/*
+ * read a whole sidecar. returns 1 with *data NULL if there isn't one yet,
+ * or 0 if there is but it can't be read.
+ */
+static int read_sidecar(const char* path, char** data, size_t* len)
+{
+    struct stat st;
+    ssize_t n;
+    size_t got = 0;
+    int fd;
+
+    *data = NULL;
+    *len = 0;
+    if((fd = open(path, O_RDONLY)) < 0)
+        return errno == ENOENT;
+    if(fstat(fd, &st) != 0 || st.st_size > XMP_MAX_SIDECAR)
+    {
+        close(fd);
+        return 0;
+    }
+    *data = (char*)malloc(st.st_size + 1);
+    while(got < (size_t)st.st_size)
+    {
+        n = pread(fd, *data + got, st.st_size - got, got);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    (*data)[got] = '\0';
+    *len = got;
+    return 1;
+}
+
+/*
+ * work out what the sidecar of raw_path needs to hold loc and queue it
+ * up to be written: the gps block alone over an old one the same size,
+ * or else the whole sidecar, created new or with its gps block replaced
+ * or added. nothing is queued if the sidecar already holds this fix.
+ * status is set to TAG_SKIPPED if the write fails later. returns 0,
+ * having said why, if the sidecar can't be updated.
+ */
+int xmp_queue(xmp_writer_t* w, const char* raw_path, const location_t* loc, int* status)
+{
+    char path[PATH_MAX];
+    char block[XMP_BLOCK_MAX];
+    unsigned int32 blen;
+    char* old;
+    size_t olen;
+    size_t start;
+    size_t end;
+    const char* rdf;
+    xmp_pending_t* p;
+    int found = 0;
+
+    if(!xmp_sidecar_path(raw_path, path, sizeof(path)) ||
+       (blen = xmp_gps_block(loc, block, sizeof(block))) == 0)
+    {
+        fprintf(stderr, "no room for the sidecar of '%s'...skipping\n", raw_path);
+        return 0;
+    }
+    if(!read_sidecar(path, &old, &olen))
+    {
+        fprintf(stderr, "could not read sidecar '%s'...skipping\n", path);
+        return 0;
+    }
+    if(old && (found = find_gps_block(old, olen, &start, &end)) < 0)
+    {
+        fprintf(stderr, "sidecar '%s' holds gps properties neftag doesn't write...skipping\n", path);
+        free(old);
+        return 0;
+    }
+    if(old && !found && (rdf = strstr(old, "</rdf:RDF>")) == NULL)
+    {
+        fprintf(stderr, "sidecar '%s' has no rdf:RDF element...skipping\n", path);
+        free(old);
+        return 0;
+    }
+    if(found && end - start == blen && memcmp(old + start, block, blen) == 0)
+    {
+        if(w->stats)
+            w->stats->unchanged++;
+        free(old);
+        return 1;
+    }
+
+    if(w->count == XMP_BATCH)
+        xmp_flush(w);
+    p = &w->pending[w->count++];
+    p->path = put(w, path, strlen(path) + 1);
+    p->status = status;
+    p->how = XMP_CREATE;
+    p->offset = 0;
+    if(!old)
+    {
+        p->data = put(w, xmp_head, strlen(xmp_head));
+        put(w, block, blen);
+        put(w, xmp_tail, strlen(xmp_tail));
+    }
+    else if(found && end - start == blen)
+    {
+        p->how = XMP_IN_PLACE;
+        p->offset = start;
+        p->data = put(w, block, blen);
+    }
+    else if(found)
+    {
+        p->data = put(w, old, start);
+        put(w, block, blen);
+        put(w, old + end, olen - end);
+    }
+    else
+    {
+        /* another tool's sidecar: our block goes in beside its own */
+        p->data = put(w, old, rdf - old);
+        put(w, " ", 1);
+        put(w, block, blen);
+        put(w, "\n ", 2);
+        put(w, rdf, olen - (rdf - old));
+    }
+    p->len = w->len - p->data;
+    free(old);
+    return 1;
+}
+
+/*
+ * write out every queued sidecar. a gps block the same size as the old
+ * one goes straight over it; anything else is written to a temporary
+ * file that's then renamed over the sidecar, so a sidecar is never left
+ * half written. returns 0 if any of them failed.
+ */
+int xmp_flush(xmp_writer_t* w)
+{
+    char tmp[PATH_MAX + 8];
+    const char* path;
+    xmp_pending_t* p;
+    int failed = 0;
+    int ok;
+    int fd;
+    int i;
+
+    for(i=0; i<w->count; ++i)
+    {
+        p = &w->pending[i];
+        path = w->buf + p->path;
+        if(p->how == XMP_IN_PLACE)
+        {
+            ok = (fd = open(path, O_WRONLY)) >= 0 &&
+                 write_all(fd, w->buf + p->data, p->len, p->offset);
+            if(fd >= 0)
+                ok = (close(fd) == 0) && ok;
+        }
+        else
+        {
+            snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+            ok = (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0 &&
+                 write_all(fd, w->buf + p->data, p->len, 0);
+            if(fd >= 0)
+                ok = (close(fd) == 0) && ok;
+            ok = ok && rename(tmp, path) == 0;
+            if(!ok && fd >= 0)
+                unlink(tmp);
+        }
+
+        if(ok)
+        {
+            if(w->stats)
+                w->stats->bytes_written += p->len;
+        }
+        else
+        {
+            fprintf(stderr, "could not write sidecar '%s'\n", path);
+            *p->status = TAG_SKIPPED;
+            failed++;
+        }
+    }
+    w->count = 0;
+    w->len = 0;
+    return failed == 0;
+}
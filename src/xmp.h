@@ -0,0 +1,62 @@
+/*
+ * xmp.h
+ * write gps locations to xmp sidecars instead of into the raw files
+ */
+
+#ifndef _XMP_H_
+#define _XMP_H_
+
+#include "track.h"
+#include "stats.h"
+#include "types.h"
+
+/* a raw file's sidecar has its extension swapped for this */
+#define XMP_SUFFIX ".xmp"
+
+/* sidecars queued up by a writer before they're all written out */
+#define XMP_BATCH 64
+
+/* longest gps block xmp_gps_block lays out */
+#define XMP_BLOCK_MAX 1024
+
+/* biggest existing sidecar that will be updated */
+#define XMP_MAX_SIDECAR (1 << 20)
+
+/* how a queued sidecar gets written */
+#define XMP_CREATE 0   /* the whole file, new or rewritten */
+#define XMP_IN_PLACE 1 /* just the gps block, over one the same size */
+
+/* a sidecar waiting to be written: its path and data sit in the writer's buffer */
+typedef struct
+{
+    size_t path;          /* offset of the path in the buffer */
+    size_t data;          /* offset of the bytes to write */
+    unsigned int32 len;
+    unsigned int32 offset; /* where in the file they go, for XMP_IN_PLACE */
+    int how;
+    int* status;          /* set to TAG_SKIPPED if the write fails */
+} xmp_pending_t;
+
+/*
+ * one worker's queue of sidecars. laying out a sidecar only reads; the
+ * writes are saved up and done XMP_BATCH at a time, each sidecar with a
+ * single write from one buffer.
+ */
+typedef struct
+{
+    char* buf;
+    size_t len;
+    size_t capacity;
+    xmp_pending_t pending[XMP_BATCH];
+    int count;
+    stats_t* stats;       /* may be NULL */
+} xmp_writer_t;
+
+void xmp_writer_init(xmp_writer_t* w, stats_t* stats);
+void xmp_writer_free(xmp_writer_t* w);
+int xmp_sidecar_path(const char* raw_path, char* buf, size_t n);
+unsigned int32 xmp_gps_block(const location_t* loc, char* buf, size_t n);
+int xmp_queue(xmp_writer_t* w, const char* raw_path, const location_t* loc, int* status);
+int xmp_flush(xmp_writer_t* w);
+
+#endif